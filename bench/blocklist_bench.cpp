@@ -0,0 +1,124 @@
+// Compares the label-boundary hash lookup in src/blocklist.cpp with the
+// previous linear scan over a std::set at 1k, 100k and 1M rules.
+//
+//   make bench && ./bench/blocklist_bench
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "blocklist.h"
+
+using namespace std;
+
+using Clock = chrono::steady_clock;
+
+static set<string> legacy_rules;
+
+// The implementation this replaced, kept verbatim for comparison
+static bool legacy_is_blocked(const string &host)
+{
+    string h = host;
+    transform(h.begin(), h.end(), h.begin(), [](unsigned char c)
+              { return tolower(c); });
+
+    for (const auto &rule : legacy_rules)
+    {
+        if (rule == h)
+            return true;
+
+        string suffix = "." + rule;
+        if (h.size() > suffix.size() && h.compare(h.size() - suffix.size(), suffix.size(), suffix) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static string rule_name(size_t i)
+{
+    return "site" + to_string(i * 7919 % 1000003) + ".example" + to_string(i % 50) + ".com";
+}
+
+// Half the hosts are subdomains of a rule, half miss
+static vector<string> make_hosts(size_t rules, size_t count)
+{
+    vector<string> hosts;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (i % 2 == 0)
+            hosts.push_back("WWW.cdn." + rule_name(i * 31 % rules));
+        else
+            hosts.push_back("www.unlisted" + to_string(i) + ".example.org");
+    }
+    return hosts;
+}
+
+template <typename Fn>
+static double ns_per_lookup(const vector<string> &hosts, size_t rounds, Fn fn, size_t &matches)
+{
+    matches = 0;
+    Clock::time_point start = Clock::now();
+
+    for (size_t r = 0; r < rounds; ++r)
+        for (const string &h : hosts)
+            matches += fn(h);
+
+    chrono::duration<double, nano> elapsed = Clock::now() - start;
+    return elapsed.count() / (rounds * hosts.size());
+}
+
+int main()
+{
+    const size_t sizes[] = {1000, 100000, 1000000};
+    string path = "/tmp/blocklist_bench_" + to_string(getpid()) + ".txt";
+
+    printf("%10s %16s %16s %10s\n", "rules", "linear ns/op", "hashed ns/op", "speedup");
+
+    for (size_t size : sizes)
+    {
+        ofstream out(path, ios::trunc);
+        for (size_t i = 0; i < size; ++i)
+        {
+            out << rule_name(i) << "\n";
+            legacy_rules.insert(rule_name(i));
+        }
+        out.close();
+
+        streambuf *saved = cout.rdbuf(nullptr); // silence the "[INFO] Loaded" line
+        load_blocklist(path);
+        cout.rdbuf(saved);
+
+        vector<string> hosts = make_hosts(size, 1000);
+
+        // The linear scan touches every rule, so give it fewer lookups at large sizes
+        size_t linear_hosts = max<size_t>(10, 10000000 / size);
+        vector<string> linear_sample(hosts.begin(), hosts.begin() + min(linear_hosts, hosts.size()));
+
+        size_t linear_matches, hashed_matches;
+        double linear = ns_per_lookup(linear_sample, 1, legacy_is_blocked, linear_matches);
+        double hashed = ns_per_lookup(hosts, 1000, is_blocked, hashed_matches);
+
+        size_t sample_matches;
+        ns_per_lookup(linear_sample, 1, is_blocked, sample_matches);
+        if (sample_matches != linear_matches)
+        {
+            fprintf(stderr, "mismatch at %zu rules: linear %zu, hashed %zu\n", size, linear_matches, sample_matches);
+            unlink(path.c_str());
+            return 1;
+        }
+
+        printf("%10zu %16.1f %16.1f %9.0fx\n", size, linear, hashed, linear / hashed);
+    }
+
+    unlink(path.c_str());
+    return 0;
+}
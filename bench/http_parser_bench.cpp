@@ -0,0 +1,308 @@
+// Compares the incremental parser in src/http_parser.cpp with the previous
+// rescanning implementation, on a whole request and on one arriving in pieces.
+//
+//   make bench && ./bench/http_parser_bench
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <strings.h>
+#include "http_parser.h"
+
+using namespace std;
+
+#define MAX_HEADER_SIZE 8192
+
+using Clock = chrono::steady_clock;
+
+// The implementation this replaced, kept verbatim for comparison
+static bool legacy_parse_port(const string &s, int &port)
+{
+    if (s.empty() || s.size() > 5)
+        return false;
+
+    for (char c : s)
+    {
+        if (c < '0' || c > '9')
+            return false;
+    }
+
+    port = atoi(s.c_str());
+    return port > 0 && port <= 65535;
+}
+
+// Case-insensitive check that a header line starts with "name:"
+static bool header_is(const string &data, size_t line_start, size_t line_end, const char *name)
+{
+    size_t n = strlen(name);
+    return line_end - line_start > n && data[line_start + n] == ':' &&
+           strncasecmp(data.c_str() + line_start, name, n) == 0;
+}
+
+static string header_value(const string &data, size_t line_start, size_t line_end)
+{
+    size_t colon = data.find(':', line_start);
+    size_t start = data.find_first_not_of(" \t", colon + 1);
+    if (start == string::npos || start >= line_end)
+        return "";
+
+    size_t end = line_end;
+    while (end > start && (data[end - 1] == ' ' || data[end - 1] == '\t'))
+        end--;
+
+    return data.substr(start, end - start);
+}
+
+// Connection-scoped headers that must not be forwarded to the next hop
+static bool is_hop_by_hop(const string &data, size_t line_start, size_t line_end)
+{
+    return header_is(data, line_start, line_end, "Connection") ||
+           header_is(data, line_start, line_end, "Proxy-Connection") ||
+           header_is(data, line_start, line_end, "Keep-Alive");
+}
+
+static bool parse_content_length(const string &value, size_t &length)
+{
+    if (value.empty() || value.size() > 18)
+        return false;
+
+    length = 0;
+    for (char c : value)
+    {
+        if (c < '0' || c > '9')
+            return false;
+        length = length * 10 + (c - '0');
+    }
+
+    return true;
+}
+
+static bool is_chunked(const string &value)
+{
+    return value.size() >= 7 && strcasecmp(value.c_str() + value.size() - 7, "chunked") == 0;
+}
+
+static ParseResult legacy_parse_http_request(const string &data, HttpRequest &req)
+{
+    // EARLY malformed request-line detection
+    size_t line_end = data.find("\r\n");
+    if (line_end != string::npos)
+    {
+        size_t m1 = data.find(' ');
+        size_t m2 = (m1 == string::npos) ? string::npos : data.find(' ', m1 + 1);
+
+        if (m1 == string::npos || m2 == string::npos || m2 > line_end)
+            return PARSE_ERROR;
+    }
+
+    // Wait until full headers are received
+    size_t header_end = data.find("\r\n\r\n");
+    if (header_end == string::npos)
+        return data.size() > MAX_HEADER_SIZE ? PARSE_ERROR : PARSE_INCOMPLETE;
+
+    if (header_end + 4 > MAX_HEADER_SIZE)
+        return PARSE_ERROR;
+
+    req.header_length = header_end + 4;
+
+    string request_line = data.substr(0, line_end);
+    size_t m1 = request_line.find(' ');
+    size_t m2 = request_line.find(' ', m1 + 1);
+
+    req.method = request_line.substr(0, m1);
+    string uri = request_line.substr(m1 + 1, m2 - m1 - 1);
+    req.http11 = request_line.compare(m2 + 1, string::npos, "HTTP/1.0") != 0;
+
+    req.port = 80;
+
+    if (req.method == "CONNECT")
+    {
+        size_t colon = uri.find(':');
+        if (colon == string::npos)
+            return PARSE_ERROR;
+
+        req.host = uri.substr(0, colon);
+        if (!legacy_parse_port(uri.substr(colon + 1), req.port))
+            return PARSE_ERROR;
+        return PARSE_OK;
+    }
+
+    if (uri.find("http://") == 0)
+    {
+        string rest = uri.substr(7);
+        size_t slash = rest.find('/');
+        string host_port = (slash == string::npos) ? rest : rest.substr(0, slash);
+        req.path = (slash == string::npos) ? "/" : rest.substr(slash);
+
+        size_t colon = host_port.find(':');
+        req.host = host_port.substr(0, colon);
+        if (colon != string::npos && !legacy_parse_port(host_port.substr(colon + 1), req.port))
+            return PARSE_ERROR;
+    }
+    else
+    {
+        // Absolute path
+        req.path = uri;
+
+        size_t host_pos = data.find("\r\nHost:");
+        if (host_pos == string::npos || host_pos > header_end)
+            return PARSE_ERROR;
+
+        size_t start_h = host_pos + 7;
+        size_t end_h = data.find("\r\n", start_h);
+
+        string host_port = data.substr(start_h, end_h - start_h); // get the host name
+        while (!host_port.empty() && host_port[0] == ' ')         // erase any spaces if present
+            host_port.erase(0, 1);
+
+        size_t colon = host_port.find(':');
+        if (colon != string::npos)
+        {
+            req.host = host_port.substr(0, colon);
+            if (!legacy_parse_port(host_port.substr(colon + 1), req.port)) // get the port after the colon
+                return PARSE_ERROR;
+        }
+        else
+        {
+            req.host = host_port;
+        }
+    }
+
+    if (req.host.empty())
+        return PARSE_ERROR;
+
+    // Keep the client's HTTP version so 1.0 clients never receive chunked responses
+    string rewritten = req.method + " " + req.path + (req.http11 ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+
+    req.keep_alive = req.http11;
+    req.body = BodyFraming();
+
+    bool has_length = false, chunked = false;
+    size_t length = 0;
+
+    size_t pos = line_end + 2;
+    while (pos < header_end + 2)
+    {
+        size_t eol = data.find("\r\n", pos);
+
+        if (header_is(data, pos, eol, "Connection") || header_is(data, pos, eol, "Proxy-Connection"))
+        {
+            string value = header_value(data, pos, eol);
+            if (strcasecmp(value.c_str(), "close") == 0)
+                req.keep_alive = false;
+            else if (strcasecmp(value.c_str(), "keep-alive") == 0)
+                req.keep_alive = true;
+        }
+        else if (header_is(data, pos, eol, "Content-Length"))
+        {
+            if (!parse_content_length(header_value(data, pos, eol), length))
+                return PARSE_ERROR;
+            has_length = true;
+        }
+        else if (header_is(data, pos, eol, "Transfer-Encoding"))
+        {
+            chunked = is_chunked(header_value(data, pos, eol));
+        }
+
+        if (!is_hop_by_hop(data, pos, eol))
+            rewritten.append(data, pos, eol + 2 - pos);
+        pos = eol + 2;
+    }
+
+    if (chunked)
+    {
+        req.body.kind = BodyKind::CHUNKED;
+        req.body.chunk_state = 0;
+    }
+    else if (has_length && length > 0)
+    {
+        req.body.kind = BodyKind::LENGTH;
+        req.body.remaining = length;
+    }
+
+    req.body.done = req.body.kind == BodyKind::NONE;
+
+    rewritten += "Connection: keep-alive\r\n\r\n"; // lets the upstream pool reuse the connection
+    req.raw_request = rewritten;
+
+    return PARSE_OK;
+}
+
+static const string REQUEST =
+    "GET /static/js/app.bundle.min.js?v=20260117 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: https://www.example.com/products/catalogue/page/3\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; consent=1; ab=variant-b\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n";
+
+// Feeds REQUEST in chunk-byte reads, parsing after each one as the proxy does
+template <typename Parse>
+static double ns_per_request(Parse parse, size_t chunk, size_t rounds)
+{
+    string buffer;
+    buffer.reserve(REQUEST.size());
+    size_t ok = 0;
+
+    Clock::time_point start = Clock::now();
+
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        HttpRequest req;
+        buffer.clear();
+
+        for (size_t pos = 0; pos < REQUEST.size(); pos += chunk)
+        {
+            buffer.append(REQUEST, pos, chunk);
+            if (parse(buffer, req) == PARSE_OK)
+                ok++;
+        }
+    }
+
+    chrono::duration<double, nano> elapsed = Clock::now() - start;
+
+    if (ok != rounds)
+    {
+        fprintf(stderr, "parse failed\n");
+        exit(1);
+    }
+
+    return elapsed.count() / rounds;
+}
+
+int main()
+{
+    const size_t chunks[] = {REQUEST.size(), 256, 64};
+    const size_t rounds = 200000;
+
+    // Both parsers must agree on what goes upstream
+    HttpRequest a, b;
+    legacy_parse_http_request(REQUEST, a);
+    parse_http_request(REQUEST, b);
+    if (a.raw_request != b.raw_request || a.host != b.host || a.port != b.port || a.path != b.path)
+    {
+        fprintf(stderr, "parsers disagree\n");
+        return 1;
+    }
+
+    printf("%8s %16s %16s %10s\n", "read", "old ns/request", "new ns/request", "speedup");
+
+    for (size_t chunk : chunks)
+    {
+        double old_ns = ns_per_request(legacy_parse_http_request, chunk, rounds);
+        double new_ns = ns_per_request(parse_http_request, chunk, rounds);
+
+        printf("%7zuB %16.1f %16.1f %9.1fx\n", chunk, old_ns, new_ns, old_ns / new_ns);
+    }
+
+    return 0;
+}
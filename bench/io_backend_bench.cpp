@@ -0,0 +1,419 @@
+// Compares the epoll and io_uring EventLoop backends in src/event_loop.cpp: short
+// connections (accept, read a request, answer, close) and a one-way TCP relay through
+// the loop, reporting requests/s and the loop thread's CPU time per request and per GB.
+//
+//   make bench && ./bench/io_backend_bench [seconds per run] [GB relayed]
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "event_loop.h"
+
+using namespace std;
+
+#define CLIENT_THREADS 4
+#define RELAY_BUFFER 65536
+
+using Clock = chrono::steady_clock;
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+static double thread_cpu_seconds(thread &t)
+{
+    clockid_t clock;
+    timespec ts{};
+    if (pthread_getcpuclockid(t.native_handle(), &clock) == 0)
+        clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_listener(int &port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0 ||
+        getsockname(fd, (sockaddr *)&addr, &len) < 0)
+    {
+        perror("listener");
+        exit(1);
+    }
+
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connect_to(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Answers one request, then waits for the client to close
+class Responder : public EventHandler
+{
+public:
+    Responder(EventLoop &loop, int fd) : loop(loop)
+    {
+        channel.handler = this;
+        channel.fd = fd;
+    }
+
+    Channel channel;
+
+    void on_event(Channel *, uint32_t) override
+    {
+        char buf[512];
+        while (true)
+        {
+            ssize_t n = recv(channel.fd, buf, sizeof(buf), 0);
+            if (n > 0)
+            {
+                received += n;
+                if (received == sizeof(request) - 1)
+                    send(channel.fd, response, sizeof(response) - 1, MSG_NOSIGNAL);
+                continue;
+            }
+
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+
+            finish();
+            return;
+        }
+    }
+
+    void on_shutdown() override
+    {
+        finish();
+    }
+
+private:
+    void finish()
+    {
+        if (channel.fd < 0)
+            return;
+
+        loop.close_fd(channel.fd);
+        channel.fd = -1;
+        loop.detach(this);
+    }
+
+    EventLoop &loop;
+    size_t received = 0;
+};
+
+class Listener : public EventHandler
+{
+public:
+    Listener(EventLoop &loop, int fd) : loop(loop)
+    {
+        channel.handler = this;
+        channel.fd = fd;
+    }
+
+    Channel channel;
+
+    void on_event(Channel *, uint32_t) override
+    {
+        while (true)
+        {
+            int fd = accept4(channel.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+
+            serve(fd);
+        }
+    }
+
+    void on_accept(Channel *, int fd) override
+    {
+        serve(fd);
+    }
+
+    void on_shutdown() override
+    {
+        loop.close_fd(channel.fd);
+        loop.detach(this);
+    }
+
+private:
+    void serve(int fd)
+    {
+        auto responder = make_shared<Responder>(loop, fd);
+        loop.attach(responder);
+        loop.add_fd(&responder->channel, EPOLLIN | EPOLLRDHUP | EPOLLET);
+    }
+
+    EventLoop &loop;
+};
+
+// Clients send one request per connection and close with a reset, so neither side
+// accumulates TIME_WAIT sockets over a run
+static void connections(IoBackend backend, double seconds)
+{
+    EventLoop loop(backend);
+    int port;
+    int fd = open_listener(port);
+
+    auto listener = make_shared<Listener>(loop, fd);
+    loop.attach(listener);
+    if (!loop.accept_fd(&listener->channel))
+        loop.add_fd(&listener->channel, EPOLLIN | EPOLLET);
+
+    thread runner(&EventLoop::run, &loop);
+
+    atomic<long> served{0};
+    auto deadline = Clock::now() + chrono::duration<double>(seconds);
+    auto start = Clock::now();
+    double cpu_start = thread_cpu_seconds(runner);
+
+    vector<thread> clients;
+    for (int i = 0; i < CLIENT_THREADS; ++i)
+    {
+        clients.emplace_back([port, deadline, &served]()
+                             {
+            char buf[256];
+            linger reset{1, 0};
+
+            while (Clock::now() < deadline)
+            {
+                int fd = connect_to(port);
+                if (fd < 0)
+                    continue;
+
+                send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL);
+
+                size_t got = 0;
+                while (got < sizeof(response) - 1)
+                {
+                    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+                    if (n <= 0)
+                        break;
+                    got += n;
+                }
+
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+                close(fd);
+
+                if (got == sizeof(response) - 1)
+                    served.fetch_add(1, memory_order_relaxed);
+            } });
+    }
+    for (thread &t : clients)
+        t.join();
+
+    double wall = chrono::duration<double>(Clock::now() - start).count();
+    double cpu = thread_cpu_seconds(runner) - cpu_start;
+
+    loop.stop();
+    runner.join();
+
+    printf("%-9s connections   %9.0f requests/s   loop CPU %6.2f us/request\n",
+           backend == IoBackend::EPOLL ? "epoll" : "io_uring", served / wall, cpu * 1e6 / served);
+}
+
+// Copies everything from in to out, then closes both
+class Relay : public EventHandler
+{
+public:
+    Relay(EventLoop &loop, int in_fd, int out_fd) : loop(loop), buf(RELAY_BUFFER)
+    {
+        in.handler = this;
+        in.fd = in_fd;
+        out.handler = this;
+        out.fd = out_fd;
+    }
+
+    Channel in;
+    Channel out;
+
+    void on_event(Channel *, uint32_t) override
+    {
+        while (in.fd >= 0)
+        {
+            if (offset < length)
+            {
+                ssize_t n = send(out.fd, buf.data() + offset, length - offset, MSG_NOSIGNAL);
+                if (n < 0)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        finish();
+                    return;
+                }
+                offset += n;
+                continue;
+            }
+
+            ssize_t n = recv(in.fd, buf.data(), buf.size(), 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n <= 0)
+            {
+                finish();
+                return;
+            }
+
+            offset = 0;
+            length = n;
+        }
+    }
+
+    void on_shutdown() override
+    {
+        finish();
+    }
+
+private:
+    void finish()
+    {
+        if (in.fd < 0)
+            return;
+
+        loop.close_fd(in.fd);
+        loop.close_fd(out.fd);
+        in.fd = -1;
+        out.fd = -1;
+        loop.detach(this);
+    }
+
+    EventLoop &loop;
+    vector<char> buf;
+    size_t offset = 0;
+    size_t length = 0;
+};
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Connected pair of blocking TCP sockets over loopback
+static void tcp_pair(int &connected, int &accepted)
+{
+    int port;
+    int listener = open_listener(port);
+
+    connected = connect_to(port);
+    do
+        accepted = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    while (accepted < 0 && errno == EAGAIN);
+
+    close(listener);
+}
+
+// source -> [loop] -> sink, all over loopback TCP
+static void relay(IoBackend backend, double gigabytes)
+{
+    EventLoop loop(backend);
+
+    int source, relay_in, relay_out, sink;
+    tcp_pair(source, relay_in);
+    tcp_pair(relay_out, sink);
+
+    set_nonblocking(relay_in);
+    set_nonblocking(relay_out);
+
+    auto handler = make_shared<Relay>(loop, relay_in, relay_out);
+    loop.attach(handler);
+    loop.add_fd(&handler->in, EPOLLIN | EPOLLRDHUP | EPOLLET);
+    loop.add_fd(&handler->out, EPOLLOUT | EPOLLET);
+
+    thread runner(&EventLoop::run, &loop);
+
+    long long total = (long long)(gigabytes * (1LL << 30));
+    auto start = Clock::now();
+    double cpu_start = thread_cpu_seconds(runner);
+
+    thread writer([source, total]()
+                  {
+        vector<char> chunk(RELAY_BUFFER, 'x');
+        long long sent = 0;
+        while (sent < total)
+        {
+            ssize_t n = send(source, chunk.data(), min<long long>(chunk.size(), total - sent), MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        close(source); });
+
+    vector<char> chunk(RELAY_BUFFER);
+    long long received = 0;
+    while (true)
+    {
+        ssize_t n = recv(sink, chunk.data(), chunk.size(), 0);
+        if (n <= 0)
+            break;
+        received += n;
+    }
+
+    double wall = chrono::duration<double>(Clock::now() - start).count();
+    double cpu = thread_cpu_seconds(runner) - cpu_start;
+
+    writer.join();
+    close(sink);
+    loop.stop();
+    runner.join();
+
+    double gb = received / (double)(1LL << 30);
+    printf("%-9s relay         %9.2f GB/s          loop CPU %6.2f s/GB\n",
+           backend == IoBackend::EPOLL ? "epoll" : "io_uring", gb / wall, cpu / gb);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 2;
+    double gigabytes = argc > 2 ? atof(argv[2]) : 2;
+
+    {
+        EventLoop probe(IoBackend::IO_URING);
+        if (probe.backend() != IoBackend::IO_URING)
+        {
+            printf("io_uring is not available here; only epoll is measured\n");
+            connections(IoBackend::EPOLL, seconds);
+            relay(IoBackend::EPOLL, gigabytes);
+            return 0;
+        }
+    }
+
+    for (IoBackend backend : {IoBackend::EPOLL, IoBackend::IO_URING})
+        connections(backend, seconds);
+    for (IoBackend backend : {IoBackend::EPOLL, IoBackend::IO_URING})
+        relay(backend, gigabytes);
+
+    return 0;
+}
@@ -0,0 +1,435 @@
+// Closed-loop load generator for a running proxy: each of --concurrency clients sends one
+// request, waits for the whole response, and sends the next, until --duration runs out.
+// Prints one JSON object with requests/s, MB/s and latency percentiles, so runs can be
+// collected (see bench/load_test.sh) and compared.
+//
+//   get      GET http://<origin>/bytes/<n> through the proxy, on keep-alive connections
+//   connect  CONNECT <origin>, then --tunnel-requests GETs inside each tunnel; the
+//            handshake counts towards the first request's latency
+//   mixed    half of the clients do get, the other half connect
+//
+//   ./bench/load_gen --workload get --concurrency 16 --duration 5 --size 1024,65536
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define SOCKET_TIMEOUT_SEC 10
+#define MAX_HEADER_SIZE 16384
+
+using Clock = chrono::steady_clock;
+
+enum class Workload
+{
+    GET,
+    CONNECT,
+    MIXED
+};
+
+struct Options
+{
+    string proxy = "127.0.0.1:2205";
+    string origin = "127.0.0.1:18081";
+    Workload workload = Workload::GET;
+    int concurrency = 16;
+    double duration = 5;
+    double warmup = 0;
+    vector<long> sizes{1024};
+    int delay_ms = 0;
+    int tunnel_requests = 10;
+    string label;
+};
+
+static Options options;
+static sockaddr_in proxy_addr;
+
+// What one client thread saw; merged once every thread is done
+struct ClientStats
+{
+    vector<uint32_t> latencies_us;
+    long long body_bytes = 0;
+    long errors = 0;
+};
+
+static const char *workload_name(Workload workload)
+{
+    switch (workload)
+    {
+    case Workload::GET:
+        return "get";
+    case Workload::CONNECT:
+        return "connect";
+    default:
+        return "mixed";
+    }
+}
+
+static bool parse_address(const string &text, sockaddr_in &addr)
+{
+    size_t colon = text.rfind(':');
+    if (colon == string::npos)
+        return false;
+
+    addr = sockaddr_in{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(text.c_str() + colon + 1));
+    return inet_pton(AF_INET, text.substr(0, colon).c_str(), &addr.sin_addr) == 1;
+}
+
+static int connect_proxy()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    int one = 1;
+    timeval timeout{SOCKET_TIMEOUT_SEC, 0};
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool send_all(int fd, const string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Response head and framing of what read_response() consumed
+struct Response
+{
+    int status = 0;
+    long long body_bytes = 0;
+    bool close = false;    // the server ends the connection after this response
+    bool received = false; // any byte arrived; a keep-alive connection that closes before that is retried
+};
+
+static long long header_number(const string &head, const char *name)
+{
+    const char *at = strcasestr(head.c_str(), name);
+    return at ? atoll(at + strlen(name)) : -1;
+}
+
+// Reads one response, discarding the body. with_body is false for the answer to CONNECT.
+static bool read_response(int fd, bool with_body, Response &resp)
+{
+    static thread_local vector<char> buf(256 * 1024);
+    string head;
+    size_t end;
+
+    while ((end = head.find("\r\n\r\n")) == string::npos)
+    {
+        if (head.size() > MAX_HEADER_SIZE)
+            return false;
+
+        ssize_t n = recv(fd, buf.data(), with_body ? buf.size() : 1, 0); // a tunnel must not over-read
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        resp.received = true;
+        head.append(buf.data(), n);
+    }
+
+    long long extra = head.size() - (end + 4);
+    head.resize(end + 2);
+
+    if (head.compare(0, 5, "HTTP/") != 0 || head.find(' ') == string::npos)
+        return false;
+
+    resp.status = atoi(head.c_str() + head.find(' ') + 1);
+    resp.close = strcasestr(head.c_str(), "\r\nconnection: close") != nullptr;
+
+    if (!with_body)
+        return true;
+
+    long long length = header_number(head, "\r\ncontent-length:");
+    if (length < 0)
+        return false; // the stub always sends a length
+
+    resp.body_bytes = extra;
+    while (resp.body_bytes < length)
+    {
+        ssize_t n = recv(fd, buf.data(), min<long long>(buf.size(), length - resp.body_bytes), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        resp.body_bytes += n;
+    }
+
+    return resp.body_bytes == length;
+}
+
+static string request_path(long size)
+{
+    return "/bytes/" + to_string(size) + "?delay_ms=" + to_string(options.delay_ms);
+}
+
+// One exchange on fd; false on any failure, after which the connection is unusable
+static bool exchange(int fd, const string &request, Response &resp)
+{
+    return send_all(fd, request) && read_response(fd, true, resp);
+}
+
+static bool open_tunnel(int &fd)
+{
+    fd = connect_proxy();
+    if (fd < 0)
+        return false;
+
+    Response resp;
+    string request = "CONNECT " + options.origin + " HTTP/1.1\r\nHost: " + options.origin + "\r\n\r\n";
+    if (send_all(fd, request) && read_response(fd, false, resp) && resp.status == 200)
+        return true;
+
+    close(fd);
+    fd = -1;
+    return false;
+}
+
+static void run_client(int index, Clock::time_point record_from, Clock::time_point deadline, ClientStats &stats)
+{
+    bool tunnel = options.workload == Workload::CONNECT || (options.workload == Workload::MIXED && index % 2 == 1);
+
+    int fd = -1;
+    int tunnel_left = 0;
+    size_t next_size = index; // clients start at different sizes of the list
+
+    while (Clock::now() < deadline)
+    {
+        long size = options.sizes[next_size++ % options.sizes.size()];
+        auto start = Clock::now();
+        bool ok;
+        Response resp;
+
+        if (tunnel)
+        {
+            if (tunnel_left == 0)
+            {
+                if (fd >= 0)
+                    close(fd);
+
+                tunnel_left = options.tunnel_requests;
+                if (!open_tunnel(fd))
+                {
+                    tunnel_left = 0;
+                    stats.errors++;
+                    continue;
+                }
+            }
+
+            string request = "GET " + request_path(size) + " HTTP/1.1\r\nHost: " + options.origin + "\r\n\r\n";
+            ok = exchange(fd, request, resp);
+            tunnel_left--;
+        }
+        else
+        {
+            string request = "GET http://" + options.origin + request_path(size) + " HTTP/1.1\r\nHost: " +
+                             options.origin + "\r\n\r\n";
+
+            bool reused = fd >= 0;
+            if (!reused)
+                fd = connect_proxy();
+
+            ok = fd >= 0 && exchange(fd, request, resp);
+
+            // The proxy may close an idle or used-up connection just as it is reused
+            if (!ok && reused && !resp.received)
+            {
+                close(fd);
+                fd = connect_proxy();
+                resp = Response();
+                ok = fd >= 0 && exchange(fd, request, resp);
+            }
+        }
+
+        auto finished = Clock::now();
+        ok = ok && resp.status == 200;
+
+        if (!ok || resp.close)
+        {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            tunnel_left = 0;
+        }
+
+        if (start < record_from)
+            continue;
+
+        if (!ok)
+        {
+            stats.errors++;
+            continue;
+        }
+
+        stats.latencies_us.push_back(chrono::duration_cast<chrono::microseconds>(finished - start).count());
+        stats.body_bytes += resp.body_bytes;
+    }
+
+    if (fd >= 0)
+        close(fd);
+}
+
+// Nearest-rank percentile of sorted latencies, in milliseconds
+static double percentile(const vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+
+    size_t rank = (size_t)(p / 100 * sorted.size() + 0.999999);
+    rank = max<size_t>(1, min(rank, sorted.size()));
+    return sorted[rank - 1] / 1000.0;
+}
+
+static void report(const vector<ClientStats> &clients, double seconds)
+{
+    vector<uint32_t> latencies;
+    long long bytes = 0;
+    long errors = 0;
+
+    for (const ClientStats &stats : clients)
+    {
+        latencies.insert(latencies.end(), stats.latencies_us.begin(), stats.latencies_us.end());
+        bytes += stats.body_bytes;
+        errors += stats.errors;
+    }
+    sort(latencies.begin(), latencies.end());
+
+    string sizes;
+    for (long size : options.sizes)
+        sizes += (sizes.empty() ? "" : ", ") + to_string(size);
+
+    printf("{\"label\": \"%s\", \"workload\": \"%s\", \"concurrency\": %d, \"duration_sec\": %.2f, "
+           "\"response_bytes\": [%s], \"delay_ms\": %d, \"requests\": %zu, \"errors\": %ld, "
+           "\"requests_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+           "\"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p99_9\": %.3f, \"max\": %.3f}}\n",
+           options.label.c_str(), workload_name(options.workload), options.concurrency, seconds, sizes.c_str(),
+           options.delay_ms, latencies.size(), errors, latencies.size() / seconds, bytes / seconds / (1 << 20),
+           percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+           percentile(latencies, 99.9), latencies.empty() ? 0 : latencies.back() / 1000.0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [--proxy ip:port] [--origin ip:port] [--workload get|connect|mixed]\n"
+            "          [--concurrency n] [--duration sec] [--warmup sec] [--size bytes[,bytes...]]\n"
+            "          [--delay ms] [--tunnel-requests n] [--label text]\n",
+            name);
+    exit(2);
+}
+
+static void parse_options(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        string key = argv[i];
+        if (i + 1 >= argc)
+            usage(argv[0]);
+        string value = argv[++i];
+
+        if (key == "--proxy")
+            options.proxy = value;
+        else if (key == "--origin")
+            options.origin = value;
+        else if (key == "--workload" && value == "get")
+            options.workload = Workload::GET;
+        else if (key == "--workload" && value == "connect")
+            options.workload = Workload::CONNECT;
+        else if (key == "--workload" && value == "mixed")
+            options.workload = Workload::MIXED;
+        else if (key == "--concurrency")
+            options.concurrency = atoi(value.c_str());
+        else if (key == "--duration")
+            options.duration = atof(value.c_str());
+        else if (key == "--warmup")
+            options.warmup = atof(value.c_str());
+        else if (key == "--delay")
+            options.delay_ms = atoi(value.c_str());
+        else if (key == "--tunnel-requests")
+            options.tunnel_requests = atoi(value.c_str());
+        else if (key == "--label")
+            options.label = value;
+        else if (key == "--size")
+        {
+            options.sizes.clear();
+            for (size_t at = 0; at < value.size(); at = value.find(',', at) + 1)
+            {
+                options.sizes.push_back(atol(value.c_str() + at));
+                if (value.find(',', at) == string::npos)
+                    break;
+            }
+        }
+        else
+            usage(argv[0]);
+    }
+
+    if (options.concurrency <= 0 || options.duration <= 0 || options.tunnel_requests <= 0 || options.sizes.empty())
+        usage(argv[0]);
+
+    if (!parse_address(options.proxy, proxy_addr))
+    {
+        fprintf(stderr, "load_gen: --proxy must be a numeric ip:port\n");
+        exit(2);
+    }
+
+    if (options.label.empty())
+        options.label = string(workload_name(options.workload)) + "-c" + to_string(options.concurrency);
+}
+
+int main(int argc, char **argv)
+{
+    parse_options(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    auto start = Clock::now();
+    auto record_from = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(options.warmup));
+    auto deadline = record_from + chrono::duration_cast<Clock::duration>(chrono::duration<double>(options.duration));
+
+    vector<ClientStats> clients(options.concurrency);
+    vector<thread> threads;
+    for (int i = 0; i < options.concurrency; ++i)
+        threads.emplace_back(run_client, i, record_from, deadline, ref(clients[i]));
+    for (thread &t : threads)
+        t.join();
+
+    // Requests still in flight at the deadline finish and count, so the window extends to them
+    double seconds = chrono::duration<double>(Clock::now() - record_from).count();
+    report(clients, seconds);
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#!/bin/sh
+# End-to-end load test on loopback: starts bench/origin_stub and the proxy (with a copy of
+# config/proxy.conf in a scratch directory), runs bench/load_gen over a matrix of workloads
+# and concurrency levels, and prints the results as one JSON array.
+#
+#   make all bench && ./bench/load_test.sh [seconds per run] > results.json
+#
+# LOAD_TEST_CONCURRENCY, LOAD_TEST_SIZES and LOAD_TEST_DELAY_MS override the matrix;
+# LOAD_TEST_CONF adds config lines (e.g. "io_backend = io_uring").
+
+set -e
+
+cd "$(dirname "$0")/.."
+ROOT=$(pwd)
+
+DURATION=${1:-5}
+CONCURRENCY=${LOAD_TEST_CONCURRENCY:-"1 16 64"}
+SIZES=${LOAD_TEST_SIZES:-"1024 65536 1048576"}
+DELAY_MS=${LOAD_TEST_DELAY_MS:-0}
+ORIGIN_PORT=18081
+PROXY_PORT=18080
+
+for binary in proxy bench/origin_stub bench/load_gen; do
+    if [ ! -x "$binary" ]; then
+        echo "load_test: $binary is missing; run make all bench first" >&2
+        exit 1
+    fi
+done
+
+WORK=$(mktemp -d)
+ORIGIN_PID=
+PROXY_PID=
+
+cleanup() {
+    [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null && wait "$PROXY_PID" 2>/dev/null
+    [ -n "$ORIGIN_PID" ] && kill "$ORIGIN_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+# Same settings as the shipped config, but on loopback ports of its own and with every
+# file it writes inside the scratch directory
+mkdir -p "$WORK/config/logs"
+cp config/blocked_sites.txt "$WORK/config/"
+sed -e "s/^listen_address = .*/listen_address = 127.0.0.1/" \
+    -e "s/^listen_port = .*/listen_port = $PROXY_PORT/" \
+    -e "s/^admin_port = .*/admin_port = 0/" \
+    config/proxy.conf > "$WORK/config/proxy.conf"
+[ -n "$LOAD_TEST_CONF" ] && printf '%s\n' "$LOAD_TEST_CONF" >> "$WORK/config/proxy.conf"
+
+"$ROOT/bench/origin_stub" $ORIGIN_PORT &
+ORIGIN_PID=$!
+(cd "$WORK" && exec "$ROOT/proxy" > proxy.out 2>&1) &
+PROXY_PID=$!
+sleep 1
+
+run() {
+    "$ROOT/bench/load_gen" --proxy 127.0.0.1:$PROXY_PORT --origin 127.0.0.1:$ORIGIN_PORT \
+        --duration "$DURATION" --warmup 1 --delay "$DELAY_MS" "$@"
+}
+
+echo "["
+first=1
+for workload in get connect mixed; do
+    for size in $SIZES; do
+        for clients in $CONCURRENCY; do
+            [ $first = 1 ] || echo ","
+            first=0
+            run --workload $workload --concurrency $clients --size $size \
+                --label "$workload-${size}B-c$clients" | tr -d '\n'
+        done
+    done
+done
+echo
+echo "]"
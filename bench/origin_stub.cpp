@@ -0,0 +1,175 @@
+// Local origin server for the load tests: answers GET /bytes/<n>?delay_ms=<d> with n bytes
+// after d milliseconds, on keep-alive HTTP/1.1 connections, one thread per connection.
+// Responses carry no freshness, so the proxy does not cache them unless max_age=<s> is
+// given. Tunnelled requests (CONNECT through the proxy) are served the same way.
+//
+//   ./bench/origin_stub <port>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+#define MAX_HEADER_SIZE 16384
+#define BODY_CHUNK (1024 * 1024)
+
+static char body_chunk[BODY_CHUNK];
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Value of name=<number> in the query string, or fallback
+static long query_number(const string &target, const char *name, long fallback)
+{
+    size_t query = target.find('?');
+    if (query == string::npos)
+        return fallback;
+
+    string key = string(name) + "=";
+    size_t at = target.find(key, query);
+    if (at == string::npos || (target[at - 1] != '?' && target[at - 1] != '&'))
+        return fallback;
+
+    return atol(target.c_str() + at + key.size());
+}
+
+static void respond(int fd, const string &target, bool close_after, bool &ok)
+{
+    long size = 0;
+    int status = 200;
+
+    if (target.compare(0, 7, "/bytes/") == 0)
+        size = atol(target.c_str() + 7);
+    else
+        status = 404;
+
+    long delay = query_number(target, "delay_ms", 0);
+    if (delay > 0)
+        this_thread::sleep_for(chrono::milliseconds(delay));
+
+    long max_age = query_number(target, "max_age", 0);
+
+    string head = "HTTP/1.1 " + string(status == 200 ? "200 OK" : "404 Not Found") + "\r\n"
+                  "Content-Type: application/octet-stream\r\n"
+                  "Content-Length: " + to_string(size) + "\r\n" +
+                  (max_age > 0 ? "Cache-Control: max-age=" + to_string(max_age) + "\r\n" : "") +
+                  (close_after ? "Connection: close\r\n" : "") + "\r\n";
+
+    ok = send_all(fd, head.data(), head.size());
+    while (ok && size > 0)
+    {
+        size_t n = min<long>(size, BODY_CHUNK);
+        ok = send_all(fd, body_chunk, n);
+        size -= n;
+    }
+}
+
+static void serve(int fd)
+{
+    string data;
+    char buf[16384];
+
+    while (true)
+    {
+        size_t end = data.find("\r\n\r\n");
+        if (end == string::npos)
+        {
+            if (data.size() > MAX_HEADER_SIZE)
+                break;
+
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+
+            data.append(buf, n);
+            continue;
+        }
+
+        // Request line: METHOD SP target SP version; bodies are not expected
+        size_t first = data.find(' ');
+        size_t second = first == string::npos ? string::npos : data.find(' ', first + 1);
+        if (second == string::npos)
+            break;
+
+        string target = data.substr(first + 1, second - first - 1);
+        string header = data.substr(0, end);
+        data.erase(0, end + 4);
+
+        bool close_after = header.find("HTTP/1.0") != string::npos || strcasestr(header.c_str(), "connection: close");
+
+        bool ok;
+        respond(fd, target, close_after, ok);
+        if (!ok || close_after)
+            break;
+    }
+
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(body_chunk, 'x', sizeof(body_chunk));
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[1]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0)
+    {
+        perror("origin_stub");
+        return 1;
+    }
+
+    while (true)
+    {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+            perror("accept");
+            return 1;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        thread(serve, fd).detach();
+    }
+}
@@ -0,0 +1,179 @@
+// Compares the work-stealing ThreadPool in src/thread_pool.cpp with the previous
+// single-queue pool under queue contention: many threads submitting tiny jobs,
+// and jobs that fan out into more jobs.
+//
+//   make bench && ./bench/thread_pool_bench
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <queue>
+#include "thread_pool.h"
+
+using namespace std;
+
+using Clock = chrono::steady_clock;
+
+// The implementation this replaced, kept verbatim for comparison
+class LegacyPool
+{
+public:
+    explicit LegacyPool(size_t size) : stop(false)
+    {
+        for (size_t i = 0; i < size; ++i)
+            workers.emplace_back(&LegacyPool::worker, this);
+    }
+
+    ~LegacyPool()
+    {
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            stop = true;
+        }
+        condition.notify_all();
+
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    void submit(function<void()> job)
+    {
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            jobs.push(move(job));
+        }
+        condition.notify_one();
+    }
+
+private:
+    void worker()
+    {
+        while (true)
+        {
+            function<void()> job;
+
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                condition.wait(lock, [this]
+                               { return stop || !jobs.empty(); });
+
+                if (stop && jobs.empty())
+                    return;
+
+                job = move(jobs.front());
+                jobs.pop();
+            }
+
+            job();
+        }
+    }
+
+    vector<thread> workers;
+    queue<function<void()>> jobs;
+
+    mutex queue_mutex;
+    condition_variable condition;
+    bool stop;
+};
+
+static atomic<long> done;
+static volatile long sink;
+
+// A few hundred nanoseconds of work, about what posting a resolved address back costs
+static void small_work(long seed)
+{
+    long x = seed;
+    for (int i = 0; i < 64; ++i)
+        x = x * 6364136223846793005L + 1442695040888963407L;
+    sink = x;
+    done.fetch_add(1, memory_order_relaxed);
+}
+
+static void wait_for(long jobs)
+{
+    while (done.load(memory_order_relaxed) < jobs)
+        this_thread::yield();
+}
+
+// producers threads each submit per_producer jobs
+template <typename Pool>
+static double contention(size_t workers, int producers, long per_producer)
+{
+    done = 0;
+    Pool pool(workers);
+
+    auto start = Clock::now();
+    vector<thread> threads;
+    for (int p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&pool, per_producer, p]()
+                             {
+            for (long i = 0; i < per_producer; ++i)
+                pool.submit([i, p]() { small_work(i + p); }); });
+    }
+    for (thread &t : threads)
+        t.join();
+
+    wait_for(producers * per_producer);
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+template <typename Pool>
+static void spawn(Pool &pool, int depth)
+{
+    small_work(depth);
+    if (depth == 0)
+        return;
+
+    pool.submit([&pool, depth]()
+                { spawn(pool, depth - 1); });
+    pool.submit([&pool, depth]()
+                { spawn(pool, depth - 1); });
+}
+
+// One root job that fans out into a binary tree of jobs
+template <typename Pool>
+static double fan_out(size_t workers, int depth)
+{
+    done = 0;
+    Pool pool(workers);
+
+    auto start = Clock::now();
+    pool.submit([&pool, depth]()
+                { spawn(pool, depth); });
+
+    wait_for((2L << depth) - 1);
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void report(const char *name, long jobs, double legacy, double stealing)
+{
+    printf("%-28s legacy %8.2f Mjobs/s   work-stealing %8.2f Mjobs/s   (%.2fx)\n", name,
+           jobs / legacy / 1e6, jobs / stealing / 1e6, legacy / stealing);
+}
+
+int main(int argc, char **argv)
+{
+    size_t workers = argc > 1 ? atoi(argv[1]) : 4;
+    long per_producer = 250000;
+    int depth = 19;
+
+    printf("%zu workers\n", workers);
+
+    for (int producers : {1, 4, 8})
+    {
+        double legacy = contention<LegacyPool>(workers, producers, per_producer);
+        double stealing = contention<ThreadPool>(workers, producers, per_producer);
+
+        char name[64];
+        snprintf(name, sizeof(name), "%d submitting threads", producers);
+        report(name, producers * per_producer, legacy, stealing);
+    }
+
+    double legacy = fan_out<LegacyPool>(workers, depth);
+    double stealing = fan_out<ThreadPool>(workers, depth);
+    report("fan-out (jobs submit jobs)", (2L << depth) - 1, legacy, stealing);
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef ADMIN_SERVER_H
+#define ADMIN_SERVER_H
+
+#include <string>
+
+using namespace std;
+
+// Serves GET /metrics (Prometheus text format) on its own thread, one short connection at a
+// time, so scrapes never run on the event loops. False if address:port cannot be bound.
+bool start_admin_server(const string &address, int port);
+
+void stop_admin_server();
+
+#endif
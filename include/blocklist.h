@@ -5,7 +5,17 @@
 
 using namespace std;
 
-bool load_blocklist(const string &filename);
+// Maps image_file if it is a valid compiled image newer than filename, otherwise parses filename
+// Builds a new immutable snapshot and publishes it; is_blocked() callers pick it up on their next call
+bool load_blocklist(const string &filename, const string &image_file = "");
+
+// Reloads the blocklist in the background whenever its files change or reload is requested
+void start_blocklist_watcher();
+
+// Async-signal-safe, meant for the SIGHUP handler
+void request_blocklist_reload();
+
+void stop_blocklist_watcher();
 
 bool is_blocked(const string &host);
 
@@ -0,0 +1,57 @@
+#ifndef BLOCKLIST_IMAGE_H
+#define BLOCKLIST_IMAGE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// Compiled blocklist: a read-only file that is mmap()ed as is.
+//
+//   header | Bloom filter (uint64 words) | hash slots (uint32) | strings
+//
+// Each slot holds 1 + the offset of a rule in the string area (0 = empty), and
+// each rule is stored as one length byte followed by its characters.
+struct BlocklistImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t rule_count;
+    uint32_t bloom_words; // power of two
+    uint32_t bloom_hashes;
+    uint32_t slot_count; // power of two, at least twice rule_count
+    uint32_t reserved;
+    uint64_t bloom_offset;
+    uint64_t slots_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct BlocklistImage
+{
+    const BlocklistImageHeader *header = nullptr;
+    const uint64_t *bloom = nullptr;
+    const uint32_t *slots = nullptr;
+    const unsigned char *strings = nullptr;
+    void *base = nullptr;
+    size_t size = 0;
+};
+
+// Reads a text blocklist: one domain per line, trimmed and lowercased, blank lines skipped
+bool read_blocklist_text(const string &filename, vector<string> &rules);
+
+// Writes rules (already normalised) as an image; false on an I/O error or a rule over 255 bytes
+bool write_blocklist_image(const vector<string> &rules, const string &filename);
+
+// Maps an image read-only; false if it is missing, truncated or of another version
+bool map_blocklist_image(const string &filename, BlocklistImage &image);
+
+void unmap_blocklist_image(BlocklistImage &image);
+
+// Exact lookup of one lowercased domain
+bool blocklist_image_contains(const BlocklistImage &image, string_view domain);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+
+using namespace std;
+
+#define BUFFER_CLASSES 4 // 4 KB, 16 KB, 64 KB and 256 KB
+
+struct BufferPoolStats
+{
+    size_t in_use_bytes;
+    size_t in_use[BUFFER_CLASSES]; // buffers handed out, by size class
+    size_t pooled_bytes;           // free buffers kept for reuse, across all threads
+    size_t reused;                 // requests served from a free list
+    size_t allocated;              // requests that had to allocate
+};
+
+// max_pooled_bytes: free buffers kept across all threads; anything released beyond it is freed
+void init_buffer_pool(size_t max_pooled_bytes);
+
+size_t buffer_class_size(int size_class);
+
+int buffer_class_for(size_t bytes); // smallest class that holds bytes, or -1 above the largest
+
+BufferPoolStats buffer_pool_stats();
+
+// One I/O buffer from the calling thread's free lists. Sizes above the largest class are
+// allocated exactly and never pooled. Released buffers go to the releasing thread's lists.
+class IoBuffer
+{
+public:
+    IoBuffer() = default;
+    ~IoBuffer() { release(); }
+
+    IoBuffer(IoBuffer &&other) noexcept;
+    IoBuffer &operator=(IoBuffer &&other) noexcept;
+
+    IoBuffer(const IoBuffer &) = delete;
+    IoBuffer &operator=(const IoBuffer &) = delete;
+
+    char *data() const { return ptr; }
+    size_t size() const { return capacity; }
+
+    void reset(size_t bytes);             // at least bytes of capacity; the contents are dropped
+    void grow(size_t bytes, size_t keep); // at least bytes of capacity, keeping the first keep bytes
+    void release();
+
+private:
+    char *ptr = nullptr;
+    size_t capacity = 0;
+};
+
+#endif
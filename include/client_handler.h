@@ -2,7 +2,12 @@
 #define CLIENT_HANDLER_H
 
 #include "task.h"
+#include "event_loop.h"
 
-void handle_client(const Task &task);
+// Registers the accepted client socket with loop; the connection runs as a state machine from there
+void handle_client(EventLoop &loop, const Task &task);
+
+// Client connections handled by any loop that have not been closed yet
+size_t open_connection_count();
 
 #endif
@@ -0,0 +1,87 @@
+#ifndef COLLAPSED_FORWARDING_H
+#define COLLAPSED_FORWARDING_H
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include "event_loop.h"
+
+using namespace std;
+
+// One piece of a response body shared by every connection following a fetch. Followers walk
+// the chain and drop their reference as they go, so chunks everyone has sent are freed.
+struct FlightChunk
+{
+    string data;
+    size_t end = 0;               // body bytes up to the end of this chunk
+    shared_ptr<FlightChunk> next; // set once and cleared once, under the flight's lock
+
+    // Frees the rest of the chain one link at a time instead of recursing once per chunk
+    ~FlightChunk()
+    {
+        shared_ptr<FlightChunk> rest = move(next);
+        while (rest && rest.use_count() == 1)
+            rest = move(rest->next);
+    }
+};
+
+enum class FlightState
+{
+    WAITING_HEAD, // the leader has not received the response header yet
+    STREAMING,
+    DONE,
+    FAILED // not shareable, or the leader lost its origin connection
+};
+
+// A follower waiting for the leader's next step; wake runs on loop's thread
+struct FlightWaiter
+{
+    EventLoop *loop;
+    function<void()> wake;
+};
+
+// One upstream fetch that concurrent identical requests attach to
+struct Flight
+{
+    string key;
+    mutex m;
+    FlightState state = FlightState::WAITING_HEAD;
+    string head;              // response head without Connection and the blank line
+    bool until_close = false; // body ends when the origin closes: followers close afterwards too
+    bool chunked = false;     // chunked body, which HTTP/1.0 followers cannot read
+    shared_ptr<FlightChunk> root; // empty chunk before the body; held while new followers may join
+    shared_ptr<FlightChunk> last;
+    deque<shared_ptr<FlightChunk>> window; // chunks less than the buffer limit behind last
+    size_t bytes = 0;
+    vector<FlightWaiter> waiters;
+};
+
+// max_buffered_bytes: how much of the body is kept for followers that join late
+void init_collapsed_forwarding(size_t max_buffered_bytes);
+
+// Attaches to the running fetch for key, or registers a new one that the caller leads.
+// A follower's cursor is set to the chunk before the body, which keeps the whole body reachable for it.
+shared_ptr<Flight> flight_join(const string &key, bool &leader, shared_ptr<FlightChunk> &cursor);
+
+// Leader: the response can be shared; followers start receiving it
+void flight_publish_head(Flight &flight, const string &head, bool until_close, bool chunked);
+
+// Leader: body bytes as they arrive from the origin
+void flight_append(Flight &flight, const char *data, size_t len);
+
+// Leader: the body is complete (ok) or the fetch cannot be shared or finished
+void flight_finish(Flight &flight, bool ok);
+
+// Follower: the flight's state; while it is WAITING_HEAD, wake runs once the leader moves on.
+// head, until_close and chunked may be read once the state is no longer WAITING_HEAD.
+FlightState flight_wait_head(Flight &flight, EventLoop &loop, function<void()> wake);
+
+// Follower: the chunk after cursor, or nullptr with the flight's state. Without a next chunk
+// in a STREAMING flight, wake runs once the leader appends or finishes. A follower that fell
+// more than the buffer limit behind finds the chain cut and gets FAILED.
+shared_ptr<FlightChunk> flight_next(Flight &flight, const FlightChunk &cursor, FlightState &state, EventLoop &loop, function<void()> wake);
+
+#endif
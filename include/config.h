@@ -9,15 +9,51 @@ struct Config
 {
     string listen_address = "";
     string blocklist_file = "";
+    string blocklist_image_file = ""; // compiled blocklist (make blocklist-image); empty to always parse the text file
     string log_file = "";
     string metrics_file = "";
+    int metrics_flush_interval_ms = 0;
+    string admin_address = ""; // listener for GET /metrics in the Prometheus format
+    int admin_port = -1;       // 0 disables it
     bool enable_blocklist = true;
     bool enable_https_tunnel = true;
     bool log_enabled = true;
+    bool enable_splice = true;
+    int io_buffer_pool_mb = -1; // free relay buffers kept for reuse across all loops
     int connection_timeout_sec;
+    int client_keepalive_timeout_sec = 0;
+    int client_max_requests = 0;
     int listen_port;
-    int thread_pool_size;
+    int thread_pool_size; // number of event loop threads
+    bool reuseport_listeners = false; // one SO_REUSEPORT listening socket per event loop instead of one shared acceptor
+    bool pin_worker_threads = false;  // pin each event loop thread to its own CPU
+    string io_backend = "";           // "epoll" or "io_uring" (falls back to epoll when unsupported)
+    int blocking_pool_size = 0;          // threads the blocking-work pool never shrinks below
+    int blocking_pool_max_size = -1;     // and never grows above
+    int blocking_pool_target_wait_ms = -1; // grow while jobs wait longer than this
+    int blocking_pool_idle_sec = -1;     // a thread idle this long exits
+    int tunnel_loops = -1; // event loops that only relay established CONNECT tunnels; 0 keeps tunnels on their loop
+    int max_connections = -1;         // open client connections across all loops; 0 for no limit
+    int max_accept_queue = -1;        // accepted connections handed to a loop but not yet started; 0 for no limit
+    int accept_queue_target_ms = -1;  // shed when hand-off delay stays above this for 100 ms (CoDel); 0 disables
+    int overload_retry_after_sec = -1; // Retry-After sent with the 503 when shedding
     size_t log_max_size_bytes;
+    int log_queue_size = 0;      // records buffered for the log writer thread
+    string log_full_policy = ""; // "drop" or "block" when the log queue is full
+    int upstream_pool_max_idle = -1; // idle origin connections kept per event loop
+    int upstream_pool_max_per_host = -1;
+    int upstream_pool_idle_ttl_sec = -1;
+    int dns_cache_max_entries = -1; // resolved host:port pairs kept in memory
+    int dns_cache_ttl_sec = -1;
+    int dns_negative_ttl_sec = -1; // how long a failed lookup is remembered
+    int response_cache_max_mb = -1; // memory for cached origin responses; 0 disables the cache
+    int response_cache_max_object_kb = -1;
+    string response_cache_dir = ""; // disk tier for responses above response_cache_max_object_kb; empty disables it
+    int response_cache_disk_max_mb = -1;
+    int response_cache_disk_max_object_mb = -1;
+    bool collapsed_forwarding = true;       // concurrent identical GETs share one origin fetch
+    int collapsed_forwarding_wait_sec = -1; // followers fetch on their own if no response header arrived by then
+    int collapsed_forwarding_buffer_kb = -1; // body kept for followers that join while the response streams; followers further behind are closed
 };
 
 bool load_config(const string &filename, Config &config);
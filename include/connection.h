@@ -0,0 +1,185 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <string>
+#include <cstring>
+#include <memory>
+#include <chrono>
+#include "buffer_pool.h"
+#include "event_loop.h"
+#include "http_parser.h"
+#include "response_cache.h"
+#include "collapsed_forwarding.h"
+
+using namespace std;
+
+enum class ConnState
+{
+    READING_HEADERS, // waiting for a complete request header from the client
+    RESOLVING,       // destination lookup running on the resolver pool
+    CONNECTING,      // non-blocking connect() to the destination in progress
+    RELAYING,        // moving bytes between client and destination
+    RESPONDING,      // flushing a proxy-generated response before closing
+    CLOSED
+};
+
+#define GROW_AFTER_FULL_READS 2 // reads that fill the whole buffer before the next size class is used
+
+// Bytes read from one socket that still have to be written to the other. The pooled buffer
+// is only held while bytes are in flight, so an idle connection holds none.
+struct RelayBuffer
+{
+    IoBuffer data;
+    size_t offset = 0;
+    size_t length = 0;
+    int read_class = 0; // size class for reads; grows while reads keep filling the buffer
+    int full_reads = 0;
+
+    bool empty() const { return offset >= length; }
+    size_t pending() const { return length - offset; }
+
+    void assign(const string &s)
+    {
+        offset = length = 0;
+        if (s.empty())
+        {
+            data.release();
+            return;
+        }
+
+        data.reset(s.size());
+        memcpy(data.data(), s.data(), s.size());
+        offset = 0;
+        length = s.size();
+    }
+
+    void append(const char *p, size_t n)
+    {
+        size_t kept = pending();
+        if (offset > 0 && kept > 0) // drop what was already written
+            memmove(data.data(), data.data() + offset, kept);
+
+        data.grow(kept + n, kept);
+        memcpy(data.data() + kept, p, n);
+        offset = 0;
+        length = kept + n;
+    }
+
+    // Empty buffer of the current read size
+    char *read_space(size_t &size)
+    {
+        data.reset(buffer_class_size(read_class));
+        size = data.size();
+        return data.data();
+    }
+
+    // After a read of n bytes into read_space(size)
+    void record_read(size_t n, size_t size)
+    {
+        full_reads = n == size ? full_reads + 1 : 0;
+        if (full_reads >= GROW_AFTER_FULL_READS && read_class + 1 < BUFFER_CLASSES)
+        {
+            read_class++;
+            full_reads = 0;
+        }
+    }
+
+    void release_if_empty()
+    {
+        if (empty())
+        {
+            data.release();
+            offset = length = 0;
+        }
+    }
+};
+
+// Kernel pipe used to splice() one direction without copying through user space
+struct SplicePipe
+{
+    int read_fd = -1;
+    int write_fd = -1;
+    size_t pending = 0; // bytes sitting in the pipe
+};
+
+// Per-socket edge-triggered readiness; cleared once the socket reports EAGAIN
+struct SocketState
+{
+    bool readable = false;
+    bool writable = false;
+    bool eof = false;
+};
+
+struct Connection : public EventHandler, public enable_shared_from_this<Connection>
+{
+    Connection(EventLoop &loop, int client_fd, const string &client_ip, int client_port);
+    ~Connection() override;
+
+    void on_event(Channel *channel, uint32_t events) override;
+    void on_tick(chrono::steady_clock::time_point now) override;
+
+    EventLoop &loop;
+
+    Channel client;
+    Channel upstream;
+    SocketState client_io;
+    SocketState upstream_io;
+
+    string client_ip;
+    int client_port;
+
+    ConnState state = ConnState::READING_HEADERS;
+    HttpRequest req;
+    string header_data; // client bytes not consumed yet, including pipelined requests
+
+    int requests_served = 0;
+    bool keep_client = false; // read the next request after this response instead of closing
+
+    RelayBuffer to_upstream;
+    RelayBuffer to_client;
+
+    bool reused_upstream = false; // upstream socket came from the keep-alive pool
+    bool response_parsed = false;
+    string response_head; // raw origin response header bytes until it is complete
+    HttpResponse resp;
+
+    bool use_splice = false; // falls back to the copy loop if the kernel refuses splice()
+    SplicePipe upstream_pipe; // client -> upstream
+    SplicePipe client_pipe;   // upstream -> client
+
+    shared_ptr<const CachedResponse> cache_hit; // sent from memory instead of asking the origin
+    string cache_tail;                          // Age and Connection headers that follow cache_hit->head
+    size_t cache_sent = 0;
+    shared_ptr<CachedResponse> cache_fill; // origin response being captured for the cache
+    const char *cache_status = nullptr;    // HIT or MISS for the access log; null if the cache was not consulted
+
+    shared_ptr<Flight> flight; // collapsed forwarding: the origin fetch this request leads or follows
+    bool flight_leader = false;
+    bool flight_head_sent = false;          // follower only, as are the two below
+    shared_ptr<FlightChunk> flight_cursor;  // chunk being sent
+    size_t flight_offset = 0;
+
+    bool forwarded = false; // request passed policy checks and went upstream
+    size_t bytes = 0;       // counted towards metrics_record_allowed
+    size_t body_bytes = 0;  // request body bytes sent upstream
+    bool tunnel_open = false; // counted in the open tunnels gauge
+    chrono::steady_clock::time_point deadline;
+    chrono::steady_clock::time_point request_start; // header complete, for the latency histograms
+    chrono::steady_clock::time_point connect_start; // connect() to the origin issued
+};
+
+// Moves the connection into CLOSED, closes both sockets and records the request
+void finish_connection(Connection &conn);
+
+// Records the finished request and goes back to reading the next one on the same client socket
+void next_request(Connection &conn);
+
+// The request body's chunked framing broke: drops the origin connection, which cannot know where
+// the body ends, and answers 400 unless part of a response already went to the client
+void reject_request_body(Connection &conn);
+
+// Hands a relaying connection over to target: a new Connection registered there takes its
+// sockets, pipes and buffers, and conn detaches from its own loop without closing anything
+void move_connection(Connection &conn, EventLoop &target);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include "response_cache.h"
+
+using namespace std;
+
+// Disk tier of the response cache. Each response is one content file in the cache directory:
+//
+//   DiskObjectHeader | key | vary (name \0 value \0 ...) | response head | body
+//
+// and index.bin, mmap()ed while the proxy runs, maps key hashes to content files.
+// The index is rebuilt from the content files when it is missing, corrupt, sized
+// for a different cap, or was not closed cleanly.
+struct DiskObjectHeader
+{
+    char magic[8];
+    uint32_t key_length;
+    uint32_t vary_length;
+    uint64_t head_length;
+    uint64_t body_length;
+    int64_t stored;
+    int64_t expires;
+    uint32_t chunked;
+    uint32_t reserved;
+};
+
+struct DiskIndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count; // power of two
+    uint32_t clean;      // 1 once the index was closed at shutdown
+    uint32_t reserved;
+    uint64_t next_file_id;
+};
+
+// Open-addressing slot; key_hash 0 is empty and 1 is a removed entry
+struct DiskIndexSlot
+{
+    uint64_t key_hash;
+    uint64_t file_id;
+    int64_t stored;
+    int64_t expires;
+    int64_t last_used; // for eviction; updated on hits
+    uint64_t size;     // bytes on disk
+    uint64_t check;    // mix of the fields above, to detect a torn or corrupt index
+    uint64_t reserved;
+};
+
+// Opens or creates dir and its index and starts the writer and eviction threads; false disables the tier.
+// Responses up to max_object_bytes are stored, within max_bytes in total.
+bool init_disk_cache(const string &dir, size_t max_bytes, size_t min_object_bytes, size_t max_object_bytes);
+
+// Finishes the queued writes, stops both threads and marks the index clean
+void stop_disk_cache();
+
+bool disk_cache_enabled();
+
+size_t disk_cache_max_object();
+
+// Entry whose head and body are ranges of an open content file; nullptr on a miss
+shared_ptr<CachedResponse> disk_cache_lookup(const string &key);
+
+// Empty entry for a capture. Captures are written by the tier's writer thread, so the event loops
+// only queue bytes; the entry is deleted on that thread too, after everything queued for it.
+shared_ptr<CachedResponse> disk_cache_new_capture();
+
+// Queues opening a temporary content file for entry and writing everything but the body
+bool disk_cache_begin(const string &key, CachedResponse &entry);
+
+// Queues body bytes; false past the object limit, or when the writer is too far behind to take them
+bool disk_cache_append(CachedResponse &entry, const char *data, size_t len);
+
+// Queues moving a complete capture into place and indexing it
+void disk_cache_store(const string &key, CachedResponse &entry);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+class EventHandler;
+class IoRing;
+
+enum class IoBackend
+{
+    EPOLL,
+    IO_URING // multishot poll and accept, submitted in batches with the wait; falls back to EPOLL
+};
+
+// One registered file descriptor; the backend hands the Channel back on every event
+struct Channel
+{
+    EventHandler *handler = nullptr;
+    int fd = -1;
+};
+
+class EventHandler
+{
+public:
+    virtual ~EventHandler() = default;
+
+    virtual void on_event(Channel *channel, uint32_t events) = 0;
+
+    virtual void on_accept(Channel *channel, int client_fd); // from accept_fd(); closes client_fd by default
+
+    virtual void on_tick(chrono::steady_clock::time_point) {} // called about once per second
+
+    virtual void on_shutdown() {} // the owning loop was asked to stop
+};
+
+class EventLoop
+{
+public:
+    explicit EventLoop(IoBackend backend = IoBackend::EPOLL);
+    ~EventLoop();
+
+    IoBackend backend() const { return ring ? IoBackend::IO_URING : IoBackend::EPOLL; }
+
+    void run(); // returns once stop() was called and every handler has detached
+
+    void stop(); // async-signal-safe
+
+    void post(function<void()> fn); // run fn on the loop thread
+
+    bool add_fd(Channel *channel, uint32_t events);
+
+    void remove_fd(int fd);
+
+    // Removes fd and closes it. io_uring keeps watched files open, so a plain close() is
+    // not enough to release a registered socket there
+    void close_fd(int fd);
+
+    // Delivers connections to channel's listening socket through on_accept(), with one multishot
+    // accept; false on the epoll backend, where the handler uses add_fd() and accept4()
+    bool accept_fd(Channel *channel);
+
+    void attach(shared_ptr<EventHandler> handler);
+
+    void detach(EventHandler *handler); // destroyed after the current iteration
+
+    // Runs fn about once per second on the loop thread; unlike handlers it does not keep the loop alive
+    void add_periodic(function<void(chrono::steady_clock::time_point)> fn);
+
+    // Loop thread only: time spent handling events, posted work and ticks so far, and attached handlers
+    chrono::steady_clock::duration busy_time() const { return busy; }
+    size_t handler_count() const { return handlers.size(); }
+
+private:
+    struct Watch; // an fd registered with io_uring
+
+    void run_posted();
+    void dispatch(Channel *channel, uint32_t events);
+    void reap();
+    bool arm(Watch *watch);
+    bool cancel(Watch *watch);
+
+    int epoll_fd;
+    int wake_fd;
+    Channel wake_channel;
+
+    atomic<bool> quit;
+    bool shutdown_notified;
+
+    mutex post_mutex;
+    vector<function<void()>> posted;
+
+    vector<function<void(chrono::steady_clock::time_point)>> periodic;
+
+    chrono::steady_clock::duration busy{0};
+
+    unordered_map<EventHandler *, shared_ptr<EventHandler>> handlers;
+    vector<shared_ptr<EventHandler>> graveyard;
+
+    unique_ptr<IoRing> ring;
+    unordered_map<int, Watch *> watches; // by fd
+    unordered_set<Watch *> cancelled;    // removed, freed once the kernel posts their last completion
+    vector<Watch *> unarmed;             // requests the kernel ended on an error, re-armed on the next tick
+    vector<Watch *> uncancelled;         // removed while the submission queue was full; cancelled before the next wait
+};
+
+#endif
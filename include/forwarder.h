@@ -1,13 +1,24 @@
 #ifndef FORWARDER_H
 #define FORWARDER_H
 
-#include <cstddef>
-#include "http_parser.h"
+#include "connection.h"
 
-size_t forward_tcp(int client_fd, const HttpRequest &req);
+// Starts HTTP forwarding of conn.req to the destination server
+void forward_tcp(Connection &conn);
 
-size_t tunnel_tcp(int client_fd, const HttpRequest &req);
+// Starts an HTTPS CONNECT tunnel to the destination server
+void tunnel_tcp(Connection &conn);
 
-bool send_all(int fd, const char *buf, size_t len);
+// Advances the upstream connect and moves whatever bytes the sockets allow
+void relay_data(Connection &conn);
+
+// Releases the splice() pipes of a finished connection
+void close_relay_pipes(Connection &conn);
+
+// Leaves a collapsed fetch; an unfinished one that conn leads fails for its followers
+void release_flight(Connection &conn);
+
+// The deadline passed while relaying: true if the forwarder took another route instead of closing
+bool relay_deadline_passed(Connection &conn);
 
 #endif
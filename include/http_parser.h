@@ -2,18 +2,106 @@
 #define HTTP_PARSER_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
 
 using namespace std;
 
+enum ParseResult
+{
+    PARSE_INCOMPLETE, // headers not fully received yet
+    PARSE_OK,
+    PARSE_ERROR
+};
+
+enum class BodyKind
+{
+    NONE,       // no body follows the header
+    LENGTH,     // Content-Length
+    CHUNKED,    // Transfer-Encoding: chunked
+    UNTIL_CLOSE // delimited by the origin closing the connection
+};
+
+// Tracks where a message body ends while its bytes stream past
+struct BodyFraming
+{
+    BodyKind kind = BodyKind::NONE;
+    size_t remaining = 0; // LENGTH: body bytes left, CHUNKED: bytes left in the current chunk
+    size_t chunk_size = 0;
+    int chunk_state = 0;
+    bool done = false;
+    bool strict = false;    // request body: broken chunked framing is an error instead of relaying until close
+    bool malformed = false; // strict only; no more bytes belong to the body
+};
+
+// Views into the buffer that was parsed; valid until that buffer is modified
+struct HttpHeader
+{
+    string_view name;
+    string_view value; // without surrounding whitespace
+};
+
+// Offsets of one header line; the buffer may still grow (and move) while the header arrives
+struct HeaderSpan
+{
+    uint32_t line_start;
+    uint32_t colon;
+    uint32_t line_end; // offset of the line's CR
+    uint8_t id;        // which of the headers the parser acts on, if any
+};
+
+// Where parse_http_request() stopped, so the next call only scans new bytes
+struct RequestScan
+{
+    size_t pos = 0;
+    size_t line_start = 0;
+    size_t colon = string::npos; // first ':' of the current line, once seen
+    size_t method_end = 0;
+    size_t uri_end = 0;
+    size_t request_line_end = 0; // 0 until the request line is complete
+    vector<HeaderSpan> spans;
+};
+
 struct HttpRequest
 {
     string method;
     string host;
     string path;
-    string raw_request;
+    string raw_request; // rewritten header for the origin: HTTP/1.x keep-alive, hop-by-hop headers removed
     int port;
+    bool http11 = true;
+    bool keep_alive = false;  // client asked to keep its connection open
+    size_t header_length = 0; // bytes of the client's header, including the blank line
+    BodyFraming body;
+    vector<HttpHeader> headers; // set once parsing succeeds
+    RequestScan scan;
+};
+
+struct HttpResponse
+{
+    int status = 0;
+    bool keep_alive = false; // origin allows another request on this connection
+    size_t header_length = 0;
+    string head; // status line and end-to-end headers, without Connection and the blank line
+    BodyFraming body;
 };
 
-bool parse_http_request(int client_fd, HttpRequest &req);
+// Incremental: call again with the same buffer after more bytes were appended.
+// req must be reset (req = HttpRequest()) before parsing a different buffer or the next request.
+ParseResult parse_http_request(const string &data, HttpRequest &req);
+
+// Case-insensitive header lookup on a parsed request; empty if absent
+string_view find_header(const HttpRequest &req, const char *name);
+
+ParseResult parse_http_response(const string &data, const string &request_method, HttpResponse &resp);
+
+// Consumes up to len body bytes and returns how many belong to the message; data may be
+// null for LENGTH and UNTIL_CLOSE bodies, whose end does not depend on content
+size_t advance_body(BodyFraming &body, const char *data, size_t len);
+
+// Largest read that cannot run past the end of the body
+size_t body_read_limit(const BodyFraming &body, size_t max);
 
 #endif
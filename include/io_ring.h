@@ -0,0 +1,61 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+using namespace std;
+
+// Minimal io_uring on the raw syscalls (no liburing): entries are queued in the shared
+// submission ring and handed to the kernel together with the next wait, so many operations
+// cost one io_uring_enter()
+class IoRing
+{
+public:
+    IoRing() = default;
+    ~IoRing();
+
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    // false when the kernel has no io_uring, it is disabled, or it predates multishot accept (5.19)
+    bool init(unsigned entries);
+
+    // The ring starts disabled so that it can be created on one thread and used on another;
+    // the thread that calls enable() is the only one that may submit afterwards
+    bool enable();
+
+    io_uring_sqe *get_sqe(); // zeroed; submits the queued entries first if the ring is full
+
+    // Submits the queued entries and runs completions; waits up to timeout_ms for one if none is ready
+    bool submit_and_wait(int timeout_ms);
+
+    io_uring_cqe *peek(); // next completion, or nullptr
+    void seen();          // consumes the completion peek() returned
+
+private:
+    bool submit(bool wait, int timeout_ms);
+
+    int ring_fd = -1;
+    bool disabled = false;
+
+    void *ring_mem = nullptr;
+    size_t ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    atomic<unsigned> *sq_head = nullptr;
+    atomic<unsigned> *sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_queued = 0; // local tail: entries filled in but not yet visible to the kernel
+
+    atomic<unsigned> *cq_head = nullptr;
+    atomic<unsigned> *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+};
+
+#endif
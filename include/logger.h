@@ -6,9 +6,12 @@
 
 using namespace std;
 
-void init_logger(const string &filename, size_t max_size_bytes);
+// Starts the writer thread. Records wait in a ring of queue_size slots; when it is full,
+// log_info() either drops the record (counted and reported in the log) or waits for space.
+void init_logger(const string &filename, size_t max_size_bytes, size_t queue_size, bool block_when_full);
 
-void log_info(const string &msg);
+// Never touches the file: the writer thread adds the timestamp and writes records in batches
+void log_info(string msg);
 
 void close_logger();
 
@@ -3,10 +3,15 @@
 
 #include <string>
 #include <cstddef>
+#include "buffer_pool.h"
 
 using namespace std;
 
-void init_metrics(const string &filename);
+// Recording only bumps per-thread counters; a background thread writes filename every interval_ms
+void init_metrics(const string &filename, int interval_ms);
+
+// Stops the background thread after a final write
+void stop_metrics();
 
 void metrics_record_request(const string &host);
 
@@ -14,4 +19,90 @@ void metrics_record_blocked();
 
 void metrics_record_allowed(size_t bytes);
 
+void metrics_record_request_body(size_t bytes);
+
+void metrics_record_upstream_pool(bool hit);
+
+void metrics_record_dns_hit();
+
+void metrics_record_dns_lookup(double millis);
+
+void metrics_record_response_cache_lookup(bool hit);
+
+void metrics_record_response_cache_evictions(size_t count);
+
+void metrics_record_response_cache_usage(size_t bytes, size_t entries);
+
+void metrics_record_response_cache_disk_usage(size_t bytes, size_t entries);
+
+// saved: a follower got the shared response; otherwise it fell back to its own fetch
+void metrics_record_collapsed(bool saved);
+
+// Blocking-work pool size and history, and queue wait percentiles since the last report
+void metrics_record_blocking_pool(size_t workers, size_t grown, size_t retired, double p50_ms, double p90_ms, double p99_ms);
+
+// Relay buffer pool usage, as of now
+void metrics_record_io_buffers(const BufferPoolStats &stats);
+
+enum class Lane
+{
+    HTTP,  // loops that accept clients and serve requests
+    TUNNEL // loops that only relay established CONNECT tunnels
+};
+
+// One loop's busy and elapsed time since its last report, and the change in its open connections
+void metrics_record_lane(Lane lane, size_t busy_micros, size_t wall_micros, long connections_delta);
+
+enum class ShedReason
+{
+    CONNECTION_LIMIT, // max_connections
+    QUEUE_LIMIT,      // max_accept_queue
+    QUEUE_DELAY       // accept_queue_target_ms
+};
+
+// Queue depth right after a hand-off; only the peak is kept from these
+void metrics_record_accept_queue(size_t depth);
+
+// Connections accepted and handed to a loop that has not started them yet; read when rendering
+void metrics_watch_accept_queue(size_t (*depth)());
+
+// Time between accept and the loop starting the connection
+void metrics_record_accept_wait(size_t micros);
+
+// A new client answered with 503 and closed
+void metrics_record_load_shed(ShedReason reason);
+
+void metrics_record_blocklist_load(size_t rules, double millis);
+
+enum class ProxyError
+{
+    BAD_REQUEST, // unparsable header, or none within connection_timeout_sec (answered with 400)
+    DNS,         // destination lookup failed
+    CONNECT,     // connecting to the destination failed
+    UPSTREAM,    // origin closed, reset or sent an invalid response before it was complete
+    TIMEOUT      // connection_timeout_sec passed while resolving, connecting or relaying
+};
+
+void metrics_record_error(ProxyError error);
+
+enum class Latency
+{
+    REQUEST,         // request header complete to response fully relayed; tunnels are not included
+    FIRST_BYTE,      // request header complete to the response header being queued for the client
+    UPSTREAM_CONNECT // connect() to the origin until it completed; reused pooled sockets are not included
+};
+
+// One relaxed increment of a log-linear histogram bucket in the calling thread's shard
+void metrics_record_latency(Latency which, size_t micros);
+
+// Open client connections across all loops; read whenever the metrics are rendered, because
+// snapshots pushed from several loop threads could land out of order
+void metrics_watch_connections(size_t (*open)());
+
+// An established CONNECT tunnel opened or closed
+void metrics_record_tunnel(bool opened);
+
+// Every metric in the Prometheus text exposition format (version 0.0.4); safe from any thread
+string metrics_prometheus();
+
 #endif
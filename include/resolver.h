@@ -0,0 +1,24 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <string>
+#include <functional>
+#include <netinet/in.h>
+#include "event_loop.h"
+
+using namespace std;
+
+// ok == false means the host could not be resolved
+using ResolveCallback = function<void(bool ok, const sockaddr_in &addr)>;
+
+// Lookups run on min_threads to max_threads threads; the pool grows while lookups queue up
+void init_resolver(size_t min_threads, size_t max_threads);
+
+void stop_resolver();
+
+// Resolves host:port off the event loop and runs done on loop's thread.
+// Answers are cached per host:port (including failures), and concurrent lookups of the same
+// host:port share one getaddrinfo() call. A cache hit runs done before returning.
+void resolve_async(EventLoop &loop, const string &host, int port, ResolveCallback done);
+
+#endif
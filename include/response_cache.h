@@ -0,0 +1,66 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <ctime>
+#include <sys/types.h>
+#include "http_parser.h"
+
+using namespace std;
+
+// One stored response. Hits share it, so it is sent without copying even if it is evicted meanwhile.
+// Disk-tier entries keep head and body in a content file instead, open for sendfile().
+struct CachedResponse
+{
+    string head;                       // status line and end-to-end headers, without Connection, Age and the blank line
+    string body;                       // framed as the origin sent it (Content-Length or chunked)
+    vector<pair<string, string>> vary; // request headers (lowercase name, value) the response was selected by
+    time_t stored = 0;
+    time_t expires = 0;
+    bool chunked = false;
+
+    int fd = -1; // disk tier only, from here on
+    off_t head_offset = 0;
+    size_t head_size = 0;
+    off_t body_offset = 0;
+    size_t body_size = 0;
+    string temp_path; // capture not published yet; removed if it is abandoned
+    bool on_disk = false;      // capture written by the disk tier's writer thread
+    bool write_failed = false; // writer thread only
+
+    CachedResponse() = default;
+    CachedResponse(const CachedResponse &) = delete;
+    CachedResponse &operator=(const CachedResponse &) = delete;
+    ~CachedResponse();
+};
+
+// max_bytes == 0 disables the cache
+void init_response_cache(size_t max_bytes, size_t max_object_bytes);
+
+bool response_cache_enabled();
+
+// method host:port path; the key for cached and collapsed responses
+string response_cache_key(const HttpRequest &req);
+
+// A bodiless GET without credentials, Range or If-* headers, whose response other clients may receive
+bool request_shareable(const HttpRequest &req);
+
+// The response may be sent to concurrent requests for the same key: a cacheable status, not private, no cookies, no Vary
+bool response_shareable(const HttpResponse &resp);
+
+// Fresh response for a GET, or nullptr. Requests with no-cache are always misses.
+shared_ptr<const CachedResponse> response_cache_lookup(const HttpRequest &req);
+
+// Starts capturing a response when its headers allow storing it; nullptr otherwise
+shared_ptr<CachedResponse> response_cache_begin(const HttpRequest &req, const HttpResponse &resp);
+
+// Adds body bytes to a capture; false once the response grew too large to be stored
+bool response_cache_append(CachedResponse &entry, const char *data, size_t len);
+
+// Publishes a complete capture, replacing any older response for the same request
+void response_cache_store(const HttpRequest &req, shared_ptr<CachedResponse> entry);
+
+#endif
@@ -1,8 +1,13 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "event_loop.h"
+
 void start_server(int port);
 
 void stop_server();
 
+// Loop for the next established CONNECT tunnel, round-robin; nullptr when tunnels stay on their loop
+EventLoop *tunnel_lane();
+
 #endif
@@ -2,6 +2,7 @@
 #define TASK_H
 
 #include <string>
+#include <chrono>
 
 using namespace std;
 
@@ -10,6 +11,7 @@ struct Task
     int client_fd;
     string client_ip;
     int client_port;
+    chrono::steady_clock::time_point accepted;
 };
 
 #endif
@@ -2,32 +2,141 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <cstdint>
 #include <condition_variable>
-
-#include "task.h"
+#include <functional>
 
 using namespace std;
 
+#define POOL_WAIT_BUCKETS 32
+#define POOL_WAIT_SAMPLE 16 // one job in this many is timed from submit to start
+
+struct PoolJob
+{
+    function<void()> fn;
+    chrono::steady_clock::time_point queued; // only on sampled jobs
+};
+
+// Chase-Lev work-stealing deque: the owning worker pushes and pops at the bottom without
+// locking, other workers steal from the top with one compare-and-swap
+class WorkDeque
+{
+public:
+    WorkDeque();
+
+    void push(PoolJob *job); // owner only
+    PoolJob *pop();          // owner only
+    PoolJob *steal();        // any thread
+
+private:
+    struct Ring
+    {
+        explicit Ring(int64_t capacity);
+
+        int64_t capacity;
+        unique_ptr<atomic<PoolJob *>[]> slots;
+
+        PoolJob *get(int64_t i) { return slots[i & (capacity - 1)].load(memory_order_relaxed); }
+        void put(int64_t i, PoolJob *job) { slots[i & (capacity - 1)].store(job, memory_order_relaxed); }
+    };
+
+    Ring *grow(Ring *ring, int64_t top, int64_t bottom);
+
+    alignas(64) atomic<int64_t> top;
+    alignas(64) atomic<int64_t> bottom;
+    atomic<Ring *> ring;
+    vector<unique_ptr<Ring>> rings; // outgrown rings stay alive while thieves may still read them
+};
+
+struct ThreadPoolStats
+{
+    size_t workers;
+    size_t grown;       // workers added since the pool started
+    size_t retired;     // idle workers that exited
+    double wait_p50_ms; // sampled queue wait of the jobs started since the previous report
+    double wait_p90_ms;
+    double wait_p99_ms;
+};
+
+struct ThreadPoolOptions
+{
+    size_t min_workers = 1;
+    size_t max_workers = 1;               // above min_workers the pool grows and shrinks
+    chrono::milliseconds target_wait{20}; // add a worker while jobs wait in the queue longer than this
+    chrono::seconds idle_timeout{30};     // a worker idle this long exits, down to min_workers
+    function<void(const ThreadPoolStats &)> report; // about once per second, on the pool's supervisor thread
+};
+
+// Runs blocking jobs (DNS lookups) so the event loops never wait on them.
+// Each worker owns a WorkDeque; idle workers steal from busy ones, spin briefly,
+// then park. Jobs submitted from outside the pool land in per-worker inboxes.
+// With max_workers above min_workers, a supervisor thread adds workers while jobs
+// wait too long, and workers idle for idle_timeout exit.
 class ThreadPool
 {
 public:
     explicit ThreadPool(size_t size);
-    ~ThreadPool();
+    explicit ThreadPool(const ThreadPoolOptions &options);
+    ~ThreadPool(); // runs every queued job, then joins the workers
 
-    void enqueue(Task task);
+    template <typename F>
+    void submit(F &&fn)
+    {
+        schedule(new PoolJob{function<void()>(std::forward<F>(fn)), {}});
+    }
 
 private:
-    void worker();
+    struct alignas(64) Worker
+    {
+        WorkDeque deque;
+        mutex inbox_mutex;
+        vector<PoolJob *> inbox;
+        vector<PoolJob *> batch;     // swapped with an inbox so neither side reallocates; owner only
+        atomic<bool> running{false}; // a thread serves this slot; idle slots are still stolen from
+        atomic<size_t> started{0};   // jobs its threads have started; written by the owner only
+    };
+
+    void schedule(PoolJob *job);
+    void worker(size_t index);
+    PoolJob *find_job(size_t index);
+    PoolJob *take_inbox(Worker &from, Worker &into);
+    void wake_helper(); // wakes one parked worker unless another is already searching
+    void record_start(const PoolJob &job);
+    void start_worker(); // park_mutex held
+    void supervise();
+    void report();
+
+    ThreadPoolOptions options;
+    vector<unique_ptr<Worker>> queues; // max_workers slots
+    vector<thread> workers;            // by slot; joined before the slot is reused
+
+    atomic<int64_t> pending; // submitted but not yet started
+    atomic<size_t> next;     // inbox for the next outside submission
+    atomic<int> spinning;    // workers looking for work before they park
+    atomic<int> sleeping;
+    atomic<bool> waking;     // a parked worker was signalled and has not started searching yet
+    int max_spinning;        // 0 on a single CPU, where spinning only delays the submitter
+
+    // Queue wait, for the supervisor
+    atomic<int64_t> longest_wait; // steady_clock ticks, among sampled jobs started since the supervisor last looked
+    atomic<size_t> wait_buckets[POOL_WAIT_BUCKETS]; // by log2 of the wait in microseconds
 
-    vector<thread> workers;
-    queue<Task> tasks;
+    mutex park_mutex; // also guards the sizing fields below
+    condition_variable park;
+    size_t active;
+    size_t grown;
+    size_t retired;
+    chrono::steady_clock::time_point last_grow;
 
-    mutex queue_mutex;
-    condition_variable condition;
-    bool stop;
+    thread supervisor;
+    mutex supervisor_mutex;
+    condition_variable supervisor_cv;
+    atomic<bool> stop;
 };
 
 #endif
@@ -0,0 +1,18 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <string>
+#include "event_loop.h"
+
+using namespace std;
+
+// Idle keep-alive connections to origin servers. Each event loop thread owns its own
+// pool, so these must only be called from the loop that uses the socket.
+
+// Returns an idle connected socket to host:port, or -1 when none is available
+int upstream_pool_acquire(EventLoop &loop, const string &host, int port);
+
+// Parks a socket whose last response was fully read; closes it if the pool is full
+void upstream_pool_release(EventLoop &loop, const string &host, int port, int fd);
+
+#endif
@@ -0,0 +1,162 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include "admin_server.h"
+#include "metrics.h"
+
+using namespace std;
+
+#define ADMIN_IO_TIMEOUT_SEC 2
+#define ADMIN_MAX_REQUEST 8192
+
+static int listen_fd = -1;
+static int stop_fd = -1; // eventfd that wakes the admin thread for shutdown
+static thread admin_thread;
+
+static void send_all(int fd, const string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        sent += n;
+    }
+}
+
+static string response(const string &status, const string &content_type, const string &body)
+{
+    return "HTTP/1.1 " + status + "\r\n"
+           "Content-Type: " + content_type + "\r\n"
+           "Content-Length: " + to_string(body.size()) + "\r\n"
+           "Connection: close\r\n"
+           "\r\n" + body;
+}
+
+// Reads one request header and answers it; the connection always closes afterwards
+static void serve(int fd)
+{
+    timeval timeout{ADMIN_IO_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.size() < ADMIN_MAX_REQUEST)
+    {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        request.append(buffer, n);
+    }
+
+    // Request line: METHOD SP target SP version
+    size_t method_end = request.find(' ');
+    size_t target_end = method_end == string::npos ? string::npos : request.find(' ', method_end + 1);
+    if (target_end == string::npos)
+    {
+        send_all(fd, response("400 Bad Request", "text/plain", "Bad Request\n"));
+        return;
+    }
+
+    string method = request.substr(0, method_end);
+    string target = request.substr(method_end + 1, target_end - method_end - 1);
+    string path = target.substr(0, target.find('?'));
+
+    if (path != "/metrics")
+        send_all(fd, response("404 Not Found", "text/plain", "Not Found\n"));
+    else if (method != "GET" && method != "HEAD")
+        send_all(fd, response("405 Method Not Allowed", "text/plain", "Method Not Allowed\n"));
+    else
+    {
+        string out = response("200 OK", "text/plain; version=0.0.4; charset=utf-8", metrics_prometheus());
+        if (method == "HEAD")
+            out.resize(out.find("\r\n\r\n") + 4);
+        send_all(fd, out);
+    }
+}
+
+static void admin_loop()
+{
+    pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+
+    while (true)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return;
+        }
+
+        if (fds[1].revents)
+            return;
+
+        int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd < 0)
+            continue;
+
+        serve(client_fd);
+        close(client_fd);
+    }
+}
+
+bool start_admin_server(const string &address, int port)
+{
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        perror("socket");
+        return false;
+    }
+
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+        bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0)
+    {
+        cerr << "[ERROR] Cannot listen for admin requests on " << address << ":" << port << endl;
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    admin_thread = thread(admin_loop);
+
+    cout << "[INFO] Serving metrics on http://" << address << ":" << port << "/metrics" << endl;
+    return true;
+}
+
+void stop_admin_server()
+{
+    if (!admin_thread.joinable())
+        return;
+
+    uint64_t one = 1;
+    ssize_t ignored = write(stop_fd, &one, sizeof(one));
+    (void)ignored;
+    admin_thread.join();
+
+    close(stop_fd);
+    close(listen_fd);
+    stop_fd = listen_fd = -1;
+}
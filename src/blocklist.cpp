@@ -1,70 +1,312 @@
-#include <fstream>
 #include <iostream>
-#include <set>
-#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+#include <string_view>
+#include <vector>
 #include <cctype>
+#include <cerrno>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "blocklist.h"
+#include "blocklist_image.h"
+#include "logger.h"
+#include "metrics.h"
 
 using namespace std;
 
-static set<string> blocked_rules; // Contains the blocked domains name in proper format
+#define MAX_HOST_LENGTH 256 // DNS names are at most 253 characters
 
-static void to_lowercase(string &s)
+// One immutable version of the rules. Readers keep it alive through a shared_ptr,
+// so a reload never frees rules that another thread is still looking at.
+struct BlocklistSnapshot
 {
-    transform(s.begin(), s.end(), s.begin(), [](unsigned char c)
-              { return tolower(c); });
+    deque<string> storage;            // owns the rule strings; a deque never moves them
+    unordered_set<string_view> rules; // Contains the blocked domains name in proper format
+    BlocklistImage image;             // used instead of rules when a compiled image is mapped
+    size_t rule_count = 0;
+    double load_ms = 0.0;
+
+    BlocklistSnapshot() = default;
+    BlocklistSnapshot(const BlocklistSnapshot &) = delete;
+    BlocklistSnapshot &operator=(const BlocklistSnapshot &) = delete;
+
+    ~BlocklistSnapshot()
+    {
+        unmap_blocklist_image(image);
+    }
+};
+
+// Published with atomic_store; generation tells readers when their cached copy is stale
+static shared_ptr<const BlocklistSnapshot> current;
+static atomic<uint64_t> generation{0};
+
+static thread_local shared_ptr<const BlocklistSnapshot> cached;
+static thread_local uint64_t cached_generation = 0;
+
+static string text_file;
+static string image_file;
+
+static thread watcher;
+static atomic<bool> watching{false};
+static int wake_fd = -1; // eventfd: SIGHUP and shutdown requests
+
+static bool load_text(const string &filename, BlocklistSnapshot &snapshot)
+{
+    vector<string> rules;
+    if (!read_blocklist_text(filename, rules))
+        return false;
+
+    for (string &rule : rules)
+    {
+        if (snapshot.rules.count(rule))
+            continue;
+
+        snapshot.storage.push_back(move(rule));
+        snapshot.rules.insert(snapshot.storage.back());
+    }
+
+    snapshot.rule_count = snapshot.rules.size();
+    return true;
 }
 
-bool load_blocklist(const string &filename)
+// The image is only trusted if it was compiled after the text file last changed
+static bool image_is_current(const string &filename, const string &image_file)
 {
-    ifstream file(filename);
-    if (!file.is_open())
+    struct stat text_st, image_st;
+
+    if (stat(image_file.c_str(), &image_st) < 0)
+        return false;
+
+    if (stat(filename.c_str(), &text_st) == 0 && text_st.st_mtime > image_st.st_mtime)
     {
-        cerr << "[ERROR] Could not open blocklist file: " << filename << endl;
+        cerr << "[WARN] Blocklist image " << image_file << " is older than " << filename << ", using the text file" << endl;
         return false;
     }
 
-    string line;
-    while (getline(file, line))
+    return true;
+}
+
+// Builds a complete snapshot off to the side; nullptr if neither file could be read
+static shared_ptr<BlocklistSnapshot> build_snapshot(const string &filename, const string &image_file)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    auto snapshot = make_shared<BlocklistSnapshot>();
+
+    bool loaded = false;
+    if (!image_file.empty() && image_is_current(filename, image_file))
+    {
+        loaded = map_blocklist_image(image_file, snapshot->image);
+        if (loaded)
+            snapshot->rule_count = snapshot->image.header->rule_count;
+        else
+            cerr << "[WARN] Invalid blocklist image " << image_file << ", using the text file" << endl;
+    }
+
+    if (!loaded && !load_text(filename, *snapshot))
+        return nullptr;
+
+    snapshot->load_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return snapshot;
+}
+
+static void publish(shared_ptr<const BlocklistSnapshot> snapshot)
+{
+    atomic_store(&current, move(snapshot));
+    generation.fetch_add(1, memory_order_release);
+}
+
+bool load_blocklist(const string &filename, const string &image)
+{
+    shared_ptr<BlocklistSnapshot> snapshot = build_snapshot(filename, image);
+    if (!snapshot)
+        return false;
+
+    text_file = filename;
+    image_file = image;
+
+    if (snapshot->image.base)
+        cout << "[INFO] Mapped " << snapshot->rule_count << " blocked domain rules from " << image << endl;
+    else
+        cout << "[INFO] Loaded " << snapshot->rule_count << " blocked domain rules" << endl; // log to the terminal
+
+    publish(move(snapshot));
+    return true;
+}
+
+static void reload()
+{
+    shared_ptr<BlocklistSnapshot> snapshot = build_snapshot(text_file, image_file);
+    if (!snapshot)
+    {
+        log_info("Blocklist reload failed, keeping the previous rules");
+        return;
+    }
+
+    size_t rules = snapshot->rule_count;
+    double ms = snapshot->load_ms;
+    publish(move(snapshot));
+
+    log_info("Blocklist reloaded: " + to_string(rules) + " rules in " + to_string(ms) + " ms");
+    metrics_record_blocklist_load(rules, ms);
+}
+
+static string dir_of(const string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? "." : path.substr(0, slash);
+}
+
+static string base_of(const string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+// Watches the directories holding the blocklist files, since editors and the image
+// compiler replace files by renaming over them, which would end a watch on the file itself
+static void watch_loop()
+{
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd >= 0)
+    {
+        uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO;
+        inotify_add_watch(inotify_fd, dir_of(text_file).c_str(), mask);
+        if (!image_file.empty() && dir_of(image_file) != dir_of(text_file))
+            inotify_add_watch(inotify_fd, dir_of(image_file).c_str(), mask);
+    }
+
+    string text_name = base_of(text_file);
+    string image_name = image_file.empty() ? "" : base_of(image_file);
+
+    while (watching)
     {
-        // Trim leading whitespace
-        line.erase(line.begin(), find_if(line.begin(), line.end(), [](unsigned char c)
-                                         { return !isspace(c); }));
+        pollfd fds[2] = {{wake_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+        int ready = poll(fds, inotify_fd >= 0 ? 2 : 1, -1);
+
+        if (ready < 0 && errno != EINTR)
+            break;
 
-        // Trim trailing whitespace
-        line.erase(find_if(line.rbegin(), line.rend(), [](unsigned char c)
-                           { return !isspace(c); })
-                       .base(),
-                   line.end());
+        bool changed = false;
 
-        if (!line.empty())
+        if (fds[0].revents & POLLIN)
         {
-            to_lowercase(line); // convert the blocked domain into lowercase
-            blocked_rules.insert(line);
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) == sizeof(count))
+                changed = true; // SIGHUP, or shutdown if watching was cleared
         }
+
+        if (inotify_fd >= 0 && (fds[1].revents & POLLIN))
+        {
+            alignas(inotify_event) char buffer[4096];
+            ssize_t n;
+
+            while ((n = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+            {
+                for (char *p = buffer; p < buffer + n; p += sizeof(inotify_event) + ((inotify_event *)p)->len)
+                {
+                    inotify_event *event = (inotify_event *)p;
+                    if (event->len > 0 && (text_name == event->name || image_name == event->name))
+                        changed = true;
+                }
+            }
+        }
+
+        if (changed && watching)
+            reload();
     }
 
-    cout << "[INFO] Loaded " << blocked_rules.size() << " blocked domain rules" << endl; // log to the terminal
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+}
 
-    return true;
+void start_blocklist_watcher()
+{
+    shared_ptr<const BlocklistSnapshot> snapshot = atomic_load(&current);
+    if (!snapshot)
+        return;
+
+    metrics_record_blocklist_load(snapshot->rule_count, snapshot->load_ms);
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0)
+        return;
+
+    watching = true;
+    watcher = thread(watch_loop);
 }
 
-bool is_blocked(const string &host)
+void request_blocklist_reload()
 {
-    string h = host;
-    to_lowercase(h);
+    if (wake_fd < 0)
+        return;
 
-    for (const auto &rule : blocked_rules)
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one)); // async-signal-safe
+    (void)ignored;
+}
+
+void stop_blocklist_watcher()
+{
+    if (!watcher.joinable())
+        return;
+
+    watching = false;
+    request_blocklist_reload();
+    watcher.join();
+
+    close(wake_fd);
+    wake_fd = -1;
+}
+
+static bool contains(const BlocklistSnapshot &snapshot, string_view domain)
+{
+    if (snapshot.image.base)
+        return blocklist_image_contains(snapshot.image, domain);
+    return snapshot.rules.count(domain) > 0;
+}
+
+// A host is blocked if it equals a rule or is a subdomain of one, so only the
+// suffixes that start at a label boundary need to be looked up
+bool is_blocked(const string &host)
+{
+    // Each thread keeps its own reference and only re-reads the shared pointer after a reload
+    uint64_t gen = generation.load(memory_order_acquire);
+    if (gen != cached_generation)
     {
-        if (rule == h)
-            return true;
+        cached = atomic_load(&current);
+        cached_generation = gen;
+    }
 
-        string suffix = "." + rule;
-        if (h.size() > suffix.size() && h.compare(h.size() - suffix.size(), suffix.size(), suffix) == 0)
-        {
+    if (!cached)
+        return false;
+
+    const BlocklistSnapshot &snapshot = *cached;
+    char buffer[MAX_HOST_LENGTH];
+
+    // Only the tail of an oversized host can match a rule
+    size_t start = host.size() > MAX_HOST_LENGTH ? host.size() - MAX_HOST_LENGTH : 0;
+    size_t length = host.size() - start;
+
+    for (size_t i = 0; i < length; ++i)
+        buffer[i] = tolower((unsigned char)host[start + i]);
+
+    string_view h(buffer, length);
+
+    if (start == 0 && contains(snapshot, h))
+        return true;
+
+    for (size_t i = (start == 0) ? 1 : 0; i < length; ++i) // a leading dot is not a subdomain boundary
+    {
+        if (buffer[i] == '.' && contains(snapshot, h.substr(i + 1)))
             return true;
-        }
     }
 
     return false;
-}
\ No newline at end of file
+}
@@ -0,0 +1,232 @@
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blocklist_image.h"
+
+using namespace std;
+
+#define IMAGE_MAGIC "PXBLIMG1"
+#define IMAGE_VERSION 1
+#define BLOOM_BITS_PER_RULE 10
+#define BLOOM_HASHES 7
+
+// FNV-1a; the two halves seed the Bloom filter's double hashing
+static uint64_t hash_domain(string_view s)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : s)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint32_t round_up_pow2(uint64_t n)
+{
+    uint32_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+static void bloom_positions(uint64_t h, uint32_t bloom_words, uint32_t hashes, uint64_t *out)
+{
+    uint64_t bits = (uint64_t)bloom_words * 64;
+    uint64_t h1 = h, h2 = (h >> 32) | 1;
+
+    for (uint32_t i = 0; i < hashes; ++i)
+        out[i] = (h1 + i * h2) & (bits - 1);
+}
+
+bool read_blocklist_text(const string &filename, vector<string> &rules)
+{
+    ifstream file(filename);
+    if (!file.is_open())
+    {
+        cerr << "[ERROR] Could not open blocklist file: " << filename << endl;
+        return false;
+    }
+
+    string line;
+    while (getline(file, line))
+    {
+        // Trim leading whitespace
+        line.erase(line.begin(), find_if(line.begin(), line.end(), [](unsigned char c)
+                                         { return !isspace(c); }));
+
+        // Trim trailing whitespace
+        line.erase(find_if(line.rbegin(), line.rend(), [](unsigned char c)
+                           { return !isspace(c); })
+                       .base(),
+                   line.end());
+
+        if (!line.empty())
+        {
+            // convert the blocked domain into lowercase
+            transform(line.begin(), line.end(), line.begin(), [](unsigned char c)
+                      { return tolower(c); });
+            rules.push_back(line);
+        }
+    }
+
+    return true;
+}
+
+bool write_blocklist_image(const vector<string> &input, const string &filename)
+{
+    vector<string> rules(input);
+    sort(rules.begin(), rules.end());
+    rules.erase(unique(rules.begin(), rules.end()), rules.end());
+
+    BlocklistImageHeader header{};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.rule_count = rules.size();
+    header.bloom_words = round_up_pow2(max<uint64_t>(1, rules.size() * BLOOM_BITS_PER_RULE / 64));
+    header.bloom_hashes = BLOOM_HASHES;
+    header.slot_count = round_up_pow2(max<uint64_t>(2, rules.size() * 2));
+
+    vector<uint64_t> bloom(header.bloom_words, 0);
+    vector<uint32_t> slots(header.slot_count, 0);
+    string strings;
+
+    for (const string &rule : rules)
+    {
+        if (rule.size() > 255)
+        {
+            cerr << "[ERROR] Blocklist rule longer than 255 characters: " << rule << endl;
+            return false;
+        }
+
+        uint64_t h = hash_domain(rule);
+
+        uint64_t positions[BLOOM_HASHES];
+        bloom_positions(h, header.bloom_words, header.bloom_hashes, positions);
+        for (uint64_t bit : positions)
+            bloom[bit / 64] |= 1ULL << (bit % 64);
+
+        // Linear probing; the table is at most half full
+        uint32_t slot = h & (header.slot_count - 1);
+        while (slots[slot] != 0)
+            slot = (slot + 1) & (header.slot_count - 1);
+        slots[slot] = strings.size() + 1;
+
+        strings.push_back((char)rule.size());
+        strings.append(rule);
+    }
+
+    header.bloom_offset = sizeof(header);
+    header.slots_offset = header.bloom_offset + bloom.size() * sizeof(uint64_t);
+    header.strings_offset = header.slots_offset + slots.size() * sizeof(uint32_t);
+    header.strings_size = strings.size();
+
+    ofstream out(filename, ios::binary | ios::trunc);
+    if (!out.is_open())
+    {
+        cerr << "[ERROR] Could not write blocklist image: " << filename << endl;
+        return false;
+    }
+
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)bloom.data(), bloom.size() * sizeof(uint64_t));
+    out.write((const char *)slots.data(), slots.size() * sizeof(uint32_t));
+    out.write(strings.data(), strings.size());
+
+    return out.good();
+}
+
+bool map_blocklist_image(const string &filename, BlocklistImage &image)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(BlocklistImageHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (base == MAP_FAILED)
+        return false;
+
+    const BlocklistImageHeader *header = (const BlocklistImageHeader *)base;
+    size_t size = st.st_size;
+
+    bool valid = memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == IMAGE_VERSION &&
+                 header->bloom_words > 0 && (header->bloom_words & (header->bloom_words - 1)) == 0 &&
+                 header->bloom_hashes > 0 && header->bloom_hashes <= BLOOM_HASHES &&
+                 header->slot_count > 0 && (header->slot_count & (header->slot_count - 1)) == 0 &&
+                 header->bloom_offset == sizeof(BlocklistImageHeader) &&
+                 header->slots_offset == header->bloom_offset + (uint64_t)header->bloom_words * sizeof(uint64_t) &&
+                 header->strings_offset == header->slots_offset + (uint64_t)header->slot_count * sizeof(uint32_t) &&
+                 header->strings_offset + header->strings_size == size;
+
+    if (!valid)
+    {
+        munmap(base, size);
+        return false;
+    }
+
+    image.header = header;
+    image.bloom = (const uint64_t *)((const char *)base + header->bloom_offset);
+    image.slots = (const uint32_t *)((const char *)base + header->slots_offset);
+    image.strings = (const unsigned char *)base + header->strings_offset;
+    image.base = base;
+    image.size = size;
+    return true;
+}
+
+void unmap_blocklist_image(BlocklistImage &image)
+{
+    if (image.base)
+        munmap(image.base, image.size);
+    image = BlocklistImage();
+}
+
+bool blocklist_image_contains(const BlocklistImage &image, string_view domain)
+{
+    const BlocklistImageHeader &header = *image.header;
+    uint64_t h = hash_domain(domain);
+
+    // Most lookups are misses; the Bloom filter answers them without touching the table
+    uint64_t positions[BLOOM_HASHES];
+    bloom_positions(h, header.bloom_words, header.bloom_hashes, positions);
+    for (uint32_t i = 0; i < header.bloom_hashes; ++i)
+    {
+        if (!(image.bloom[positions[i] / 64] & (1ULL << (positions[i] % 64))))
+            return false;
+    }
+
+    uint32_t mask = header.slot_count - 1;
+    for (uint32_t slot = h & mask, probes = 0; probes < header.slot_count; slot = (slot + 1) & mask, ++probes)
+    {
+        uint32_t entry = image.slots[slot];
+        if (entry == 0)
+            return false;
+
+        uint64_t offset = entry - 1;
+        if (offset >= header.strings_size)
+            return false; // corrupt image
+
+        size_t length = image.strings[offset];
+        if (offset + 1 + length > header.strings_size)
+            return false;
+
+        if (length == domain.size() && memcmp(image.strings + offset + 1, domain.data(), length) == 0)
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,177 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "buffer_pool.h"
+
+using namespace std;
+
+static const size_t class_sizes[BUFFER_CLASSES] = {4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024};
+
+static size_t max_pooled = 0;
+
+// Shared counters; the free lists themselves are per thread and take no lock
+static atomic<size_t> pooled_bytes{0};
+static atomic<size_t> in_use_count[BUFFER_CLASSES];
+static atomic<size_t> oversize_bytes{0};
+static atomic<size_t> reused{0};
+static atomic<size_t> allocated{0};
+
+// Free buffers of one thread, by size class; returned to the allocator when the thread exits
+struct ThreadBuffers
+{
+    vector<char *> free_lists[BUFFER_CLASSES];
+
+    ~ThreadBuffers()
+    {
+        for (int c = 0; c < BUFFER_CLASSES; ++c)
+        {
+            for (char *p : free_lists[c])
+                free(p);
+
+            pooled_bytes.fetch_sub(free_lists[c].size() * class_sizes[c], memory_order_relaxed);
+        }
+    }
+};
+
+static thread_local ThreadBuffers buffers;
+
+void init_buffer_pool(size_t max_pooled_bytes)
+{
+    max_pooled = max_pooled_bytes;
+}
+
+size_t buffer_class_size(int size_class)
+{
+    return class_sizes[size_class];
+}
+
+int buffer_class_for(size_t bytes)
+{
+    for (int c = 0; c < BUFFER_CLASSES; ++c)
+    {
+        if (bytes <= class_sizes[c])
+            return c;
+    }
+    return -1;
+}
+
+BufferPoolStats buffer_pool_stats()
+{
+    BufferPoolStats stats{};
+
+    stats.in_use_bytes = oversize_bytes.load(memory_order_relaxed);
+    for (int c = 0; c < BUFFER_CLASSES; ++c)
+    {
+        stats.in_use[c] = in_use_count[c].load(memory_order_relaxed);
+        stats.in_use_bytes += stats.in_use[c] * class_sizes[c];
+    }
+
+    stats.pooled_bytes = pooled_bytes.load(memory_order_relaxed);
+    stats.reused = reused.load(memory_order_relaxed);
+    stats.allocated = allocated.load(memory_order_relaxed);
+    return stats;
+}
+
+static char *take(size_t &bytes)
+{
+    int c = buffer_class_for(bytes);
+    if (c < 0)
+    {
+        oversize_bytes.fetch_add(bytes, memory_order_relaxed);
+        allocated.fetch_add(1, memory_order_relaxed);
+        return (char *)malloc(bytes);
+    }
+
+    bytes = class_sizes[c];
+    in_use_count[c].fetch_add(1, memory_order_relaxed);
+
+    vector<char *> &list = buffers.free_lists[c];
+    if (list.empty())
+    {
+        allocated.fetch_add(1, memory_order_relaxed);
+        return (char *)malloc(bytes);
+    }
+
+    char *p = list.back();
+    list.pop_back();
+    pooled_bytes.fetch_sub(bytes, memory_order_relaxed);
+    reused.fetch_add(1, memory_order_relaxed);
+    return p;
+}
+
+static void give_back(char *p, size_t bytes)
+{
+    int c = buffer_class_for(bytes);
+    if (c < 0)
+    {
+        oversize_bytes.fetch_sub(bytes, memory_order_relaxed);
+        free(p);
+        return;
+    }
+
+    in_use_count[c].fetch_sub(1, memory_order_relaxed);
+
+    if (pooled_bytes.load(memory_order_relaxed) + bytes > max_pooled)
+    {
+        free(p);
+        return;
+    }
+
+    buffers.free_lists[c].push_back(p);
+    pooled_bytes.fetch_add(bytes, memory_order_relaxed);
+}
+
+IoBuffer::IoBuffer(IoBuffer &&other) noexcept : ptr(other.ptr), capacity(other.capacity)
+{
+    other.ptr = nullptr;
+    other.capacity = 0;
+}
+
+IoBuffer &IoBuffer::operator=(IoBuffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        ptr = other.ptr;
+        capacity = other.capacity;
+        other.ptr = nullptr;
+        other.capacity = 0;
+    }
+    return *this;
+}
+
+void IoBuffer::reset(size_t bytes)
+{
+    if (ptr && capacity >= bytes)
+        return;
+
+    release();
+    capacity = bytes;
+    ptr = take(capacity);
+}
+
+void IoBuffer::grow(size_t bytes, size_t keep)
+{
+    if (ptr && capacity >= bytes)
+        return;
+
+    size_t grown = bytes;
+    char *p = take(grown);
+    if (keep > 0)
+        memcpy(p, ptr, keep);
+
+    release();
+    ptr = p;
+    capacity = grown;
+}
+
+void IoBuffer::release()
+{
+    if (!ptr)
+        return;
+
+    give_back(ptr, capacity);
+    ptr = nullptr;
+    capacity = 0;
+}
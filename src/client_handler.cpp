@@ -1,8 +1,10 @@
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
 #include <unistd.h>
-#include <cstring>
+#include <cerrno>
+#include <atomic>
 #include "client_handler.h"
+#include "connection.h"
 #include "http_parser.h"
 #include "forwarder.h"
 #include "blocklist.h"
@@ -12,98 +14,422 @@
 
 using namespace std;
 
-void handle_client(const Task &task)
+#define BUFFER_SIZE 4096
+
+static atomic<size_t> open_connections{0};
+
+static chrono::steady_clock::time_point timeout_from_now()
 {
-    HttpRequest req;
-    size_t bytes = 0;
+    return chrono::steady_clock::now() + chrono::seconds(global_config.connection_timeout_sec);
+}
 
-    apply_socket_timeout(task.client_fd, global_config.connection_timeout_sec);
+static string client_label(const Connection &conn)
+{
+    return conn.client_ip + ":" + to_string(conn.client_port);
+}
 
-    if (!parse_http_request(task.client_fd, req))
-    {
-        // The request parser fails hence we send response 400 BAD REQUEST
+static string request_line(const Connection &conn)
+{
+    return conn.req.method + " " + conn.req.path + " HTTP/1.0";
+}
 
-        string body = "Bad Request: unable to parse HTTP request.\n";
+static string host_port(const Connection &conn)
+{
+    return conn.req.host + ":" + to_string(conn.req.port);
+}
 
-        string response = "HTTP/1.0 400 Bad Request\r\n"
-                          "Content-Type: text/plain\r\n"
-                          "Content-Length: " +
-                          to_string(body.size()) + "\r\n"
-                                                   "Connection: close\r\n"
-                                                   "\r\n" +
-                          body;
+Connection::Connection(EventLoop &loop, int client_fd, const string &client_ip, int client_port)
+    : loop(loop), client_ip(client_ip), client_port(client_port)
+{
+    client.handler = this;
+    client.fd = client_fd;
+    upstream.handler = this;
+    deadline = timeout_from_now();
+}
 
-        send_all(task.client_fd, response.c_str(), response.size());
+Connection::~Connection()
+{
+    if (client.fd >= 0)
+        loop.close_fd(client.fd);
+    if (upstream.fd >= 0)
+        loop.close_fd(upstream.fd);
+}
 
-        metrics_record_blocked();
+static void record_forwarded(Connection &conn)
+{
+    if (!conn.forwarded)
+        return;
+
+    conn.forwarded = false;
+    conn.requests_served++;
+
+    if (conn.req.method != "CONNECT")
+    {
+        auto elapsed = chrono::steady_clock::now() - conn.request_start;
+        metrics_record_latency(Latency::REQUEST, chrono::duration_cast<chrono::microseconds>(elapsed).count());
+    }
 
-        log_info(task.client_ip + ":" + to_string(task.client_port) +
-                 " | \"INVALID REQUEST\""
-                 " | -"
-                 " | FAILED | 400 | bytes=0");
+    metrics_record_allowed(conn.bytes);
+    metrics_record_request_body(conn.body_bytes);
+    log_info(client_label(conn) +
+             " | \"" + request_line(conn) + "\"" +
+             " | " + host_port(conn) +
+             " | ALLOWED | 200 | bytes=" + to_string(conn.bytes) +
+             (conn.cache_status ? string(" | cache=") + conn.cache_status : string()));
+}
 
-        close(task.client_fd);
+void finish_connection(Connection &conn)
+{
+    if (conn.state == ConnState::CLOSED)
         return;
+
+    conn.state = ConnState::CLOSED;
+    open_connections.fetch_sub(1, memory_order_relaxed);
+
+    if (conn.tunnel_open)
+    {
+        conn.tunnel_open = false;
+        metrics_record_tunnel(false);
+    }
+
+    conn.loop.close_fd(conn.client.fd);
+    conn.client.fd = -1;
+
+    if (conn.upstream.fd >= 0)
+    {
+        conn.loop.close_fd(conn.upstream.fd);
+        conn.upstream.fd = -1;
+    }
+
+    close_relay_pipes(conn);
+    release_flight(conn);
+    record_forwarded(conn);
+
+    conn.loop.detach(&conn);
+}
+
+void move_connection(Connection &conn, EventLoop &target)
+{
+    auto moved = make_shared<Connection>(target, conn.client.fd, conn.client_ip, conn.client_port);
+
+    conn.loop.remove_fd(conn.client.fd);
+    conn.loop.remove_fd(conn.upstream.fd);
+
+    moved->upstream.fd = conn.upstream.fd;
+    moved->client_io = conn.client_io;
+    moved->upstream_io = conn.upstream_io;
+    moved->state = conn.state;
+    moved->req = move(conn.req);
+    moved->header_data = move(conn.header_data);
+    moved->requests_served = conn.requests_served;
+    moved->keep_client = conn.keep_client;
+    moved->to_upstream = move(conn.to_upstream);
+    moved->to_client = move(conn.to_client);
+    moved->use_splice = conn.use_splice;
+    moved->upstream_pipe = conn.upstream_pipe;
+    moved->client_pipe = conn.client_pipe;
+    moved->forwarded = conn.forwarded;
+    moved->bytes = conn.bytes;
+    moved->body_bytes = conn.body_bytes;
+    moved->tunnel_open = conn.tunnel_open;
+    moved->deadline = conn.deadline;
+    moved->request_start = conn.request_start;
+
+    // Everything now belongs to moved; conn goes away without closing or recording it
+    conn.client.fd = -1;
+    conn.upstream.fd = -1;
+    conn.upstream_pipe = SplicePipe();
+    conn.client_pipe = SplicePipe();
+    conn.forwarded = false;
+    conn.tunnel_open = false;
+    conn.state = ConnState::CLOSED;
+    conn.loop.detach(&conn);
+
+    target.post([moved]()
+                {
+        Connection &conn = *moved;
+        conn.loop.attach(moved);
+
+        // Adding an edge-triggered socket reports the readiness it already has
+        if (!conn.loop.add_fd(&conn.client, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) ||
+            !conn.loop.add_fd(&conn.upstream, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+        {
+            finish_connection(conn);
+            return;
+        }
+
+        relay_data(conn); });
+}
+
+static bool flush_to_client(Connection &conn)
+{
+    RelayBuffer &buf = conn.to_client;
+
+    while (!buf.empty() && conn.client_io.writable)
+    {
+        ssize_t sent = send(conn.client.fd, buf.data.data() + buf.offset, buf.pending(), MSG_NOSIGNAL);
+
+        if (sent > 0)
+        {
+            buf.offset += sent;
+            continue;
+        }
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            conn.client_io.writable = false;
+            return true;
+        }
+
+        return false;
     }
 
-    metrics_record_request(req.host);
+    return true;
+}
 
-    string request_line = req.method + " " + req.path + " HTTP/1.0";
-    string host_port = req.host + ":" + to_string(req.port);
+// Queues a proxy-generated response; the connection closes once it is written
+static void send_response(Connection &conn, const string &status, const string &body)
+{
+    string response = "HTTP/1.0 " + status + "\r\n"
+                                             "Content-Type: text/plain\r\n"
+                                             "Content-Length: " +
+                      to_string(body.size()) + "\r\n"
+                                               "Connection: close\r\n"
+                                               "\r\n" +
+                      body;
+
+    conn.to_client.assign(response);
+    conn.state = ConnState::RESPONDING;
+    conn.deadline = timeout_from_now();
 
-    if (global_config.enable_blocklist && is_blocked(req.host))
+    if (!flush_to_client(conn) || conn.to_client.empty())
+        finish_connection(conn);
+}
+
+static void reject_invalid(Connection &conn)
+{
+    // The request parser fails hence we send response 400 BAD REQUEST
+
+    metrics_record_blocked();
+    metrics_record_error(ProxyError::BAD_REQUEST);
+
+    log_info(client_label(conn) +
+             " | \"INVALID REQUEST\""
+             " | -"
+             " | FAILED | 400 | bytes=0");
+
+    send_response(conn, "400 Bad Request", "Bad Request: unable to parse HTTP request.\n");
+}
+
+void reject_request_body(Connection &conn)
+{
+    if (conn.upstream.fd >= 0)
+    {
+        conn.loop.close_fd(conn.upstream.fd);
+        conn.upstream.fd = -1;
+    }
+
+    conn.forwarded = false; // logged here instead of as ALLOWED
+    metrics_record_error(ProxyError::BAD_REQUEST);
+
+    log_info(client_label(conn) +
+             " | \"" + request_line(conn) + "\"" +
+             " | " + host_port(conn) +
+             " | FAILED | 400 | bytes=0");
+
+    if (conn.response_parsed || !conn.to_client.empty())
+        finish_connection(conn);
+    else
+        send_response(conn, "400 Bad Request", "Bad Request: malformed chunked request body.\n");
+}
+
+static void dispatch_request(Connection &conn)
+{
+    conn.header_data.erase(0, conn.req.header_length); // what is left is body or pipelined requests
+    conn.request_start = chrono::steady_clock::now();
+
+    metrics_record_request(conn.req.host);
+
+    if (global_config.enable_blocklist && is_blocked(conn.req.host))
     {
         metrics_record_blocked();
-        log_info(task.client_ip + ":" + to_string(task.client_port) +
-                 " | \"" + request_line + "\"" +
-                 " | " + host_port +
+        log_info(client_label(conn) +
+                 " | \"" + request_line(conn) + "\"" +
+                 " | " + host_port(conn) +
                  " | BLOCKED | 403 | bytes=0");
 
-        string body = "Access to the requested domain is blocked.\n";
-
-        string response = "HTTP/1.0 403 Forbidden\r\n"
-                          "Content-Type: text/plain\r\n"
-                          "Content-Length: " +
-                          to_string(body.size()) + "\r\n"
-                                                   "Connection: close\r\n"
-                                                   "\r\n" +
-                          body;
+        send_response(conn, "403 Forbidden", "Access to the requested domain is blocked.\n"); // 403 Forbidden Response sent
+        return;
+    }
 
-        send_all(task.client_fd, response.c_str(), response.size()); // 403 Forbidden Response sent
-        close(task.client_fd);
+    if (conn.req.method == "CONNECT" && !global_config.enable_https_tunnel)
+    {
+        metrics_record_blocked();
+        send_response(conn, "403 Forbidden", "HTTPS tunneling is disabled by server policy.\n");
         return;
     }
 
-    if (req.method == "CONNECT")
+    conn.forwarded = true;
+    conn.state = ConnState::RESOLVING;
+    conn.deadline = timeout_from_now();
+
+    if (conn.req.method == "CONNECT")
+        tunnel_tcp(conn); // start https tunnelling
+    else
+        forward_tcp(conn); // start http forwarding
+}
+
+static void read_request(Connection &conn)
+{
+    char buffer[BUFFER_SIZE];
+
+    while (true)
     {
-        if (!global_config.enable_https_tunnel)
+        if (!conn.header_data.empty()) // pipelined requests may already be buffered
+        {
+            ParseResult result = parse_http_request(conn.header_data, conn.req);
+
+            if (result == PARSE_ERROR)
+            {
+                reject_invalid(conn);
+                return;
+            }
+
+            if (result == PARSE_OK)
+            {
+                dispatch_request(conn);
+                return;
+            }
+        }
+
+        if (!conn.client_io.readable)
+            return;
+
+        ssize_t bytes = recv(conn.client.fd, buffer, BUFFER_SIZE, 0);
+
+        if (bytes > 0)
+        {
+            if (conn.header_data.empty())
+                conn.deadline = timeout_from_now(); // a new request started: it gets the header timeout
+            conn.header_data.append(buffer, bytes);
+            continue;
+        }
+
+        if (bytes < 0 && errno == EINTR)
+            continue;
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            metrics_record_blocked();
-            string body = "HTTPS tunneling is disabled by server policy.\n";
-
-            string response = "HTTP/1.0 403 Forbidden\r\n"
-                              "Content-Type: text/plain\r\n"
-                              "Content-Length: " +
-                              to_string(body.size()) + "\r\n"
-                                                       "Connection: close\r\n"
-                                                       "\r\n" +
-                              body;
-
-            send_all(task.client_fd, response.c_str(), response.size());
-            close(task.client_fd);
+            conn.client_io.readable = false;
             return;
         }
 
-        bytes = tunnel_tcp(task.client_fd, req); // start https tunnelling
+        if (conn.requests_served > 0 && conn.header_data.empty())
+            finish_connection(conn); // a kept-alive client closing between requests is normal
+        else
+            reject_invalid(conn); // peer closed or socket error before a full header arrived
+        return;
     }
-    else
+}
+
+void next_request(Connection &conn)
+{
+    record_forwarded(conn);
+
+    if (conn.upstream.fd >= 0)
     {
-        bytes = forward_tcp(task.client_fd, req); // start http forwarding
+        conn.loop.close_fd(conn.upstream.fd);
+        conn.upstream.fd = -1;
     }
 
-    metrics_record_allowed(bytes);
-    log_info(task.client_ip + ":" + to_string(task.client_port) +
-             " | \"" + request_line + "\"" +
-             " | " + host_port +
-             " | ALLOWED | 200 | bytes=" + to_string(bytes));
-}
\ No newline at end of file
+    // The splice pipes are empty at this point and stay with the connection
+    conn.upstream_io = SocketState();
+    conn.to_upstream = RelayBuffer();
+    conn.to_client = RelayBuffer();
+    conn.req = HttpRequest();
+    conn.resp = HttpResponse();
+    conn.response_parsed = false;
+    conn.reused_upstream = false;
+    conn.keep_client = false;
+    conn.bytes = 0;
+    conn.body_bytes = 0;
+    conn.cache_hit.reset();
+    conn.cache_tail.clear();
+    conn.cache_sent = 0;
+    conn.cache_fill.reset();
+    conn.cache_status = nullptr;
+    release_flight(conn);
+    conn.flight_head_sent = false;
+    conn.flight_offset = 0;
+
+    conn.state = ConnState::READING_HEADERS;
+    conn.deadline = chrono::steady_clock::now() + chrono::seconds(global_config.client_keepalive_timeout_sec);
+
+    read_request(conn);
+}
+
+void Connection::on_event(Channel *channel, uint32_t events)
+{
+    SocketState &io = (channel == &client) ? client_io : upstream_io;
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        io.readable = true;
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        io.writable = true;
+
+    switch (state)
+    {
+    case ConnState::READING_HEADERS:
+        read_request(*this);
+        break;
+
+    case ConnState::CONNECTING:
+    case ConnState::RELAYING:
+        relay_data(*this);
+        break;
+
+    case ConnState::RESPONDING:
+        if (!flush_to_client(*this) || to_client.empty())
+            finish_connection(*this);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void Connection::on_tick(chrono::steady_clock::time_point now)
+{
+    if (state == ConnState::CLOSED || now < deadline)
+        return;
+
+    if (state == ConnState::READING_HEADERS && requests_served > 0 && header_data.empty())
+        finish_connection(*this); // keep-alive idle timeout
+    else if (state == ConnState::READING_HEADERS)
+        reject_invalid(*this); // the client did not send a full header in time
+    else if (state != ConnState::RELAYING || !relay_deadline_passed(*this))
+    {
+        metrics_record_error(ProxyError::TIMEOUT);
+        finish_connection(*this);
+    }
+}
+
+size_t open_connection_count()
+{
+    return open_connections.load(memory_order_relaxed);
+}
+
+void handle_client(EventLoop &loop, const Task &task)
+{
+    open_connections.fetch_add(1, memory_order_relaxed);
+
+    auto conn = make_shared<Connection>(loop, task.client_fd, task.client_ip, task.client_port);
+
+    loop.attach(conn);
+
+    if (!loop.add_fd(&conn->client, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+        finish_connection(*conn);
+}
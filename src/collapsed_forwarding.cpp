@@ -0,0 +1,177 @@
+#include <unordered_map>
+#include "collapsed_forwarding.h"
+
+using namespace std;
+
+#define FLIGHT_SHARDS 16
+
+// Fetches that new requests can still attach to, by cache key
+struct FlightShard
+{
+    mutex m;
+    unordered_map<string, shared_ptr<Flight>> flights;
+};
+
+static FlightShard shards[FLIGHT_SHARDS];
+static size_t max_buffered = 0;
+
+static FlightShard &shard_for(const string &key)
+{
+    return shards[hash<string>()(key) % FLIGHT_SHARDS];
+}
+
+// Stops new followers from attaching; the registry entry goes away with it
+static void close_to_joiners(Flight &flight)
+{
+    FlightShard &shard = shard_for(flight.key);
+    lock_guard<mutex> lock(shard.m);
+
+    auto found = shard.flights.find(flight.key);
+    if (found != shard.flights.end() && found->second.get() == &flight)
+        shard.flights.erase(found);
+}
+
+// Runs the waiters collected under the flight's lock, each on its own loop
+static void wake_all(vector<FlightWaiter> &waiters)
+{
+    for (FlightWaiter &waiter : waiters)
+        waiter.loop->post(move(waiter.wake));
+}
+
+void init_collapsed_forwarding(size_t max_buffered_bytes)
+{
+    max_buffered = max_buffered_bytes;
+}
+
+shared_ptr<Flight> flight_join(const string &key, bool &leader, shared_ptr<FlightChunk> &cursor)
+{
+    FlightShard &shard = shard_for(key);
+    lock_guard<mutex> lock(shard.m);
+
+    auto found = shard.flights.find(key);
+    if (found != shard.flights.end())
+    {
+        shared_ptr<Flight> flight = found->second;
+        lock_guard<mutex> flight_lock(flight->m);
+
+        if (flight->root)
+        {
+            leader = false;
+            cursor = flight->root;
+            return flight;
+        }
+    }
+
+    auto flight = make_shared<Flight>();
+    flight->key = key;
+    flight->root = make_shared<FlightChunk>();
+    flight->last = flight->root;
+    flight->window.push_back(flight->root);
+
+    shard.flights[key] = flight;
+    leader = true;
+    return flight;
+}
+
+void flight_publish_head(Flight &flight, const string &head, bool until_close, bool chunked)
+{
+    vector<FlightWaiter> waiters;
+    {
+        lock_guard<mutex> lock(flight.m);
+        flight.head = head;
+        flight.until_close = until_close;
+        flight.chunked = chunked;
+        flight.state = FlightState::STREAMING;
+        waiters.swap(flight.waiters);
+    }
+
+    wake_all(waiters);
+}
+
+void flight_append(Flight &flight, const char *data, size_t len)
+{
+    if (len == 0)
+        return;
+
+    auto chunk = make_shared<FlightChunk>();
+    chunk->data.assign(data, len);
+
+    vector<FlightWaiter> waiters;
+    bool full = false;
+    {
+        lock_guard<mutex> lock(flight.m);
+        flight.last->next = chunk;
+        flight.last = chunk;
+        flight.bytes += len;
+        chunk->end = flight.bytes;
+        flight.window.push_back(chunk);
+
+        // Cutting the link after a chunk that fell out of the window bounds what a slow
+        // follower can keep alive; it is dropped once it reaches the cut
+        while (flight.window.front()->end + max_buffered < flight.bytes)
+        {
+            flight.window.front()->next.reset();
+            flight.window.pop_front();
+        }
+
+        // Past the limit, only followers that already joined keep the body alive
+        if (flight.bytes > max_buffered && flight.root)
+        {
+            flight.root.reset();
+            full = true;
+        }
+
+        waiters.swap(flight.waiters);
+    }
+
+    if (full)
+        close_to_joiners(flight);
+
+    wake_all(waiters);
+}
+
+void flight_finish(Flight &flight, bool ok)
+{
+    close_to_joiners(flight);
+
+    vector<FlightWaiter> waiters;
+    {
+        lock_guard<mutex> lock(flight.m);
+        flight.state = ok ? FlightState::DONE : FlightState::FAILED;
+        flight.root.reset();
+        flight.window.clear(); // the followers' cursors keep what they still have to send
+        waiters.swap(flight.waiters);
+    }
+
+    wake_all(waiters);
+}
+
+FlightState flight_wait_head(Flight &flight, EventLoop &loop, function<void()> wake)
+{
+    lock_guard<mutex> lock(flight.m);
+
+    if (flight.state == FlightState::WAITING_HEAD)
+        flight.waiters.push_back({&loop, move(wake)});
+
+    return flight.state;
+}
+
+shared_ptr<FlightChunk> flight_next(Flight &flight, const FlightChunk &cursor, FlightState &state, EventLoop &loop, function<void()> wake)
+{
+    lock_guard<mutex> lock(flight.m);
+
+    state = flight.state;
+    if (cursor.next)
+        return cursor.next;
+
+    if (cursor.end < flight.bytes)
+    {
+        state = FlightState::FAILED; // the chain was cut behind this follower
+        return nullptr;
+    }
+
+    if (state == FlightState::STREAMING)
+        flight.waiters.push_back({&loop, move(wake)});
+
+    return nullptr;
+}
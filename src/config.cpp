@@ -48,22 +48,94 @@ bool load_config(const string &filename, Config &config)
             config.listen_port = stoi(value);
         else if (key == "thread_pool_size")
             config.thread_pool_size = stoi(value);
+        else if (key == "reuseport_listeners")
+            config.reuseport_listeners = to_bool(value);
+        else if (key == "pin_worker_threads")
+            config.pin_worker_threads = to_bool(value);
+        else if (key == "io_backend")
+            config.io_backend = value;
+        else if (key == "admin_address")
+            config.admin_address = value;
+        else if (key == "admin_port")
+            config.admin_port = stoi(value);
+        else if (key == "blocking_pool_size")
+            config.blocking_pool_size = stoi(value);
+        else if (key == "blocking_pool_max_size")
+            config.blocking_pool_max_size = stoi(value);
+        else if (key == "blocking_pool_target_wait_ms")
+            config.blocking_pool_target_wait_ms = stoi(value);
+        else if (key == "blocking_pool_idle_sec")
+            config.blocking_pool_idle_sec = stoi(value);
+        else if (key == "tunnel_loops")
+            config.tunnel_loops = stoi(value);
+        else if (key == "max_connections")
+            config.max_connections = stoi(value);
+        else if (key == "max_accept_queue")
+            config.max_accept_queue = stoi(value);
+        else if (key == "accept_queue_target_ms")
+            config.accept_queue_target_ms = stoi(value);
+        else if (key == "overload_retry_after_sec")
+            config.overload_retry_after_sec = stoi(value);
         else if (key == "blocklist_file")
             config.blocklist_file = value;
+        else if (key == "blocklist_image_file")
+            config.blocklist_image_file = value;
         else if (key == "log_file")
             config.log_file = value;
         else if (key == "enable_blocklist")
             config.enable_blocklist = to_bool(value);
         else if (key == "enable_https_tunnel")
             config.enable_https_tunnel = to_bool(value);
+        else if (key == "enable_splice")
+            config.enable_splice = to_bool(value);
+        else if (key == "io_buffer_pool_mb")
+            config.io_buffer_pool_mb = stoi(value);
         else if (key == "log_enabled")
             config.log_enabled = to_bool(value);
         else if (key == "log_max_size_bytes")
             config.log_max_size_bytes = stoul(value);
         else if (key == "metrics_file")
             config.metrics_file = value;
+        else if (key == "log_queue_size")
+            config.log_queue_size = stoi(value);
+        else if (key == "log_full_policy")
+            config.log_full_policy = value;
+        else if (key == "metrics_flush_interval_ms")
+            config.metrics_flush_interval_ms = stoi(value);
         else if (key == "connection_timeout_sec")
             config.connection_timeout_sec = stoi(value);
+        else if (key == "client_keepalive_timeout_sec")
+            config.client_keepalive_timeout_sec = stoi(value);
+        else if (key == "client_max_requests")
+            config.client_max_requests = stoi(value);
+        else if (key == "upstream_pool_max_idle")
+            config.upstream_pool_max_idle = stoi(value);
+        else if (key == "upstream_pool_max_per_host")
+            config.upstream_pool_max_per_host = stoi(value);
+        else if (key == "upstream_pool_idle_ttl_sec")
+            config.upstream_pool_idle_ttl_sec = stoi(value);
+        else if (key == "dns_cache_max_entries")
+            config.dns_cache_max_entries = stoi(value);
+        else if (key == "dns_cache_ttl_sec")
+            config.dns_cache_ttl_sec = stoi(value);
+        else if (key == "dns_negative_ttl_sec")
+            config.dns_negative_ttl_sec = stoi(value);
+        else if (key == "response_cache_max_mb")
+            config.response_cache_max_mb = stoi(value);
+        else if (key == "response_cache_max_object_kb")
+            config.response_cache_max_object_kb = stoi(value);
+        else if (key == "collapsed_forwarding")
+            config.collapsed_forwarding = to_bool(value);
+        else if (key == "collapsed_forwarding_wait_sec")
+            config.collapsed_forwarding_wait_sec = stoi(value);
+        else if (key == "collapsed_forwarding_buffer_kb")
+            config.collapsed_forwarding_buffer_kb = stoi(value);
+        else if (key == "response_cache_dir")
+            config.response_cache_dir = value;
+        else if (key == "response_cache_disk_max_mb")
+            config.response_cache_disk_max_mb = stoi(value);
+        else if (key == "response_cache_disk_max_object_mb")
+            config.response_cache_disk_max_object_mb = stoi(value);
     }
 
     return true;
@@ -77,12 +149,120 @@ bool validate(Config &config)
     if (config.thread_pool_size <= 0)
         config.thread_pool_size = 4;
 
+    if (config.blocking_pool_size <= 0)
+        config.blocking_pool_size = 2;
+
+    if (config.blocking_pool_max_size < config.blocking_pool_size) // fixed size unless configured
+        config.blocking_pool_max_size = config.blocking_pool_size;
+
+    if (config.blocking_pool_target_wait_ms <= 0)
+        config.blocking_pool_target_wait_ms = 20;
+
+    if (config.blocking_pool_idle_sec <= 0)
+        config.blocking_pool_idle_sec = 30;
+
+    if (config.tunnel_loops < 0)
+        config.tunnel_loops = 0;
+
+    if (config.max_connections < 0) // 0 means no limit
+        config.max_connections = 0;
+
+    if (config.max_accept_queue < 0)
+        config.max_accept_queue = 0;
+
+    if (config.accept_queue_target_ms < 0)
+        config.accept_queue_target_ms = 0;
+
+    if (config.overload_retry_after_sec <= 0)
+        config.overload_retry_after_sec = 1;
+
+    if (config.client_keepalive_timeout_sec <= 0)
+        config.client_keepalive_timeout_sec = 15;
+
+    if (config.client_max_requests <= 0)
+        config.client_max_requests = 100;
+
+    if (config.upstream_pool_max_idle < 0) // 0 disables pooling
+        config.upstream_pool_max_idle = 64;
+
+    if (config.upstream_pool_max_per_host <= 0)
+        config.upstream_pool_max_per_host = 8;
+
+    if (config.upstream_pool_idle_ttl_sec <= 0)
+        config.upstream_pool_idle_ttl_sec = 30;
+
+    if (config.dns_cache_max_entries < 0) // 0 disables caching, lookups are still de-duplicated
+        config.dns_cache_max_entries = 1024;
+
+    if (config.dns_cache_ttl_sec < 0)
+        config.dns_cache_ttl_sec = 60;
+
+    if (config.dns_negative_ttl_sec < 0)
+        config.dns_negative_ttl_sec = 5;
+
+    if (config.response_cache_max_mb < 0) // off unless configured
+        config.response_cache_max_mb = 0;
+
+    if (config.response_cache_max_object_kb <= 0)
+        config.response_cache_max_object_kb = 1024;
+
+    if (config.response_cache_disk_max_mb <= 0)
+        config.response_cache_disk_max_mb = 1024;
+
+    if (config.response_cache_disk_max_object_mb <= 0)
+        config.response_cache_disk_max_object_mb = 256;
+
+    if (config.io_buffer_pool_mb < 0) // 0 frees every buffer on release
+        config.io_buffer_pool_mb = 64;
+
+    if (config.collapsed_forwarding_wait_sec <= 0)
+        config.collapsed_forwarding_wait_sec = 2;
+
+    if (config.collapsed_forwarding_buffer_kb < 0)
+        config.collapsed_forwarding_buffer_kb = 1024;
+
     if (config.log_max_size_bytes == 0)
         config.log_max_size_bytes = 64 * 1024; // 64 Kb
 
+    if (config.log_queue_size <= 0)
+        config.log_queue_size = 8192;
+
+    if (config.io_backend.empty())
+        config.io_backend = "epoll";
+
+    if (config.io_backend != "epoll" && config.io_backend != "io_uring")
+    {
+        cerr << "[CONFIG ERROR] Invalid io_backend: " << config.io_backend << endl;
+        return false;
+    }
+
+    if (config.log_full_policy.empty())
+        config.log_full_policy = "drop";
+
+    if (config.log_full_policy != "drop" && config.log_full_policy != "block")
+    {
+        cerr << "[CONFIG ERROR] Invalid log_full_policy: " << config.log_full_policy << endl;
+        return false;
+    }
+
     if (config.metrics_file.empty())
         config.metrics_file = "config/metrics.txt";
 
+    if (config.metrics_flush_interval_ms <= 0)
+        config.metrics_flush_interval_ms = 1000;
+
+    if (config.admin_address.empty()) // loopback unless configured otherwise
+        config.admin_address = "127.0.0.1";
+
+    if (config.admin_port < 0) // off unless configured
+        config.admin_port = 0;
+
+    if (config.admin_port > 65535)
+    {
+        cerr << "[CONFIG ERROR] Invalid admin_port: " << config.admin_port << endl;
+        return false;
+    }
+
     if (config.listen_port <= 0 || config.listen_port > 65535)
     {
         cerr << "[CONFIG ERROR] Invalid listen_port: " << config.listen_port << endl;
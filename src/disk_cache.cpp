@@ -0,0 +1,731 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "disk_cache.h"
+#include "metrics.h"
+
+using namespace std;
+
+#define INDEX_VERSION 1
+#define MIN_SLOTS 1024
+#define MAX_SLOTS (1 << 20)
+#define MIN_OBJECT_ESTIMATE (64 * 1024) // sizes the index when every cacheable response goes to disk
+#define EVICT_INTERVAL_SEC 10
+#define EVICT_TARGET_PERCENT 90
+#define WRITE_QUEUE_BYTES (8 << 20) // capture bytes waiting for the writer; a capture that would exceed it is abandoned
+
+static const char INDEX_MAGIC[8] = {'P', 'X', 'C', 'I', 'D', 'X', '0', '1'};
+static const char OBJECT_MAGIC[8] = {'P', 'X', 'C', 'O', 'B', 'J', '0', '1'};
+
+enum : uint64_t
+{
+    SLOT_EMPTY = 0,
+    SLOT_REMOVED = 1
+};
+
+static string cache_dir;
+static size_t max_total = 0;
+static size_t max_object = 0;
+
+// Everything below is guarded by index_lock. Lookups from the event loops share it, so they
+// never wait for each other; anything that changes the index takes it exclusively.
+static shared_mutex index_lock;
+static DiskIndexHeader *header = nullptr;
+static DiskIndexSlot *slots = nullptr;
+static size_t index_size = 0;
+static size_t used_bytes = 0;
+static size_t entry_count = 0;
+static size_t removed_count = 0;
+
+static atomic<uint64_t> temp_counter{0};
+
+static thread evictor;
+static condition_variable_any evict_cv;
+static bool evicting = false;
+
+// Captures are written on their own thread, in queue order, so a slow disk never stalls an event loop
+struct WriteJob
+{
+    function<void()> run;
+    size_t bytes;
+};
+
+static thread writer;
+static mutex write_lock;
+static condition_variable write_cv;
+static deque<WriteJob> write_jobs;
+static size_t write_queued = 0; // bytes in write_jobs and in the job running
+static bool writing = false;
+
+static uint64_t hash_key(const string &key)
+{
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    for (unsigned char c : key)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h < 2 ? h + 2 : h; // 0 and 1 mark free slots
+}
+
+static uint64_t slot_check(const DiskIndexSlot &slot)
+{
+    uint64_t x = slot.key_hash ^ (slot.file_id * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)slot.expires << 1) ^ (slot.size << 3);
+    return x ^ (x >> 29);
+}
+
+static string object_path(uint64_t file_id)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.obj", (unsigned long long)file_id);
+    return cache_dir + name;
+}
+
+static bool is_live(const DiskIndexSlot &slot)
+{
+    return slot.key_hash != SLOT_EMPTY && slot.key_hash != SLOT_REMOVED;
+}
+
+// Slot holding key_hash, or the first free slot on its probe path; nullptr if the table is full
+static DiskIndexSlot *probe(uint64_t key_hash, bool for_insert)
+{
+    size_t mask = header->slot_count - 1;
+    DiskIndexSlot *free_slot = nullptr;
+
+    for (size_t i = 0, pos = key_hash & mask; i < header->slot_count; ++i, pos = (pos + 1) & mask)
+    {
+        DiskIndexSlot &slot = slots[pos];
+
+        if (slot.key_hash == key_hash)
+            return &slot;
+
+        if (slot.key_hash == SLOT_REMOVED && !free_slot)
+            free_slot = &slot;
+
+        if (slot.key_hash == SLOT_EMPTY)
+            return for_insert ? (free_slot ? free_slot : &slot) : nullptr;
+    }
+
+    return for_insert ? free_slot : nullptr;
+}
+
+// False if the table has no free slot left; the caller then unlinks the entry's file
+static bool insert_slot(const DiskIndexSlot &entry)
+{
+    DiskIndexSlot *slot = probe(entry.key_hash, true);
+    if (!slot)
+        return false;
+
+    if (slot->key_hash == SLOT_REMOVED)
+        removed_count--;
+
+    *slot = entry;
+    slot->check = slot_check(*slot);
+    used_bytes += entry.size;
+    entry_count++;
+    return true;
+}
+
+static uint64_t remove_slot(DiskIndexSlot &slot)
+{
+    uint64_t file_id = slot.file_id;
+    used_bytes -= slot.size;
+    entry_count--;
+    removed_count++;
+
+    memset(&slot, 0, sizeof(slot));
+    slot.key_hash = SLOT_REMOVED;
+    return file_id;
+}
+
+static void publish_usage()
+{
+    metrics_record_response_cache_disk_usage(used_bytes, entry_count);
+}
+
+// Re-inserts the live slots so removed markers stop lengthening probe paths; files of entries
+// that no longer fit are added to dropped, for the caller to unlink outside the lock
+static void compact(vector<uint64_t> &dropped)
+{
+    vector<DiskIndexSlot> live;
+    for (size_t i = 0; i < header->slot_count; ++i)
+    {
+        if (is_live(slots[i]))
+            live.push_back(slots[i]);
+    }
+
+    memset(slots, 0, header->slot_count * sizeof(DiskIndexSlot));
+    used_bytes = entry_count = removed_count = 0;
+
+    for (const DiskIndexSlot &slot : live)
+    {
+        if (!insert_slot(slot))
+            dropped.push_back(slot.file_id);
+    }
+}
+
+static bool read_object_header(int fd, DiskObjectHeader &object, string &key)
+{
+    if (pread(fd, &object, sizeof(object), 0) != (ssize_t)sizeof(object) ||
+        memcmp(object.magic, OBJECT_MAGIC, sizeof(OBJECT_MAGIC)) != 0 || object.key_length > 65536)
+        return false;
+
+    key.resize(object.key_length);
+    return pread(fd, &key[0], key.size(), sizeof(object)) == (ssize_t)key.size();
+}
+
+// Recreates the index from the content files; leftovers from interrupted captures are removed
+static void rebuild()
+{
+    memset(slots, 0, header->slot_count * sizeof(DiskIndexSlot));
+    used_bytes = entry_count = removed_count = 0;
+    header->next_file_id = 1;
+
+    DIR *dir = opendir(cache_dir.c_str());
+    if (!dir)
+        return;
+
+    time_t now = time(nullptr);
+    while (dirent *ent = readdir(dir))
+    {
+        string name = ent->d_name;
+        string path = cache_dir + "/" + name;
+
+        if (name.compare(0, 4, "tmp-") == 0)
+        {
+            unlink(path.c_str());
+            continue;
+        }
+
+        if (name.size() != 20 || name.compare(16, 4, ".obj") != 0)
+            continue;
+
+        uint64_t file_id = strtoull(name.substr(0, 16).c_str(), nullptr, 16);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        DiskObjectHeader object;
+        string key;
+        struct stat st;
+        bool valid = fd >= 0 && read_object_header(fd, object, key) && fstat(fd, &st) == 0 &&
+                     (uint64_t)st.st_size == sizeof(object) + object.key_length + object.vary_length + object.head_length + object.body_length;
+        if (fd >= 0)
+            close(fd);
+
+        if (!valid || object.expires <= now || entry_count + 1 > header->slot_count * 3 / 4)
+        {
+            unlink(path.c_str());
+            continue;
+        }
+
+        DiskIndexSlot *existing = probe(hash_key(key), false);
+        if (existing && existing->file_id > file_id)
+        {
+            unlink(path.c_str()); // an older copy of a response that was stored again
+            continue;
+        }
+        if (existing)
+            unlink(object_path(remove_slot(*existing)).c_str());
+
+        DiskIndexSlot slot{};
+        slot.key_hash = hash_key(key);
+        slot.file_id = file_id;
+        slot.stored = object.stored;
+        slot.expires = object.expires;
+        slot.last_used = object.stored;
+        slot.size = st.st_size;
+        if (!insert_slot(slot))
+        {
+            unlink(path.c_str());
+            continue;
+        }
+
+        header->next_file_id = max<uint64_t>(header->next_file_id, file_id + 1);
+    }
+
+    closedir(dir);
+}
+
+static bool index_is_valid(uint32_t slot_count)
+{
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->version != INDEX_VERSION ||
+        header->slot_count != slot_count || header->clean != 1)
+        return false;
+
+    used_bytes = entry_count = removed_count = 0;
+    for (size_t i = 0; i < slot_count; ++i)
+    {
+        const DiskIndexSlot &slot = slots[i];
+        if (slot.key_hash == SLOT_REMOVED)
+            removed_count++;
+        else if (slot.key_hash != SLOT_EMPTY && slot.check != slot_check(slot))
+            return false;
+        else if (slot.key_hash != SLOT_EMPTY)
+        {
+            used_bytes += slot.size;
+            entry_count++;
+        }
+    }
+
+    return true;
+}
+
+// Drops expired entries, then least recently used ones until the tier is back under its cap
+static void evict()
+{
+    vector<uint64_t> victims;
+    {
+        lock_guard<shared_mutex> lock(index_lock);
+        time_t now = time(nullptr);
+
+        vector<DiskIndexSlot *> live;
+        for (size_t i = 0; i < header->slot_count; ++i)
+        {
+            DiskIndexSlot &slot = slots[i];
+            if (!is_live(slot))
+                continue;
+
+            if (slot.expires <= now)
+                victims.push_back(remove_slot(slot));
+            else
+                live.push_back(&slot);
+        }
+
+        if (used_bytes > max_total)
+        {
+            sort(live.begin(), live.end(), [](const DiskIndexSlot *a, const DiskIndexSlot *b)
+                 { return a->last_used != b->last_used ? a->last_used < b->last_used : a->file_id < b->file_id; });
+
+            size_t target = max_total / 100 * EVICT_TARGET_PERCENT;
+            for (size_t i = 0; i < live.size() && used_bytes > target; ++i)
+                victims.push_back(remove_slot(*live[i]));
+        }
+
+        if (removed_count > header->slot_count / 4)
+            compact(victims);
+
+        publish_usage();
+    }
+
+    // Unlinked outside the lock; connections still sending a file keep their descriptor
+    for (uint64_t file_id : victims)
+        unlink(object_path(file_id).c_str());
+
+    if (!victims.empty())
+        metrics_record_response_cache_evictions(victims.size());
+}
+
+static void evict_loop()
+{
+    unique_lock<shared_mutex> lock(index_lock);
+
+    while (evicting)
+    {
+        evict_cv.wait_for(lock, chrono::seconds(EVICT_INTERVAL_SEC));
+        if (!evicting)
+            break;
+
+        lock.unlock();
+        evict();
+        lock.lock();
+    }
+}
+
+static void write_loop()
+{
+    unique_lock<mutex> lock(write_lock);
+
+    while (true)
+    {
+        write_cv.wait(lock, []
+                      { return !write_jobs.empty() || !writing; });
+        if (write_jobs.empty())
+            break; // stopping, and everything queued was written
+
+        WriteJob job = move(write_jobs.front());
+        write_jobs.pop_front();
+
+        lock.unlock();
+        job.run();
+        lock.lock();
+        write_queued -= job.bytes;
+    }
+}
+
+// bounded jobs are refused once WRITE_QUEUE_BYTES are waiting; false too once the writer stopped
+static bool queue_write(function<void()> run, size_t bytes, bool bounded)
+{
+    {
+        lock_guard<mutex> lock(write_lock);
+        if (!writing || (bounded && write_queued + bytes > WRITE_QUEUE_BYTES))
+            return false;
+
+        write_queued += bytes;
+        write_jobs.push_back({move(run), bytes});
+    }
+
+    write_cv.notify_one();
+    return true;
+}
+
+// Deleter of captures: closing and unlinking an abandoned one happens on the writer as well
+static void release_capture(CachedResponse *entry)
+{
+    if (!queue_write([entry]()
+                     { delete entry; }, 0, false))
+        delete entry;
+}
+
+bool init_disk_cache(const string &dir, size_t max_bytes, size_t min_object_bytes, size_t max_object_bytes)
+{
+    cache_dir = dir;
+    max_total = max_bytes;
+    max_object = min(max_object_bytes, max_bytes);
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        cerr << "[WARN] Cannot create response cache directory " << dir << ", disk tier disabled" << endl;
+        return false;
+    }
+
+    // Sized for twice as many objects as the cap holds at the smallest size stored on disk
+    size_t estimate = 2 * max_bytes / max<size_t>(min_object_bytes, MIN_OBJECT_ESTIMATE);
+    uint32_t slot_count = MIN_SLOTS;
+    while (slot_count < estimate && slot_count < MAX_SLOTS)
+        slot_count <<= 1;
+
+    string index_path = dir + "/index.bin";
+    int fd = open(index_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        cerr << "[WARN] Cannot open response cache index " << index_path << ", disk tier disabled" << endl;
+        return false;
+    }
+
+    size_t wanted = sizeof(DiskIndexHeader) + (size_t)slot_count * sizeof(DiskIndexSlot);
+    struct stat st;
+    bool resized = fstat(fd, &st) < 0 || (size_t)st.st_size != wanted;
+
+    if (resized && ftruncate(fd, wanted) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void *base = mmap(nullptr, wanted, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    lock_guard<shared_mutex> lock(index_lock);
+    header = (DiskIndexHeader *)base;
+    slots = (DiskIndexSlot *)(header + 1);
+    index_size = wanted;
+
+    if (resized || !index_is_valid(slot_count))
+    {
+        memset(base, 0, sizeof(DiskIndexHeader));
+        memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header->version = INDEX_VERSION;
+        header->slot_count = slot_count;
+        rebuild();
+        cout << "[INFO] Rebuilt response cache index: " << entry_count << " objects in " << dir << endl;
+    }
+    else
+    {
+        cout << "[INFO] Mapped response cache index: " << entry_count << " objects in " << dir << endl;
+    }
+
+    header->clean = 0; // until stop_disk_cache(); a crash forces a rebuild on the next start
+    msync(base, sizeof(DiskIndexHeader), MS_SYNC);
+    publish_usage();
+
+    writing = true;
+    writer = thread(write_loop);
+    evicting = true;
+    evictor = thread(evict_loop);
+    return true;
+}
+
+void stop_disk_cache()
+{
+    if (!evictor.joinable())
+        return;
+
+    {
+        lock_guard<mutex> lock(write_lock);
+        writing = false;
+    }
+    write_cv.notify_one();
+    writer.join(); // stores the captures that completed before shutdown
+
+    {
+        lock_guard<shared_mutex> lock(index_lock);
+        evicting = false;
+    }
+    evict_cv.notify_one();
+    evictor.join();
+
+    lock_guard<shared_mutex> lock(index_lock);
+    msync(header, index_size, MS_SYNC);
+    header->clean = 1;
+    msync(header, index_size, MS_SYNC);
+    munmap(header, index_size);
+    header = nullptr;
+    slots = nullptr;
+}
+
+bool disk_cache_enabled()
+{
+    return header != nullptr;
+}
+
+size_t disk_cache_max_object()
+{
+    return max_object;
+}
+
+shared_ptr<CachedResponse> disk_cache_lookup(const string &key)
+{
+    uint64_t key_hash = hash_key(key);
+    uint64_t file_id;
+    {
+        shared_lock<shared_mutex> lock(index_lock);
+        DiskIndexSlot *slot = probe(key_hash, false);
+        if (!slot)
+            return nullptr;
+
+        time_t now = time(nullptr);
+        if (slot->expires <= now)
+            return nullptr; // the evictor's next sweep removes it and unlinks the file, off the event loop
+
+        // Not covered by check, so updating it keeps the slot valid; other lookups may store it concurrently
+        __atomic_store_n(&slot->last_used, (int64_t)now, __ATOMIC_RELAXED);
+        file_id = slot->file_id;
+    }
+
+    int fd = open(object_path(file_id).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        lock_guard<shared_mutex> lock(index_lock);
+        DiskIndexSlot *slot = probe(key_hash, false);
+        if (slot && slot->file_id == file_id)
+            remove_slot(*slot); // content file went missing
+        return nullptr;
+    }
+
+    auto entry = make_shared<CachedResponse>();
+    entry->fd = fd; // closed by the entry
+
+    DiskObjectHeader object;
+    string stored_key;
+    if (!read_object_header(fd, object, stored_key) || stored_key != key)
+        return nullptr; // hash collision with another key
+
+    string vary(object.vary_length, '\0');
+    off_t offset = sizeof(object) + object.key_length;
+    if (pread(fd, &vary[0], vary.size(), offset) != (ssize_t)vary.size())
+        return nullptr;
+
+    for (size_t pos = 0; pos < vary.size();)
+    {
+        size_t name_end = vary.find('\0', pos);
+        size_t value_end = vary.find('\0', name_end + 1);
+        if (value_end == string::npos)
+            return nullptr;
+
+        entry->vary.emplace_back(vary.substr(pos, name_end - pos), vary.substr(name_end + 1, value_end - name_end - 1));
+        pos = value_end + 1;
+    }
+
+    entry->stored = object.stored;
+    entry->expires = object.expires;
+    entry->chunked = object.chunked != 0;
+    entry->head_offset = offset + object.vary_length;
+    entry->head_size = object.head_length;
+    entry->body_offset = entry->head_offset + object.head_length;
+    entry->body_size = object.body_length;
+    return entry;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+shared_ptr<CachedResponse> disk_cache_new_capture()
+{
+    return shared_ptr<CachedResponse>(new CachedResponse(), release_capture);
+}
+
+// Writer thread: creates the temporary content file and writes key, vary and head
+static void open_capture(CachedResponse &entry, const string &prefix)
+{
+    entry.temp_path = cache_dir + "/tmp-" + to_string(getpid()) + "-" + to_string(temp_counter.fetch_add(1));
+    entry.fd = open(entry.temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (entry.fd < 0)
+    {
+        entry.temp_path.clear();
+        entry.write_failed = true;
+        return;
+    }
+
+    // The object header is written last, once the body length is known
+    if (lseek(entry.fd, sizeof(DiskObjectHeader), SEEK_SET) < 0 || !write_all(entry.fd, prefix.data(), prefix.size()))
+        entry.write_failed = true;
+}
+
+bool disk_cache_begin(const string &key, CachedResponse &entry)
+{
+    string prefix = key;
+    for (const auto &selector : entry.vary)
+    {
+        prefix.append(selector.first).push_back('\0');
+        prefix.append(selector.second).push_back('\0');
+    }
+
+    entry.on_disk = true;
+    entry.head_offset = sizeof(DiskObjectHeader) + prefix.size();
+    entry.head_size = entry.head.size();
+    entry.body_offset = entry.head_offset + entry.head_size;
+    prefix.append(entry.head);
+
+    // The entry stays alive for the job: its deletion is queued behind it
+    CachedResponse *capture = &entry;
+    size_t bytes = prefix.size();
+    return queue_write([capture, prefix = move(prefix)]()
+                       { open_capture(*capture, prefix); }, bytes, true);
+}
+
+bool disk_cache_append(CachedResponse &entry, const char *data, size_t len)
+{
+    if (entry.body_size + len > max_object)
+        return false;
+
+    CachedResponse *capture = &entry;
+    string bytes(data, len);
+    if (!queue_write([capture, bytes = move(bytes)]()
+                     {
+            if (!capture->write_failed && !write_all(capture->fd, bytes.data(), bytes.size()))
+                capture->write_failed = true; }, len, true))
+        return false; // the disk is behind: give up on this capture instead of waiting for it
+
+    entry.body_size += len;
+    return true;
+}
+
+// Writer thread: completes the object header, renames the file into place and indexes it
+static void store_capture(const string &key, CachedResponse &entry)
+{
+    DiskObjectHeader object{};
+    memcpy(object.magic, OBJECT_MAGIC, sizeof(OBJECT_MAGIC));
+    object.key_length = key.size();
+    object.vary_length = entry.head_offset - sizeof(DiskObjectHeader) - key.size();
+    object.head_length = entry.head_size;
+    object.body_length = entry.body_size;
+    object.stored = entry.stored;
+    object.expires = entry.expires;
+    object.chunked = entry.chunked;
+
+    if (pwrite(entry.fd, &object, sizeof(object), 0) != (ssize_t)sizeof(object))
+        return; // the entry removes its temporary file
+
+    size_t size = entry.body_offset + entry.body_size;
+    uint64_t key_hash = hash_key(key);
+    uint64_t file_id, replaced = 0;
+    vector<uint64_t> dropped;
+
+    {
+        lock_guard<shared_mutex> lock(index_lock);
+        if (!header)
+            return;
+
+        if (entry_count + removed_count + 1 > header->slot_count * 3 / 4)
+            compact(dropped);
+        if (entry_count + 1 > header->slot_count * 3 / 4)
+        {
+            evict_cv.notify_one();
+            file_id = 0; // index full until the evictor catches up
+        }
+        else
+        {
+            file_id = header->next_file_id++;
+        }
+    }
+
+    for (uint64_t id : dropped)
+        unlink(object_path(id).c_str());
+    if (file_id == 0)
+        return;
+
+    string path = object_path(file_id);
+    if (rename(entry.temp_path.c_str(), path.c_str()) < 0)
+        return;
+    entry.temp_path.clear();
+
+    bool over_cap, unindexed = false;
+    {
+        lock_guard<shared_mutex> lock(index_lock);
+        if (!header)
+            return;
+
+        DiskIndexSlot *existing = probe(key_hash, false);
+        if (existing)
+            replaced = remove_slot(*existing);
+
+        DiskIndexSlot slot{};
+        slot.key_hash = key_hash;
+        slot.file_id = file_id;
+        slot.stored = entry.stored;
+        slot.expires = entry.expires;
+        slot.last_used = entry.stored;
+        slot.size = size;
+        if (!insert_slot(slot))
+            unindexed = true;
+
+        over_cap = used_bytes > max_total;
+        publish_usage();
+    }
+
+    if (replaced)
+        unlink(object_path(replaced).c_str());
+    if (unindexed)
+        unlink(path.c_str()); // no free slot after all
+
+    if (over_cap)
+        evict_cv.notify_one(); // eviction unlinks files, so it stays off the event loops
+}
+
+void disk_cache_store(const string &key, CachedResponse &entry)
+{
+    CachedResponse *capture = &entry;
+    queue_write([capture, key]()
+                {
+        if (!capture->write_failed)
+            store_capture(key, *capture); }, 0, false);
+}
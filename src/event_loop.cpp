@@ -0,0 +1,423 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include "event_loop.h"
+#include "io_ring.h"
+
+using namespace std;
+
+#define MAX_EVENTS 256
+#define TICK_INTERVAL_MS 1000
+#define RING_ENTRIES 256
+
+// Completions carry the Watch's address, so a removed one stays allocated until the kernel
+// confirms the cancellation
+struct EventLoop::Watch
+{
+    Channel *channel; // null once removed
+    int fd;
+    uint32_t events;
+    bool accept; // multishot accept instead of multishot poll
+};
+
+void EventHandler::on_accept(Channel *, int client_fd)
+{
+    close(client_fd);
+}
+
+EventLoop::EventLoop(IoBackend backend) : epoll_fd(-1), quit(false), shutdown_notified(false)
+{
+    if (backend == IoBackend::IO_URING)
+    {
+        ring.reset(new IoRing());
+        if (!ring->init(RING_ENTRIES))
+            ring.reset(); // backend() now reports EPOLL
+    }
+
+    if (!ring)
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0)
+            perror("epoll_create1");
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0)
+        perror("eventfd");
+
+    wake_channel.fd = wake_fd; // handler stays null, which marks the wakeup channel
+    add_fd(&wake_channel, EPOLLIN | EPOLLET);
+}
+
+EventLoop::~EventLoop()
+{
+    handlers.clear();
+    graveyard.clear();
+
+    ring.reset(); // the kernel cancels whatever is still armed
+    for (auto &entry : watches)
+        delete entry.second;
+    for (Watch *watch : cancelled)
+        delete watch;
+
+    if (wake_fd >= 0)
+        close(wake_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+}
+
+void EventLoop::run()
+{
+    epoll_event events[MAX_EVENTS];
+    auto last_tick = chrono::steady_clock::now();
+
+    if (ring && !ring->enable()) // submissions come from this thread from now on
+    {
+        perror("io_uring_register");
+        return;
+    }
+
+    while (true)
+    {
+        if (quit.load() && !shutdown_notified)
+        {
+            shutdown_notified = true;
+
+            vector<shared_ptr<EventHandler>> current; // handlers may detach while being notified
+            for (auto &entry : handlers)
+                current.push_back(entry.second);
+            for (auto &handler : current)
+                handler->on_shutdown();
+
+            graveyard.clear();
+        }
+
+        if (shutdown_notified && handlers.empty())
+        {
+            lock_guard<mutex> lock(post_mutex);
+            if (posted.empty())
+                break;
+        }
+
+        int n = 0;
+
+        if (ring)
+        {
+            // Until its cancel is submitted, the kernel keeps a removed socket's file open
+            vector<Watch *> retry;
+            retry.swap(uncancelled);
+            for (Watch *watch : retry)
+            {
+                if (!cancel(watch))
+                    uncancelled.push_back(watch);
+            }
+
+            // One io_uring_enter() submits everything queued since the last one and waits
+            if (!ring->submit_and_wait(TICK_INTERVAL_MS))
+            {
+                perror("io_uring_enter");
+                break;
+            }
+        }
+        else
+        {
+            n = epoll_wait(epoll_fd, events, MAX_EVENTS, TICK_INTERVAL_MS);
+            if (n < 0 && errno != EINTR)
+            {
+                perror("epoll_wait");
+                break;
+            }
+        }
+
+        auto woke = chrono::steady_clock::now();
+
+        if (ring)
+            reap();
+
+        for (int i = 0; i < n; ++i)
+            dispatch(static_cast<Channel *>(events[i].data.ptr), events[i].events);
+
+        run_posted();
+
+        auto now = chrono::steady_clock::now();
+        if (now - last_tick >= chrono::milliseconds(TICK_INTERVAL_MS))
+        {
+            last_tick = now;
+
+            vector<shared_ptr<EventHandler>> current;
+            for (auto &entry : handlers)
+                current.push_back(entry.second);
+            for (auto &handler : current)
+                handler->on_tick(now);
+
+            for (auto &fn : periodic)
+                fn(now);
+
+            vector<Watch *> retry;
+            retry.swap(unarmed);
+            for (Watch *watch : retry)
+            {
+                if (!arm(watch))
+                    unarmed.push_back(watch);
+            }
+        }
+
+        graveyard.clear(); // no event of this iteration can reference these anymore
+        busy += chrono::steady_clock::now() - woke;
+    }
+
+    graveyard.clear();
+}
+
+void EventLoop::dispatch(Channel *channel, uint32_t events)
+{
+    if (channel->handler == nullptr)
+    {
+        uint64_t value;
+        while (read(wake_fd, &value, sizeof(value)) > 0) // drain the wakeup counter
+            ;
+        return;
+    }
+
+    channel->handler->on_event(channel, events);
+}
+
+// Handles every completion the kernel has posted
+void EventLoop::reap()
+{
+    while (io_uring_cqe *cqe = ring->peek())
+    {
+        Watch *watch = (Watch *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        ring->seen();
+
+        if (!watch) // a cancellation's own completion
+            continue;
+
+        if (res >= 0 && watch->accept)
+        {
+            if (watch->channel)
+                watch->channel->handler->on_accept(watch->channel, res);
+            else
+                close(res);
+        }
+        else if (res >= 0 && watch->channel)
+        {
+            dispatch(watch->channel, res); // a poll completes with the ready events
+        }
+
+        if (more)
+            continue;
+
+        // The kernel ended the request: cancelled, failed, or out of completion space
+        if (!watch->channel)
+        {
+            cancelled.erase(watch);
+            auto pending = find(uncancelled.begin(), uncancelled.end(), watch);
+            if (pending != uncancelled.end()) // ended before its cancel went out
+                uncancelled.erase(pending);
+            delete watch;
+        }
+        else if (res < 0)
+        {
+            unarmed.push_back(watch); // before the handler runs, since it may remove the fd
+
+            if (watch->accept)
+            {
+                errno = -res;
+                perror("accept");
+            }
+            else
+            {
+                dispatch(watch->channel, EPOLLERR | EPOLLHUP);
+            }
+        }
+        else if (!arm(watch))
+        {
+            unarmed.push_back(watch);
+        }
+    }
+}
+
+bool EventLoop::arm(Watch *watch)
+{
+    io_uring_sqe *sqe = ring->get_sqe();
+    if (!sqe)
+        return false;
+
+    sqe->fd = watch->fd;
+    sqe->user_data = (uintptr_t)watch;
+
+    if (watch->accept)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = watch->events;
+        sqe->len = IORING_POLL_ADD_MULTI | ((watch->events & EPOLLET) ? 0 : IORING_POLL_ADD_LEVEL);
+    }
+
+    return true;
+}
+
+bool EventLoop::cancel(Watch *watch)
+{
+    io_uring_sqe *sqe = ring->get_sqe();
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)watch;
+    return true;
+}
+
+void EventLoop::stop()
+{
+    quit.store(true);
+
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void EventLoop::post(function<void()> fn)
+{
+    {
+        lock_guard<mutex> lock(post_mutex);
+        posted.push_back(move(fn));
+    }
+
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void EventLoop::run_posted()
+{
+    vector<function<void()>> batch;
+
+    {
+        lock_guard<mutex> lock(post_mutex);
+        batch.swap(posted);
+    }
+
+    for (auto &fn : batch)
+        fn();
+}
+
+bool EventLoop::add_fd(Channel *channel, uint32_t events)
+{
+    if (ring)
+    {
+        remove_fd(channel->fd); // a stale watch from an fd closed without close_fd()
+
+        Watch *watch = new Watch{channel, channel->fd, events, false};
+        if (!arm(watch))
+        {
+            delete watch;
+            return false;
+        }
+
+        watches[channel->fd] = watch;
+        return true;
+    }
+
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.ptr = channel;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, channel->fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        return false;
+    }
+
+    return true;
+}
+
+bool EventLoop::accept_fd(Channel *channel)
+{
+    if (!ring)
+        return false;
+
+    remove_fd(channel->fd);
+
+    Watch *watch = new Watch{channel, channel->fd, 0, true};
+    if (!arm(watch))
+    {
+        delete watch;
+        return false;
+    }
+
+    watches[channel->fd] = watch;
+    return true;
+}
+
+void EventLoop::remove_fd(int fd)
+{
+    if (!ring)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        return;
+    }
+
+    auto found = watches.find(fd);
+    if (found == watches.end())
+        return;
+
+    Watch *watch = found->second;
+    watches.erase(found);
+
+    auto idle = find(unarmed.begin(), unarmed.end(), watch);
+    if (idle != unarmed.end()) // nothing in the kernel refers to it
+    {
+        unarmed.erase(idle);
+        delete watch;
+        return;
+    }
+
+    watch->channel = nullptr;
+    cancelled.insert(watch);
+
+    // Submitted with the next wait; completions already posted are ignored through the null channel
+    if (!cancel(watch))
+        uncancelled.push_back(watch);
+}
+
+void EventLoop::close_fd(int fd)
+{
+    if (ring) // epoll forgets a closed socket by itself
+        remove_fd(fd);
+
+    close(fd);
+}
+
+void EventLoop::add_periodic(function<void(chrono::steady_clock::time_point)> fn)
+{
+    periodic.push_back(move(fn));
+}
+
+void EventLoop::attach(shared_ptr<EventHandler> handler)
+{
+    EventHandler *key = handler.get();
+    handlers[key] = move(handler);
+}
+
+void EventLoop::detach(EventHandler *handler)
+{
+    auto it = handlers.find(handler);
+    if (it == handlers.end())
+        return;
+
+    graveyard.push_back(move(it->second));
+    handlers.erase(it);
+}
@@ -1,29 +1,175 @@
 #include <unistd.h>
+#include <fcntl.h>
 #include <cstring>
-#include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
-#include <sys/time.h>
 #include <errno.h>
 #include "global_config.h"
 #include "forwarder.h"
+#include "resolver.h"
+#include "upstream_pool.h"
+#include "response_cache.h"
+#include "collapsed_forwarding.h"
+#include "metrics.h"
+#include "server.h"
 
 using namespace std;
 
 #define BUFFER_SIZE 4096
+#define SPLICE_CHUNK 65536 // default pipe capacity
 
-bool send_all(int fd, const char *buf, size_t len)
+static void refresh_deadline(Connection &conn)
 {
-    size_t total_sent = 0;
+    conn.deadline = chrono::steady_clock::now() + chrono::seconds(global_config.connection_timeout_sec);
+}
+
+static size_t micros_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// The response header is about to reach the client
+static void record_first_byte(Connection &conn)
+{
+    metrics_record_latency(Latency::FIRST_BYTE, micros_since(conn.request_start));
+}
+
+static void attach_upstream(Connection &conn, int server_fd)
+{
+    conn.upstream.fd = server_fd;
+    conn.state = ConnState::CONNECTING;
+    refresh_deadline(conn);
+
+    // Edge-triggered registration reports EPOLLOUT once the connect completes
+    if (!conn.loop.add_fd(&conn.upstream, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+        finish_connection(conn);
+}
 
-    while (total_sent < len)
+static void connect_upstream(Connection &conn, const sockaddr_in &addr)
+{
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0)
+    {
+        metrics_record_error(ProxyError::CONNECT);
+        finish_connection(conn);
+        return;
+    }
+
+    conn.connect_start = chrono::steady_clock::now();
+
+    if (connect(server_fd, (const sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
     {
-        ssize_t sent = send(fd, buf + total_sent, len - total_sent, 0);
+        close(server_fd);
+        metrics_record_error(ProxyError::CONNECT);
+        finish_connection(conn);
+        return;
+    }
+
+    attach_upstream(conn, server_fd);
+}
+
+static void start_upstream(Connection &conn)
+{
+    weak_ptr<Connection> weak = conn.shared_from_this();
+
+    resolve_async(conn.loop, conn.req.host, conn.req.port, [weak](bool ok, const sockaddr_in &addr)
+                  {
+        shared_ptr<Connection> conn = weak.lock();
+        if (!conn || conn->state != ConnState::RESOLVING)
+            return; // timed out while the lookup was running
+
+        if (!ok)
+        {
+            metrics_record_error(ProxyError::DNS);
+            finish_connection(*conn);
+            return;
+        }
+
+        connect_upstream(*conn, addr); });
+}
+
+// One gather write of whatever is left of a memory-tier response: stored header, generated
+// Age and Connection lines, then the stored body, without copying any of them
+static ssize_t send_parts(Connection &conn, const string *const parts[3])
+{
+    iovec iov[3];
+    int count = 0;
+    size_t skip = conn.cache_sent;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if (skip >= parts[i]->size())
+        {
+            skip -= parts[i]->size();
+            continue;
+        }
+
+        iov[count].iov_base = (void *)(parts[i]->data() + skip);
+        iov[count].iov_len = parts[i]->size() - skip;
+        count++;
+        skip = 0;
+    }
+
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    return sendmsg(conn.client.fd, &msg, MSG_NOSIGNAL);
+}
+
+// Sends a cache hit as far as the client socket allows; afterwards the client is kept or closed as after a relayed response
+static void serve_cached(Connection &conn)
+{
+    const CachedResponse &cached = *conn.cache_hit;
+    const string *parts[3] = {&cached.head, &conn.cache_tail, &cached.body};
+    size_t total = cached.fd >= 0 ? cached.head_size + conn.cache_tail.size() + cached.body_size
+                                  : cached.head.size() + conn.cache_tail.size() + cached.body.size();
+
+    while (conn.cache_sent < total && conn.client_io.writable)
+    {
+        ssize_t sent;
+
+        if (cached.fd >= 0)
+        {
+            // Disk tier: the stored header and body go from the page cache to the socket with sendfile()
+            size_t pos = conn.cache_sent;
+            size_t tail_end = cached.head_size + conn.cache_tail.size();
+
+            if (pos < cached.head_size)
+            {
+                off_t offset = cached.head_offset + pos;
+                sent = sendfile(conn.client.fd, cached.fd, &offset, cached.head_size - pos);
+            }
+            else if (pos < tail_end)
+            {
+                int more = cached.body_size > 0 ? MSG_MORE : 0;
+                sent = send(conn.client.fd, conn.cache_tail.data() + pos - cached.head_size, tail_end - pos, MSG_NOSIGNAL | more);
+            }
+            else
+            {
+                off_t offset = cached.body_offset + (pos - tail_end);
+                sent = sendfile(conn.client.fd, cached.fd, &offset, total - pos);
+            }
+
+            if (sent == 0)
+            {
+                finish_connection(conn); // content file shorter than its index entry
+                return;
+            }
+        }
+        else
+        {
+            sent = send_parts(conn, parts);
+        }
 
         if (sent > 0)
         {
-            total_sent += sent;
+            conn.cache_sent += sent;
+            conn.bytes += sent;
+            refresh_deadline(conn);
             continue;
         }
 
@@ -31,7 +177,123 @@ bool send_all(int fd, const char *buf, size_t len)
             continue;
 
         if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
-            return false;
+        {
+            conn.client_io.writable = false;
+            return;
+        }
+
+        finish_connection(conn);
+        return;
+    }
+
+    if (conn.cache_sent < total)
+        return;
+
+    if (conn.keep_client)
+        next_request(conn);
+    else
+        finish_connection(conn);
+}
+
+static void fetch_upstream(Connection &conn);
+static void follow_flight(Connection &conn);
+
+void forward_tcp(Connection &conn)
+{
+    if (response_cache_enabled() && conn.req.method == "GET" && conn.req.body.kind == BodyKind::NONE)
+    {
+        conn.cache_hit = response_cache_lookup(conn.req);
+        conn.cache_status = !conn.cache_hit ? "MISS" : conn.cache_hit->fd >= 0 ? "DISK_HIT" : "HIT";
+    }
+
+    if (conn.cache_hit)
+    {
+        conn.keep_client = conn.req.keep_alive && conn.requests_served + 1 < global_config.client_max_requests;
+        conn.cache_tail = "Age: " + to_string(time(nullptr) - conn.cache_hit->stored) +
+                          (conn.keep_client ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+        conn.state = ConnState::RELAYING;
+        record_first_byte(conn);
+        serve_cached(conn);
+        return;
+    }
+
+    // Concurrent identical requests share one origin fetch
+    if (global_config.collapsed_forwarding && request_shareable(conn.req))
+    {
+        bool leader;
+        conn.flight = flight_join(response_cache_key(conn.req), leader, conn.flight_cursor);
+        conn.flight_leader = leader;
+
+        if (!leader)
+        {
+            follow_flight(conn);
+            return;
+        }
+    }
+
+    fetch_upstream(conn);
+}
+
+static void fetch_upstream(Connection &conn)
+{
+    conn.to_upstream.assign(conn.req.raw_request);
+
+    // Body bytes that arrived with the header; anything after the body is the next pipelined request
+    size_t used = advance_body(conn.req.body, conn.header_data.data(), conn.header_data.size());
+    conn.to_upstream.append(conn.header_data.data(), used);
+    conn.header_data.erase(0, used);
+    conn.bytes += used;
+    conn.body_bytes += used;
+
+    if (conn.req.body.malformed)
+    {
+        reject_request_body(conn); // before any origin connection is used
+        return;
+    }
+
+    int pooled_fd = upstream_pool_acquire(conn.loop, conn.req.host, conn.req.port);
+    if (pooled_fd >= 0)
+    {
+        conn.reused_upstream = true; // already connected: no lookup, no handshake
+        attach_upstream(conn, pooled_fd);
+        return;
+    }
+
+    start_upstream(conn);
+}
+
+void tunnel_tcp(Connection &conn)
+{
+    // Bytes the client pipelined behind the CONNECT header belong to the tunnel
+    conn.to_upstream.assign(conn.header_data);
+    conn.bytes += conn.to_upstream.length;
+    string().swap(conn.header_data);
+
+    start_upstream(conn);
+}
+
+// Writes buf to dst until it is empty or dst would block; false on a hard error
+static bool flush_buffer(Connection &conn, Channel &dst, SocketState &dst_io, RelayBuffer &buf)
+{
+    while (!buf.empty() && dst_io.writable)
+    {
+        ssize_t sent = send(dst.fd, buf.data.data() + buf.offset, buf.pending(), MSG_NOSIGNAL);
+
+        if (sent > 0)
+        {
+            buf.offset += sent;
+            refresh_deadline(conn);
+            continue;
+        }
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            dst_io.writable = false;
+            return true;
+        }
 
         return false;
     }
@@ -39,161 +301,664 @@ bool send_all(int fd, const char *buf, size_t len)
     return true;
 }
 
-void apply_socket_timeout(int fd, int timeout_sec) // Applying the timeout
+// Ends a leader's collapsed fetch; followers of an unfinished one stop or fetch on their own
+static void end_flight(Connection &conn, bool ok)
 {
-    timeval tv{};
-    tv.tv_sec = timeout_sec;
-    tv.tv_usec = 0;
+    if (conn.flight_leader)
+        flight_finish(*conn.flight, ok);
 
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    conn.flight.reset();
+    conn.flight_cursor.reset();
+    conn.flight_leader = false;
 }
 
-size_t forward_tcp(int client_fd, const HttpRequest &req)
+void release_flight(Connection &conn)
 {
-    size_t total_bytes = 0;
+    end_flight(conn, false);
+}
 
-    apply_socket_timeout(client_fd, global_config.connection_timeout_sec);
+static void serve_flight(Connection &conn);
 
-    addrinfo hints{}, *res = nullptr;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+static function<void()> flight_wake(Connection &conn)
+{
+    weak_ptr<Connection> weak = conn.shared_from_this();
 
-    if (getaddrinfo(req.host.c_str(), to_string(req.port).c_str(), &hints, &res) != 0)
+    return [weak]()
     {
-        close(client_fd);
-        return total_bytes;
-    }
+        shared_ptr<Connection> conn = weak.lock();
+        if (conn && conn->state == ConnState::RELAYING && conn->flight && !conn->flight_leader)
+            serve_flight(*conn);
+    };
+}
 
-    int server_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (server_fd < 0)
+// The leader's response cannot be shared, or did not arrive in time: fetch it separately
+static void leave_flight(Connection &conn)
+{
+    end_flight(conn, false);
+    metrics_record_collapsed(false);
+
+    conn.cache_status = "MISS";
+    conn.state = ConnState::RESOLVING;
+    refresh_deadline(conn);
+    fetch_upstream(conn);
+}
+
+// Streams the leader's response to a follower from the shared chunks, as far as the client socket allows
+static void serve_flight(Connection &conn)
+{
+    Flight &flight = *conn.flight;
+
+    if (!conn.flight_head_sent)
     {
-        freeaddrinfo(res);
-        close(client_fd);
-        return total_bytes;
+        FlightState state = flight_wait_head(flight, conn.loop, flight_wake(conn));
+        if (state == FlightState::WAITING_HEAD)
+            return;
+
+        if (state == FlightState::FAILED || (flight.chunked && !conn.req.http11)) // HTTP/1.0 clients cannot read chunked bodies
+        {
+            leave_flight(conn);
+            return;
+        }
+
+        conn.keep_client = conn.req.keep_alive && !flight.until_close &&
+                           conn.requests_served + 1 < global_config.client_max_requests;
+        conn.to_client.assign(flight.head + (conn.keep_client ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n"));
+        conn.flight_head_sent = true;
+        record_first_byte(conn);
+        refresh_deadline(conn);
     }
 
-    apply_socket_timeout(server_fd, global_config.connection_timeout_sec);
+    if (!flush_buffer(conn, conn.client, conn.client_io, conn.to_client))
+    {
+        finish_connection(conn);
+        return;
+    }
 
-    if (connect(server_fd, res->ai_addr, res->ai_addrlen) < 0)
+    while (conn.to_client.empty() && conn.client_io.writable)
     {
-        freeaddrinfo(res);
-        close(server_fd);
-        close(client_fd);
-        return total_bytes;
+        const FlightChunk &chunk = *conn.flight_cursor;
+
+        if (conn.flight_offset == chunk.data.size())
+        {
+            FlightState state;
+            shared_ptr<FlightChunk> next = flight_next(flight, chunk, state, conn.loop, flight_wake(conn));
+
+            if (next)
+            {
+                conn.flight_cursor = move(next); // the chunk just sent is freed once every follower moved past it
+                conn.flight_offset = 0;
+                continue;
+            }
+
+            if (state == FlightState::DONE)
+            {
+                metrics_record_collapsed(true);
+                end_flight(conn, true);
+
+                if (conn.keep_client)
+                    next_request(conn);
+                else
+                    finish_connection(conn);
+            }
+            else if (state == FlightState::FAILED)
+            {
+                finish_connection(conn); // the origin cut the shared response short, or this client fell too far behind
+            }
+            return;
+        }
+
+        ssize_t sent = send(conn.client.fd, chunk.data.data() + conn.flight_offset, chunk.data.size() - conn.flight_offset, MSG_NOSIGNAL);
+
+        if (sent > 0)
+        {
+            conn.flight_offset += sent;
+            conn.bytes += sent;
+            refresh_deadline(conn);
+            continue;
+        }
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            conn.client_io.writable = false;
+            return;
+        }
+
+        finish_connection(conn);
+        return;
     }
+}
+
+static void follow_flight(Connection &conn)
+{
+    conn.cache_status = "COLLAPSED";
+    conn.state = ConnState::RELAYING;
+    conn.deadline = chrono::steady_clock::now() + chrono::seconds(global_config.collapsed_forwarding_wait_sec);
+
+    serve_flight(conn);
+}
+
+bool relay_deadline_passed(Connection &conn)
+{
+    if (!conn.flight || conn.flight_leader || conn.flight_head_sent)
+        return false;
 
-    freeaddrinfo(res);
+    leave_flight(conn); // waited too long for the leader's response header
+    return true;
+}
 
-    if (!send_all(server_fd, req.raw_request.c_str(), req.raw_request.size()))
+// Moves bytes from src to dst through buf until either socket would block; false on a hard error.
+// With framing, reading stops at the end of the HTTP message body.
+static bool pump(Connection &conn, Channel &src, SocketState &src_io, Channel &dst, SocketState &dst_io,
+                 RelayBuffer &buf, BodyFraming *framing)
+{
+    while (true)
     {
-        close(server_fd);
-        close(client_fd);
-        return total_bytes;
+        if (!flush_buffer(conn, dst, dst_io, buf))
+            return false;
+
+        if (!buf.empty())
+            return true;
+
+        size_t limit = framing ? body_read_limit(*framing, SIZE_MAX) : SIZE_MAX;
+        if (src_io.eof || !src_io.readable || limit == 0)
+        {
+            buf.release_if_empty(); // nothing in flight: the buffer goes back to the pool
+            return true;
+        }
+
+        size_t size;
+        char *space = buf.read_space(size);
+        limit = min(limit, size);
+
+        ssize_t n = recv(src.fd, space, limit, 0);
+
+        if (n > 0)
+        {
+            conn.bytes += n;
+            refresh_deadline(conn);
+            buf.record_read(n, size);
+
+            size_t used = framing ? advance_body(*framing, buf.data.data(), n) : n;
+            if (framing == &conn.req.body)
+            {
+                conn.body_bytes += used;
+                conn.header_data.append(buf.data.data() + used, n - used); // the client's next pipelined request
+            }
+            else if (used < (size_t)n)
+            {
+                conn.resp.keep_alive = false; // origin sent bytes past the end of the message
+            }
+
+            if (conn.flight_leader && framing == &conn.resp.body)
+                flight_append(*conn.flight, buf.data.data(), used);
+
+            if (conn.cache_fill && framing == &conn.resp.body && !response_cache_append(*conn.cache_fill, buf.data.data(), used))
+                conn.cache_fill.reset(); // grew past response_cache_max_object_kb
+
+            buf.offset = 0;
+            buf.length = used;
+            continue;
+        }
+
+        if (n == 0)
+        {
+            src_io.eof = true;
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            src_io.readable = false;
+            continue;
+        }
+
+        return false;
     }
+}
 
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes;
+// Zero-copy variant of pump(): src -> pipe -> dst with splice(); buf only holds proxy-generated bytes.
+// framing must not be chunked, since spliced bytes are never inspected.
+static bool pump_splice(Connection &conn, Channel &src, SocketState &src_io, Channel &dst, SocketState &dst_io,
+                        RelayBuffer &buf, SplicePipe &pipe, BodyFraming *framing)
+{
+    if (!flush_buffer(conn, dst, dst_io, buf))
+        return false;
 
-    while ((bytes = recv(server_fd, buffer, BUFFER_SIZE, 0)) > 0)
+    if (!buf.empty())
+        return true;
+    buf.release_if_empty();
+
+    while (true)
     {
-        if (!send_all(client_fd, buffer, bytes))
-            break;
+        if (pipe.pending > 0)
+        {
+            if (!dst_io.writable)
+                return true;
+
+            ssize_t n = splice(pipe.read_fd, nullptr, dst.fd, nullptr, pipe.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (n > 0)
+            {
+                pipe.pending -= n;
+                refresh_deadline(conn);
+                continue;
+            }
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                dst_io.writable = false;
+                return true;
+            }
+
+            return false;
+        }
+
+        if (src_io.eof || !src_io.readable)
+            return true;
+
+        size_t limit = framing ? body_read_limit(*framing, SPLICE_CHUNK) : SPLICE_CHUNK;
+        if (limit == 0)
+            return true;
+
+        // Only filled while empty, so EAGAIN below always means the socket ran dry
+        ssize_t n = splice(src.fd, nullptr, pipe.write_fd, nullptr, limit, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0)
+        {
+            pipe.pending = n;
+            conn.bytes += n;
+            refresh_deadline(conn);
+
+            if (framing)
+                advance_body(*framing, nullptr, n);
+            if (framing == &conn.req.body)
+                conn.body_bytes += n;
+            continue;
+        }
+
+        if (n == 0)
+        {
+            src_io.eof = true;
+            return true;
+        }
+
+        if (errno == EINTR)
+            continue;
 
-        total_bytes += bytes;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            src_io.readable = false;
+            return true;
+        }
+
+        if ((errno == EINVAL || errno == ENOSYS) && conn.upstream_pipe.pending == 0 && conn.client_pipe.pending == 0)
+        {
+            conn.use_splice = false; // this socket pair cannot splice; the copy loop takes over
+            return pump(conn, src, src_io, dst, dst_io, buf, framing);
+        }
+
+        return false;
     }
+}
+
+static bool open_pipe(SplicePipe &pipe)
+{
+    if (pipe.read_fd >= 0)
+        return true; // kept from an earlier request on this client connection
 
-    close(server_fd);
-    close(client_fd);
-    return total_bytes;
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+        return false;
+
+    pipe.read_fd = fds[0];
+    pipe.write_fd = fds[1];
+    return true;
+}
+
+static void close_pipe(SplicePipe &pipe)
+{
+    if (pipe.read_fd >= 0)
+        close(pipe.read_fd);
+    if (pipe.write_fd >= 0)
+        close(pipe.write_fd);
+
+    pipe.read_fd = -1;
+    pipe.write_fd = -1;
+    pipe.pending = 0;
 }
 
-size_t tunnel_tcp(int client_fd, const HttpRequest &req)
+void close_relay_pipes(Connection &conn)
 {
-    size_t total_bytes = 0;
+    close_pipe(conn.upstream_pipe);
+    close_pipe(conn.client_pipe);
+}
+
+static bool upstream_connected(Connection &conn)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(conn.upstream.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        return false;
 
-    apply_socket_timeout(client_fd, global_config.connection_timeout_sec);
+    conn.state = ConnState::RELAYING;
 
-    addrinfo hints{}, *res = nullptr;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    if (!conn.reused_upstream)
+        metrics_record_latency(Latency::UPSTREAM_CONNECT, micros_since(conn.connect_start));
 
-    if (getaddrinfo(req.host.c_str(),
-                    to_string(req.port).c_str(),
-                    &hints,
-                    &res) != 0)
+    bool tunnel = conn.req.method == "CONNECT";
+    if (tunnel)
     {
-        close(client_fd);
-        return total_bytes;
+        conn.to_client.assign("HTTP/1.0 200 Connection Established\r\n\r\n");
+        conn.tunnel_open = true;
+        metrics_record_tunnel(true);
     }
 
-    int server_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (server_fd < 0)
+    if (global_config.enable_splice)
     {
-        freeaddrinfo(res);
-        close(client_fd);
-        return total_bytes;
+        // Without a pipe (e.g. fd limit reached) the connection simply keeps copying
+        bool uploads = tunnel || conn.req.body.kind == BodyKind::LENGTH;
+        conn.use_splice = open_pipe(conn.client_pipe) && (!uploads || open_pipe(conn.upstream_pipe));
     }
 
-    apply_socket_timeout(server_fd, global_config.connection_timeout_sec);
+    return true;
+}
 
-    if (connect(server_fd, res->ai_addr, res->ai_addrlen) < 0)
-    {
-        freeaddrinfo(res);
-        close(server_fd);
-        close(client_fd);
-        return total_bytes;
-    }
+static bool is_idempotent(const string &method)
+{
+    return method == "GET" || method == "HEAD" || method == "OPTIONS";
+}
+
+// A pooled socket the origin closed just before we reused it: send the request again on a fresh connection
+static bool retry_stale_upstream(Connection &conn)
+{
+    if (!conn.reused_upstream || !conn.response_head.empty() || !is_idempotent(conn.req.method) ||
+        conn.req.body.kind != BodyKind::NONE)
+        return false;
 
-    freeaddrinfo(res);
+    conn.loop.close_fd(conn.upstream.fd);
+    conn.upstream.fd = -1;
+    conn.upstream_io = SocketState();
+    close_relay_pipes(conn);
+    conn.use_splice = false;
 
-    const char *resp =
-        "HTTP/1.0 200 Connection Established\r\n\r\n";
+    conn.reused_upstream = false;
+    conn.state = ConnState::RESOLVING;
+    conn.to_upstream.assign(conn.req.raw_request);
 
-    send_all(client_fd, resp, strlen(resp));
+    start_upstream(conn);
+    return true;
+}
 
-    fd_set fds;
+// Reads the origin's response header; true once the body can be relayed
+static bool read_response_head(Connection &conn)
+{
     char buffer[BUFFER_SIZE];
 
     while (true)
     {
-        FD_ZERO(&fds);
-        FD_SET(client_fd, &fds);
-        FD_SET(server_fd, &fds);
+        ParseResult result = parse_http_response(conn.response_head, conn.req.method, conn.resp);
+
+        if (result == PARSE_ERROR)
+        {
+            metrics_record_error(ProxyError::UPSTREAM);
+            finish_connection(conn);
+            return false;
+        }
+
+        if (result == PARSE_OK)
+        {
+            if (conn.resp.status >= 100 && conn.resp.status < 200 && conn.resp.status != 101)
+            {
+                // Interim response (100 Continue): pass it on and wait for the final one
+                conn.to_client.append(conn.response_head.data(), conn.resp.header_length);
+                conn.response_head.erase(0, conn.resp.header_length);
+                continue;
+            }
+
+            conn.keep_client = conn.req.keep_alive &&
+                               conn.resp.body.kind != BodyKind::UNTIL_CLOSE && conn.resp.status != 101 &&
+                               conn.requests_served + 1 < global_config.client_max_requests;
+
+            string head = conn.resp.head + (conn.keep_client ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+            conn.to_client.append(head.data(), head.size());
+            record_first_byte(conn);
+
+            const char *rest = conn.response_head.data() + conn.resp.header_length;
+            size_t rest_len = conn.response_head.size() - conn.resp.header_length;
+
+            if (conn.cache_status)
+                conn.cache_fill = response_cache_begin(conn.req, conn.resp);
+
+            if (conn.flight_leader && response_shareable(conn.resp))
+                flight_publish_head(*conn.flight, conn.resp.head, conn.resp.body.kind == BodyKind::UNTIL_CLOSE,
+                                    conn.resp.body.kind == BodyKind::CHUNKED);
+            else if (conn.flight_leader)
+                end_flight(conn, false); // its followers fetch on their own
+
+            size_t used = advance_body(conn.resp.body, rest, rest_len);
+            if (used < rest_len)
+                conn.resp.keep_alive = false; // origin sent bytes past the end of the message
+            conn.to_client.append(rest, used);
+
+            if (conn.cache_fill && !response_cache_append(*conn.cache_fill, rest, used))
+                conn.cache_fill.reset();
+
+            if (conn.flight_leader)
+                flight_append(*conn.flight, rest, used);
+
+            conn.response_parsed = true;
+            string().swap(conn.response_head);
+            return true;
+        }
+
+        if (!conn.upstream_io.readable)
+            return false;
+
+        ssize_t n = recv(conn.upstream.fd, buffer, BUFFER_SIZE, 0);
 
-        int max_fd = max(client_fd, server_fd) + 1;
+        if (n > 0)
+        {
+            conn.response_head.append(buffer, n);
+            conn.bytes += n;
+            refresh_deadline(conn);
+            continue;
+        }
 
-        timeval tv{};
-        tv.tv_sec = global_config.connection_timeout_sec;
-        tv.tv_usec = 0;
+        if (n < 0 && errno == EINTR)
+            continue;
 
-        if (select(max_fd, &fds, NULL, NULL, &tv) <= 0)
-            break;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            conn.upstream_io.readable = false;
+            return false;
+        }
 
-        if (FD_ISSET(client_fd, &fds))
+        if (!retry_stale_upstream(conn)) // closed or reset before the response header was complete
         {
-            ssize_t n = recv(client_fd, buffer, sizeof(buffer), 0);
-            if (n <= 0)
-                break;
-            if (!send_all(server_fd, buffer, n))
-                break;
+            metrics_record_error(ProxyError::UPSTREAM);
+            finish_connection(conn);
+        }
+        return false;
+    }
+}
+
+// The response was fully relayed: park the origin connection for reuse when it allows it,
+// then either wait for the client's next request or close
+static void complete_response(Connection &conn)
+{
+    if (conn.cache_fill)
+        response_cache_store(conn.req, move(conn.cache_fill));
+
+    end_flight(conn, true);
+
+    // The origin may answer before the whole upload arrived (e.g. 413); neither side can be reused then
+    bool request_sent = conn.req.body.done && conn.to_upstream.empty() && conn.upstream_pipe.pending == 0;
+
+    if (conn.resp.keep_alive && conn.resp.body.done && !conn.upstream_io.eof && request_sent)
+    {
+        conn.loop.remove_fd(conn.upstream.fd);
+        upstream_pool_release(conn.loop, conn.req.host, conn.req.port, conn.upstream.fd);
+        conn.upstream.fd = -1;
+    }
+
+    if (conn.keep_client && request_sent)
+        next_request(conn);
+    else
+        finish_connection(conn);
+}
+
+// Streams the request header and body upstream. Reading stops at the end of the body, and the
+// client is only read again once the previous chunk was written, so a slow origin holds the upload back.
+static bool send_request(Connection &conn)
+{
+    BodyFraming &body = conn.req.body;
+
+    if (conn.use_splice && body.kind == BodyKind::LENGTH)
+        return pump_splice(conn, conn.client, conn.client_io, conn.upstream, conn.upstream_io, conn.to_upstream, conn.upstream_pipe, &body);
+
+    return pump(conn, conn.client, conn.client_io, conn.upstream, conn.upstream_io, conn.to_upstream, &body);
+}
+
+static void relay_http(Connection &conn)
+{
+    bool sent = send_request(conn);
+
+    if (conn.req.body.malformed)
+    {
+        reject_request_body(conn);
+        return;
+    }
+
+    if (!sent)
+    {
+        if (!retry_stale_upstream(conn))
+            finish_connection(conn);
+        return;
+    }
+
+    if (conn.client_io.eof && !conn.req.body.done)
+    {
+        finish_connection(conn); // client gave up in the middle of its upload
+        return;
+    }
+
+    if (!conn.response_parsed)
+    {
+        bool parsed = read_response_head(conn);
 
-            total_bytes += n;
+        // Interim responses are passed on right away: a client sending Expect: 100-continue waits for them
+        if (conn.state == ConnState::RELAYING && !flush_buffer(conn, conn.client, conn.client_io, conn.to_client))
+        {
+            finish_connection(conn);
+            return;
         }
 
-        if (FD_ISSET(server_fd, &fds))
+        if (!parsed)
+            return;
+    }
+
+    BodyFraming &body = conn.resp.body;
+    bool ok;
+
+    // A captured or shared body has to pass through user space
+    if (conn.use_splice && body.kind != BodyKind::CHUNKED && !conn.cache_fill && !conn.flight_leader)
+        ok = pump_splice(conn, conn.upstream, conn.upstream_io, conn.client, conn.client_io, conn.to_client, conn.client_pipe, &body);
+    else
+        ok = pump(conn, conn.upstream, conn.upstream_io, conn.client, conn.client_io, conn.to_client, &body);
+
+    if (!ok)
+    {
+        finish_connection(conn);
+        return;
+    }
+
+    bool flushed = conn.to_client.empty() && conn.client_pipe.pending == 0;
+
+    if (flushed && body.done)
+        complete_response(conn);
+    else if (flushed && conn.upstream_io.eof)
+    {
+        if (body.kind != BodyKind::UNTIL_CLOSE)
+            metrics_record_error(ProxyError::UPSTREAM);
+
+        end_flight(conn, body.kind == BodyKind::UNTIL_CLOSE);
+        finish_connection(conn); // close-delimited body ended, or the origin cut the response short
+    }
+}
+
+static void relay_tunnel(Connection &conn)
+{
+    bool ok;
+    if (conn.use_splice)
+    {
+        ok = pump_splice(conn, conn.client, conn.client_io, conn.upstream, conn.upstream_io, conn.to_upstream, conn.upstream_pipe, nullptr) &&
+             pump_splice(conn, conn.upstream, conn.upstream_io, conn.client, conn.client_io, conn.to_client, conn.client_pipe, nullptr);
+    }
+    else
+    {
+        ok = pump(conn, conn.client, conn.client_io, conn.upstream, conn.upstream_io, conn.to_upstream, nullptr) &&
+             pump(conn, conn.upstream, conn.upstream_io, conn.client, conn.client_io, conn.to_client, nullptr);
+    }
+
+    if (!ok)
+    {
+        finish_connection(conn);
+        return;
+    }
+
+    bool upstream_done = conn.upstream_io.eof && conn.to_client.empty() && conn.client_pipe.pending == 0;
+    bool client_done = conn.client_io.eof && conn.to_upstream.empty() && conn.upstream_pipe.pending == 0;
+
+    if (upstream_done || client_done)
+        finish_connection(conn);
+}
+
+void relay_data(Connection &conn)
+{
+    if (conn.cache_hit)
+    {
+        serve_cached(conn);
+        return;
+    }
+
+    if (conn.flight && !conn.flight_leader)
+    {
+        serve_flight(conn);
+        return;
+    }
+
+    if (conn.state == ConnState::CONNECTING)
+    {
+        if (!conn.upstream_io.writable)
+            return;
+
+        if (!upstream_connected(conn))
         {
-            ssize_t n = recv(server_fd, buffer, sizeof(buffer), 0);
-            if (n <= 0)
-                break;
-            if (!send_all(client_fd, buffer, n))
-                break;
+            metrics_record_error(ProxyError::CONNECT);
+            finish_connection(conn);
+            return;
+        }
 
-            total_bytes += n;
+        EventLoop *lane = conn.req.method == "CONNECT" ? tunnel_lane() : nullptr;
+        if (lane)
+        {
+            move_connection(conn, *lane); // the tunnel is relayed there from now on
+            return;
         }
     }
 
-    close(server_fd);
-    close(client_fd);
-    return total_bytes;
+    if (conn.req.method == "CONNECT")
+        relay_tunnel(conn);
+    else
+        relay_http(conn);
 }
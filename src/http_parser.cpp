@@ -1,137 +1,690 @@
-#include <unistd.h>
-#include <sys/socket.h>
-#include <errno.h>
 #include <string>
-#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "http_parser.h"
-#include "global_config.h"
 
 using namespace std;
 
-#define BUFFER_SIZE 4096
 #define MAX_HEADER_SIZE 8192
+#define MAX_RESPONSE_HEADER_SIZE 65536
 
-bool parse_http_request(int client_fd, HttpRequest &req)
+enum HeaderId
 {
-    char buffer[BUFFER_SIZE];
-    string data;
+    HEADER_OTHER,
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_PROXY_CONNECTION,
+    HEADER_KEEP_ALIVE,
+    HEADER_CONTENT_LENGTH,
+    HEADER_TRANSFER_ENCODING
+};
 
-    auto start = chrono::steady_clock::now();
+enum ChunkState
+{
+    CHUNK_SIZE, // before the first hex digit
+    CHUNK_SIZE_DIGITS,
+    CHUNK_EXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LF,
+    CHUNK_FINAL_LF
+};
 
-    while (true)
-    {
-        auto now = chrono::steady_clock::now();
+static bool parse_port(string_view s, int &port)
+{
+    if (s.empty() || s.size() > 5)
+        return false;
 
-        if (chrono::duration_cast<chrono::seconds>(now - start).count() >= global_config.connection_timeout_sec)
-        {
+    port = 0;
+    for (char c : s)
+    {
+        if (c < '0' || c > '9')
             return false;
-        }
+        port = port * 10 + (c - '0');
+    }
 
-        ssize_t bytes = recv(client_fd, buffer, BUFFER_SIZE, 0);
+    return port > 0 && port <= 65535;
+}
 
-        if (bytes > 0)
-        {
-            data.append(buffer, bytes);
-            if (data.size() > MAX_HEADER_SIZE)
-                return false;
+static char ascii_lower(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
 
-            // EARLY malformed request-line detection
-            size_t line_end = data.find("\r\n");
-            if (line_end != string::npos)
-            {
-                string request_line = data.substr(0, line_end);
+// ASCII case-insensitive comparison; lengths are compared first, so most mismatches cost nothing
+static bool iequals(string_view a, string_view b)
+{
+    if (a.size() != b.size())
+        return false;
 
-                size_t m1 = request_line.find(' ');
-                size_t m2 = request_line.find(' ', m1 + 1);
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (ascii_lower(a[i]) != ascii_lower(b[i]))
+            return false;
+    }
 
-                if (m1 == string::npos || m2 == string::npos)
-                    return false;
-            }
+    return true;
+}
 
-            // Stop reading once full headers are received
-            if (data.find("\r\n\r\n") != string::npos)
-                break;
+static string_view trim(string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
 
-            continue;
-        }
+// Connection-scoped headers that must not be forwarded to the next hop
+static bool is_hop_by_hop(string_view name)
+{
+    return iequals(name, "Connection") || iequals(name, "Proxy-Connection") || iequals(name, "Keep-Alive");
+}
 
-        if (bytes == 0)
-            return false;
+// Names the request parser acts on; the length alone rules out almost every other header
+static uint8_t classify_header(string_view name)
+{
+    switch (name.size())
+    {
+    case 4:
+        return iequals(name, "Host") ? HEADER_HOST : HEADER_OTHER;
+    case 10:
+        if (iequals(name, "Connection"))
+            return HEADER_CONNECTION;
+        return iequals(name, "Keep-Alive") ? HEADER_KEEP_ALIVE : HEADER_OTHER;
+    case 14:
+        return iequals(name, "Content-Length") ? HEADER_CONTENT_LENGTH : HEADER_OTHER;
+    case 16:
+        return iequals(name, "Proxy-Connection") ? HEADER_PROXY_CONNECTION : HEADER_OTHER;
+    case 17:
+        return iequals(name, "Transfer-Encoding") ? HEADER_TRANSFER_ENCODING : HEADER_OTHER;
+    default:
+        return HEADER_OTHER;
+    }
+}
 
-        if (errno == EINTR)
-            continue;
+static bool parse_content_length(string_view value, size_t &length)
+{
+    if (value.empty() || value.size() > 18)
+        return false;
 
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
+    length = 0;
+    for (char c : value)
+    {
+        if (c < '0' || c > '9')
             return false;
+        length = length * 10 + (c - '0');
+    }
 
-        return false;
+    return true;
+}
+
+// True if the last coding in a Transfer-Encoding list is chunked
+static bool is_chunked(string_view value)
+{
+    size_t comma = value.rfind(',');
+    if (comma != string_view::npos)
+        value = trim(value.substr(comma + 1));
+    return iequals(value, "chunked");
+}
+
+// Returns the offset of the first '\n' in [pos, end), or npos. If colon is still npos,
+// it receives the offset of the first ':' before that '\n'.
+static size_t scan_line(const char *p, size_t pos, size_t end, size_t &colon)
+{
+#ifdef __AVX2__
+    const __m256i lf32 = _mm256_set1_epi8('\n');
+    const __m256i colon32 = _mm256_set1_epi8(':');
+
+    for (; pos + 32 <= end; pos += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + pos));
+        unsigned lf_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf32));
+        unsigned colon_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, colon32));
+
+        if (lf_mask)
+            colon_mask &= (lf_mask & -lf_mask) - 1; // only colons before the line end
+        if (colon == string::npos && colon_mask)
+            colon = pos + __builtin_ctz(colon_mask);
+        if (lf_mask)
+            return pos + __builtin_ctz(lf_mask);
     }
+#endif
 
-    req.raw_request = data;
+#ifdef __SSE2__
+    const __m128i lf16 = _mm_set1_epi8('\n');
+    const __m128i colon16 = _mm_set1_epi8(':');
 
-    size_t line_end = data.find("\r\n");
-    if (line_end == string::npos)
+    for (; pos + 16 <= end; pos += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + pos));
+        unsigned lf_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf16));
+        unsigned colon_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, colon16));
+
+        if (lf_mask)
+            colon_mask &= (lf_mask & -lf_mask) - 1;
+        if (colon == string::npos && colon_mask)
+            colon = pos + __builtin_ctz(colon_mask);
+        if (lf_mask)
+            return pos + __builtin_ctz(lf_mask);
+    }
+#endif
+
+    for (; pos < end; ++pos)
+    {
+        if (p[pos] == '\n')
+            return pos;
+        if (p[pos] == ':' && colon == string::npos)
+            colon = pos;
+    }
+
+    return string::npos;
+}
+
+string_view find_header(const HttpRequest &req, const char *name)
+{
+    for (const HttpHeader &h : req.headers)
+    {
+        if (iequals(h.name, name))
+            return h.value;
+    }
+    return string_view();
+}
+
+// Request line "METHOD URI VERSION"; offsets are kept because data may still grow
+static bool parse_request_line(const string &data, size_t line_end, RequestScan &scan)
+{
+    const char *p = data.data();
+
+    const char *m1 = (const char *)memchr(p, ' ', line_end);
+    if (!m1)
         return false;
 
-    string request_line = data.substr(0, line_end);
-    size_t m1 = request_line.find(' ');
-    size_t m2 = request_line.find(' ', m1 + 1);
-    if (m1 == string::npos || m2 == string::npos)
+    const char *m2 = (const char *)memchr(m1 + 1, ' ', p + line_end - (m1 + 1));
+    if (!m2)
         return false;
 
-    req.method = request_line.substr(0, m1);
-    string uri = request_line.substr(m1 + 1, m2 - m1 - 1);
+    scan.method_end = m1 - p;
+    scan.uri_end = m2 - p;
+    scan.request_line_end = line_end;
+    return true;
+}
+
+// Everything after the blank line: resolve the destination and rewrite the header for the origin
+static ParseResult finish_request(const string &data, HttpRequest &req)
+{
+    const RequestScan &scan = req.scan;
+    string_view all(data);
 
+    string_view method = all.substr(0, scan.method_end);
+    string_view uri = all.substr(scan.method_end + 1, scan.uri_end - scan.method_end - 1);
+    string_view version = all.substr(scan.uri_end + 1, scan.request_line_end - scan.uri_end - 1);
+
+    req.method.assign(method);
+    req.http11 = version != "HTTP/1.0";
+    req.keep_alive = req.http11;
     req.port = 80;
+    req.body = BodyFraming();
+
+    req.headers.clear();
+    req.headers.reserve(scan.spans.size());
+
+    string_view host_header;
+    bool has_length = false, has_encoding = false, chunked = false;
+    size_t length = 0;
+
+    for (const HeaderSpan &span : scan.spans)
+    {
+        string_view name = all.substr(span.line_start, span.colon - span.line_start);
+        string_view value = trim(all.substr(span.colon + 1, span.line_end - span.colon - 1));
+        req.headers.push_back({name, value});
+
+        switch (span.id)
+        {
+        case HEADER_HOST:
+            if (host_header.empty())
+                host_header = value;
+            break;
+
+        case HEADER_CONNECTION:
+        case HEADER_PROXY_CONNECTION:
+            if (iequals(value, "close"))
+                req.keep_alive = false;
+            else if (iequals(value, "keep-alive"))
+                req.keep_alive = true;
+            break;
+
+        case HEADER_CONTENT_LENGTH:
+        {
+            // Repeated lengths must agree, or the origin could frame the body differently (RFC 7230 3.3.3)
+            size_t parsed;
+            if (!parse_content_length(value, parsed) || (has_length && parsed != length))
+                return PARSE_ERROR;
+            length = parsed;
+            has_length = true;
+            break;
+        }
+
+        case HEADER_TRANSFER_ENCODING:
+            has_encoding = true;
+            chunked = is_chunked(value); // the last header line holds the final coding
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // A request body is delimited by chunked or by Content-Length, never by both or by close
+    if (has_encoding && (!chunked || has_length))
+        return PARSE_ERROR;
 
-    if (req.method == "CONNECT")
+    if (method == "CONNECT")
     {
         size_t colon = uri.find(':');
-        if (colon == string::npos)
-            return false;
+        if (colon == string_view::npos)
+            return PARSE_ERROR;
 
-        req.host = uri.substr(0, colon);
-        req.port = stoi(uri.substr(colon + 1));
-        return true;
+        req.host.assign(uri.substr(0, colon));
+        if (!parse_port(uri.substr(colon + 1), req.port))
+            return PARSE_ERROR;
+        return PARSE_OK;
     }
 
-    if (uri.find("http://") == 0)
+    string_view host_port;
+    if (uri.substr(0, 7) == "http://")
     {
-        string rest = uri.substr(7);
+        string_view rest = uri.substr(7);
         size_t slash = rest.find('/');
-        req.host = (slash == string::npos) ? rest : rest.substr(0, slash);
-        req.path = (slash == string::npos) ? "/" : rest.substr(slash);
+        host_port = rest.substr(0, slash);
+        if (slash == string_view::npos)
+            req.path = "/";
+        else
+            req.path.assign(rest.substr(slash));
     }
     else
     {
-        // Absolute path
-        req.path = uri;
+        // Absolute path: the destination comes from the Host header
+        req.path.assign(uri);
+        host_port = host_header;
+    }
 
-        size_t host_pos = data.find("\r\nHost:");
-        if (host_pos == string::npos)
-            return false;
+    size_t colon = host_port.find(':');
+    req.host.assign(host_port.substr(0, colon));
+    if (colon != string_view::npos && !parse_port(host_port.substr(colon + 1), req.port))
+        return PARSE_ERROR;
+
+    if (req.host.empty())
+        return PARSE_ERROR;
+
+    if (chunked)
+    {
+        req.body.kind = BodyKind::CHUNKED;
+        req.body.chunk_state = CHUNK_SIZE;
+        req.body.strict = true; // the origin must agree with us on where the body ends
+    }
+    else if (has_length && length > 0)
+    {
+        req.body.kind = BodyKind::LENGTH;
+        req.body.remaining = length;
+    }
 
-        size_t start_h = host_pos + 7;
-        size_t end_h = data.find("\r\n", start_h);
+    req.body.done = req.body.kind == BodyKind::NONE;
 
-        string host_port = data.substr(start_h, end_h - start_h); // get the host name
-        while (!host_port.empty() && host_port[0] == ' ')         // erase any spaces if present
-            host_port.erase(0, 1);
+    // Keep the client's HTTP version so 1.0 clients never receive chunked responses
+    string &rewritten = req.raw_request;
+    rewritten.clear();
+    rewritten.reserve(req.header_length + 32);
+    rewritten.append(method).append(" ").append(req.path).append(req.http11 ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+
+    // Header lines are copied in contiguous runs, skipping only the hop-by-hop ones
+    size_t run_start = scan.request_line_end + 2;
+    for (const HeaderSpan &span : scan.spans)
+    {
+        if (span.id != HEADER_CONNECTION && span.id != HEADER_PROXY_CONNECTION && span.id != HEADER_KEEP_ALIVE)
+            continue;
 
-        size_t colon = host_port.find(':');
-        if (colon != string::npos)
+        rewritten.append(all.substr(run_start, span.line_start - run_start));
+        run_start = span.line_end + 2;
+    }
+    rewritten.append(all.substr(run_start, req.header_length - 2 - run_start));
+
+    rewritten += "Connection: keep-alive\r\n\r\n"; // lets the upstream pool reuse the connection
+
+    return PARSE_OK;
+}
+
+// Resumes where the previous call stopped, so each byte of the header is scanned once
+ParseResult parse_http_request(const string &data, HttpRequest &req)
+{
+    RequestScan &scan = req.scan;
+    const char *p = data.data();
+    size_t limit = min(data.size(), (size_t)MAX_HEADER_SIZE);
+
+    while (scan.pos < limit)
+    {
+        size_t lf = scan_line(p, scan.pos, limit, scan.colon);
+        if (lf == string::npos)
         {
-            req.host = host_port.substr(0, colon);
-            req.port = stoi(host_port.substr(colon + 1)); // get the port after the colon
+            scan.pos = limit;
+            break;
+        }
+
+        // Lines must end in CRLF
+        if (lf == scan.line_start || p[lf - 1] != '\r')
+            return PARSE_ERROR;
+
+        size_t line_end = lf - 1;
+        scan.pos = lf + 1;
+
+        if (scan.request_line_end == 0)
+        {
+            // EARLY malformed request-line detection
+            if (!parse_request_line(data, line_end, scan))
+                return PARSE_ERROR;
+        }
+        else if (line_end == scan.line_start)
+        {
+            req.header_length = scan.pos;
+            return finish_request(data, req);
         }
         else
         {
-            req.host = host_port;
+            // "name: value" with no space before the colon
+            size_t colon = scan.colon;
+            if (colon == string::npos || colon >= line_end || colon == scan.line_start ||
+                p[colon - 1] == ' ' || p[colon - 1] == '\t')
+                return PARSE_ERROR;
+
+            if (scan.spans.empty())
+                scan.spans.reserve(16);
+
+            string_view name(p + scan.line_start, colon - scan.line_start);
+            scan.spans.push_back({(uint32_t)scan.line_start, (uint32_t)colon, (uint32_t)line_end, classify_header(name)});
         }
+
+        scan.line_start = scan.pos;
+        scan.colon = string::npos;
     }
 
-    string new_line = req.method + " " + req.path + " HTTP/1.0"; // turning the request into http/1.0
-    req.raw_request.replace(0, line_end, new_line);
+    return data.size() >= MAX_HEADER_SIZE ? PARSE_ERROR : PARSE_INCOMPLETE;
+}
 
-    return true;
+// Splits one "name: value" header line of a response; name stays empty if there is no colon
+static void split_header(string_view line, string_view &name, string_view &value)
+{
+    size_t colon = line.find(':');
+    if (colon == string_view::npos)
+        return;
+
+    name = line.substr(0, colon);
+    value = trim(line.substr(colon + 1));
+}
+
+ParseResult parse_http_response(const string &data, const string &request_method, HttpResponse &resp)
+{
+    size_t header_end = data.find("\r\n\r\n");
+    if (header_end == string::npos)
+        return data.size() > MAX_RESPONSE_HEADER_SIZE ? PARSE_ERROR : PARSE_INCOMPLETE;
+
+    size_t line_end = data.find("\r\n");
+    if (data.compare(0, 5, "HTTP/") != 0 || line_end < 12)
+        return PARSE_ERROR;
+
+    bool http11 = data.compare(0, 8, "HTTP/1.0") != 0;
+    resp.status = atoi(data.c_str() + 9);
+    if (resp.status < 100 || resp.status > 999)
+        return PARSE_ERROR;
+
+    resp.header_length = header_end + 4;
+    resp.head = data.substr(0, line_end + 2);
+    resp.body = BodyFraming();
+
+    bool has_length = false, chunked = false, close = !http11;
+    size_t length = 0;
+
+    string_view all(data);
+    size_t pos = line_end + 2;
+    while (pos < header_end + 2)
+    {
+        size_t eol = data.find("\r\n", pos);
+        string_view name, value;
+
+        split_header(all.substr(pos, eol - pos), name, value);
+
+        if (iequals(name, "Content-Length"))
+        {
+            if (!parse_content_length(value, length))
+                return PARSE_ERROR;
+            has_length = true;
+        }
+        else if (iequals(name, "Transfer-Encoding"))
+        {
+            chunked = is_chunked(value);
+        }
+        else if (iequals(name, "Connection"))
+        {
+            if (iequals(value, "close"))
+                close = true;
+            else if (iequals(value, "keep-alive"))
+                close = false;
+        }
+
+        if (!is_hop_by_hop(name))
+            resp.head.append(data, pos, eol + 2 - pos);
+        pos = eol + 2;
+    }
+
+    BodyFraming &body = resp.body;
+
+    if (request_method == "HEAD" || (resp.status >= 100 && resp.status < 200) ||
+        resp.status == 204 || resp.status == 304)
+    {
+        body.kind = BodyKind::NONE;
+    }
+    else if (chunked)
+    {
+        body.kind = BodyKind::CHUNKED;
+        body.chunk_state = CHUNK_SIZE;
+    }
+    else if (has_length)
+    {
+        body.kind = BodyKind::LENGTH;
+        body.remaining = length;
+    }
+    else
+    {
+        body.kind = BodyKind::UNTIL_CLOSE;
+        close = true;
+    }
+
+    body.done = body.kind == BodyKind::NONE || (body.kind == BodyKind::LENGTH && length == 0);
+    resp.keep_alive = !close && resp.status != 101;
+
+    return PARSE_OK;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// A response whose chunked framing breaks is relayed until the origin closes; a request body
+// stops at the bad byte and is marked malformed, so the exchange can be failed
+static size_t framing_error(BodyFraming &body, size_t consumed, size_t len)
+{
+    if (body.strict)
+    {
+        body.malformed = true;
+        return consumed;
+    }
+
+    body.kind = BodyKind::UNTIL_CLOSE;
+    return len;
+}
+
+static size_t advance_chunked(BodyFraming &body, const char *data, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && !body.done)
+    {
+        char c = data[i];
+
+        switch (body.chunk_state)
+        {
+        case CHUNK_SIZE:
+        case CHUNK_SIZE_DIGITS:
+        {
+            int v = hex_value(c);
+            if (v >= 0)
+            {
+                if (body.chunk_size > (SIZE_MAX >> 4))
+                    return framing_error(body, i, len); // absurd chunk size
+                body.chunk_size = body.chunk_size * 16 + v;
+                body.chunk_state = CHUNK_SIZE_DIGITS;
+            }
+            else if (body.chunk_state == CHUNK_SIZE)
+                return framing_error(body, i, len); // no size at all
+            else if (c == '\r')
+                body.chunk_state = CHUNK_SIZE_LF;
+            else if (c == ';' || c == ' ' || c == '\t')
+                body.chunk_state = CHUNK_EXT;
+            else
+                return framing_error(body, i, len);
+            i++;
+            break;
+        }
+
+        case CHUNK_EXT:
+            if (c == '\n')
+                return framing_error(body, i, len); // bare LF
+            if (c == '\r')
+                body.chunk_state = CHUNK_SIZE_LF;
+            i++;
+            break;
+
+        case CHUNK_SIZE_LF:
+            if (c != '\n')
+                return framing_error(body, i, len);
+            i++;
+            if (body.chunk_size == 0)
+            {
+                body.chunk_state = CHUNK_TRAILER_START;
+            }
+            else
+            {
+                body.remaining = body.chunk_size;
+                body.chunk_state = CHUNK_DATA;
+            }
+            break;
+
+        case CHUNK_DATA:
+        {
+            size_t take = min(body.remaining, len - i);
+            body.remaining -= take;
+            i += take;
+            if (body.remaining == 0)
+                body.chunk_state = CHUNK_DATA_CR;
+            break;
+        }
+
+        case CHUNK_DATA_CR:
+            if (c != '\r')
+                return framing_error(body, i, len);
+            body.chunk_state = CHUNK_DATA_LF;
+            i++;
+            break;
+
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return framing_error(body, i, len);
+            body.chunk_size = 0;
+            body.chunk_state = CHUNK_SIZE;
+            i++;
+            break;
+
+        case CHUNK_TRAILER_START:
+            if (c == '\n')
+                return framing_error(body, i, len); // bare LF
+            body.chunk_state = (c == '\r') ? CHUNK_FINAL_LF : CHUNK_TRAILER;
+            i++;
+            break;
+
+        case CHUNK_TRAILER:
+            if (c == '\n')
+                return framing_error(body, i, len); // bare LF
+            if (c == '\r')
+                body.chunk_state = CHUNK_TRAILER_LF;
+            i++;
+            break;
+
+        case CHUNK_TRAILER_LF:
+            if (c != '\n')
+                return framing_error(body, i, len);
+            body.chunk_state = CHUNK_TRAILER_START;
+            i++;
+            break;
+
+        case CHUNK_FINAL_LF:
+            if (c != '\n')
+                return framing_error(body, i, len);
+            body.done = true;
+            i++;
+            break;
+        }
+    }
+
+    return i;
+}
+
+size_t advance_body(BodyFraming &body, const char *data, size_t len)
+{
+    if (body.done || body.malformed)
+        return 0;
+
+    switch (body.kind)
+    {
+    case BodyKind::LENGTH:
+    {
+        size_t take = min(body.remaining, len);
+        body.remaining -= take;
+        body.done = body.remaining == 0;
+        return take;
+    }
+
+    case BodyKind::CHUNKED:
+        return advance_chunked(body, data, len);
+
+    case BodyKind::UNTIL_CLOSE:
+        return len;
+
+    default:
+        return 0;
+    }
+}
+
+size_t body_read_limit(const BodyFraming &body, size_t max)
+{
+    if (body.done || body.malformed)
+        return 0;
+
+    if (body.kind == BodyKind::LENGTH)
+        return min(body.remaining, max);
+
+    return max;
 }
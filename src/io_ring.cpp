@@ -0,0 +1,174 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <vector>
+#include "io_ring.h"
+
+using namespace std;
+
+#define CQ_PER_SQ 4 // multishot operations post many completions per submission
+
+static bool supports(int ring_fd, unsigned op)
+{
+    vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    io_uring_probe *probe = (io_uring_probe *)buf.data();
+
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        return false;
+
+    return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+static int setup(unsigned entries, unsigned flags, io_uring_params &params)
+{
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | flags;
+    params.cq_entries = entries * CQ_PER_SQ;
+
+    return syscall(__NR_io_uring_setup, entries, &params);
+}
+
+IoRing::~IoRing()
+{
+    if (sqes)
+        munmap(sqes, sqes_size);
+    if (ring_mem)
+        munmap(ring_mem, ring_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+}
+
+bool IoRing::init(unsigned entries)
+{
+    io_uring_params params;
+
+    // Completions are only run when this thread waits, instead of interrupting it (6.1+)
+    ring_fd = setup(entries, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED, params);
+    disabled = ring_fd >= 0;
+
+    if (ring_fd < 0 && errno == EINVAL)
+        ring_fd = setup(entries, 0, params);
+    if (ring_fd < 0)
+        return false;
+
+    // IORING_OP_SOCKET arrived with multishot accept, so it stands in for a version check
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed || !supports(ring_fd, IORING_OP_SOCKET))
+        return false;
+
+    ring_size = max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                    params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    void *mem = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (mem == MAP_FAILED)
+        return false;
+    ring_mem = mem;
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    mem = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (mem == MAP_FAILED)
+        return false;
+    sqes = (io_uring_sqe *)mem;
+
+    char *base = (char *)ring_mem;
+
+    sq_head = (atomic<unsigned> *)(base + params.sq_off.head);
+    sq_tail = (atomic<unsigned> *)(base + params.sq_off.tail);
+    sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_queued = sq_tail->load(memory_order_relaxed);
+
+    unsigned *array = (unsigned *)(base + params.sq_off.array); // slot i always holds entry i
+    for (unsigned i = 0; i < sq_entries; ++i)
+        array[i] = i;
+
+    cq_head = (atomic<unsigned> *)(base + params.cq_off.head);
+    cq_tail = (atomic<unsigned> *)(base + params.cq_off.tail);
+    cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(base + params.cq_off.cqes);
+
+    return true;
+}
+
+bool IoRing::enable()
+{
+    if (!disabled)
+        return true;
+
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) < 0)
+        return false;
+
+    disabled = false;
+    return true;
+}
+
+io_uring_sqe *IoRing::get_sqe()
+{
+    if (sq_queued - sq_head->load(memory_order_acquire) >= sq_entries)
+    {
+        submit(false, 0);
+        if (sq_queued - sq_head->load(memory_order_acquire) >= sq_entries)
+            return nullptr;
+    }
+
+    io_uring_sqe *sqe = &sqes[sq_queued & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sq_queued;
+    return sqe;
+}
+
+bool IoRing::submit_and_wait(int timeout_ms)
+{
+    return submit(true, timeout_ms);
+}
+
+bool IoRing::submit(bool wait, int timeout_ms)
+{
+    sq_tail->store(sq_queued, memory_order_release);
+    unsigned to_submit = sq_queued - sq_head->load(memory_order_acquire);
+
+    if (!wait && to_submit == 0)
+        return true;
+
+    unsigned flags = 0;
+    unsigned min_complete = 0;
+    __kernel_timespec ts{};
+    io_uring_getevents_arg arg{};
+
+    if (wait)
+    {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        arg.sigmask_sz = _NSIG / 8;
+
+        if (cq_head->load(memory_order_relaxed) == cq_tail->load(memory_order_acquire))
+        {
+            min_complete = 1;
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+
+    long ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                       wait ? &arg : nullptr, wait ? sizeof(arg) : 0);
+
+    // ETIME: nothing completed in time; EBUSY/EAGAIN: completions must be consumed first
+    return ret >= 0 || errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN;
+}
+
+io_uring_cqe *IoRing::peek()
+{
+    unsigned head = cq_head->load(memory_order_relaxed);
+    if (head == cq_tail->load(memory_order_acquire))
+        return nullptr;
+
+    return &cqes[head & cq_mask];
+}
+
+void IoRing::seen()
+{
+    cq_head->store(cq_head->load(memory_order_relaxed) + 1, memory_order_release);
+}
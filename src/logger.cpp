@@ -1,57 +1,254 @@
-#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <ctime>
-#include <sys/stat.h>
+#include <cerrno>
 #include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <iostream>
 #include "logger.h"
 
 using namespace std;
 
-static ofstream log_file;
-static mutex log_mutex;
+#define WRITE_BATCH_BYTES 65536
+#define WRITER_IDLE_MS 10
+
+struct LogRecord
+{
+    time_t when;
+    string text;
+};
+
+// Bounded multi-producer ring (Vyukov): a slot is free for position p when seq == p,
+// and holds a record for the writer when seq == p + 1
+struct Slot
+{
+    atomic<size_t> seq;
+    LogRecord record;
+};
+
+static unique_ptr<Slot[]> ring;
+static size_t capacity = 0;
+static atomic<size_t> head{0}; // next position producers claim
+static size_t tail = 0;        // next position the writer reads; writer thread only
+
+static atomic<bool> running{false};
+static atomic<size_t> dropped{0};
+static bool block_when_full = false;
+static thread writer;
+static mutex idle_lock; // only for the writer's nap; producers never take it
+static condition_variable idle_cv;
+
+// Writer thread state
+static int log_fd = -1;
 static string log_filename;
 static size_t max_size = 0;
+static size_t file_size = 0; // tracked in memory, so rotation needs no stat()
 
-static string timestamp()
+static bool push(LogRecord &record)
 {
-    time_t now = time(nullptr);
-    char buf[32];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    return buf;
+    size_t pos = head.load(memory_order_relaxed);
+
+    while (true)
+    {
+        Slot &slot = ring[pos & (capacity - 1)];
+        size_t seq = slot.seq.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+            {
+                slot.record = move(record);
+                slot.seq.store(pos + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false; // full: the writer has not freed this slot yet
+        }
+        else
+        {
+            pos = head.load(memory_order_relaxed);
+        }
+    }
 }
 
-static void rotate_if_needed()
+static bool pop(LogRecord &record)
 {
+    Slot &slot = ring[tail & (capacity - 1)];
+    if (slot.seq.load(memory_order_acquire) != tail + 1)
+        return false;
+
+    record = move(slot.record);
+    slot.seq.store(tail + capacity, memory_order_release);
+    tail++;
+    return true;
+}
+
+static void open_log()
+{
+    log_fd = open(log_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
     struct stat st{};
-    if (stat(log_filename.c_str(), &st) == 0 && (size_t)st.st_size >= max_size)
+    file_size = (log_fd >= 0 && fstat(log_fd, &st) == 0) ? st.st_size : 0;
+}
+
+static void write_out(string &out)
+{
+    size_t done = 0;
+    while (log_fd >= 0 && done < out.size())
+    {
+        ssize_t n = write(log_fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    file_size += done; // only what reached the file counts towards rotation
+    out.clear();
+}
+
+static void rotate()
+{
+    if (log_fd >= 0)
+        close(log_fd);
+
+    remove((log_filename + ".1").c_str());
+    rename(log_filename.c_str(), (log_filename + ".1").c_str());
+    open_log();
+}
+
+// The timestamp only changes once per second, so it is formatted once per second
+static const string &timestamp(time_t when)
+{
+    static time_t cached_time = -1;
+    static string cached;
+
+    if (when != cached_time)
+    {
+        char buf[32];
+        tm local;
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime_r(&when, &local));
+        cached = buf;
+        cached_time = when;
+    }
+
+    return cached;
+}
+
+static void append(string &out, time_t when, const string &text)
+{
+    if (file_size + out.size() >= max_size)
     {
-        log_file.close();
-        remove((log_filename + ".1").c_str());
-        rename(log_filename.c_str(), (log_filename + ".1").c_str());
-        log_file.open(log_filename, ios::out | ios::app);
+        write_out(out);
+        rotate();
     }
+
+    out += "[";
+    out += timestamp(when);
+    out += "] ";
+    out += text;
+    out += "\n";
 }
 
-void init_logger(const string &filename, size_t max_size_bytes)
+static void writer_loop()
+{
+    string out;
+    out.reserve(WRITE_BATCH_BYTES * 2);
+
+    LogRecord record;
+    size_t reported_drops = 0;
+
+    while (true)
+    {
+        bool stopping = !running.load(memory_order_acquire);
+
+        while (out.size() < WRITE_BATCH_BYTES && pop(record))
+            append(out, record.when, record.text);
+
+        size_t drops = dropped.load(memory_order_relaxed);
+        if (drops != reported_drops && out.size() < WRITE_BATCH_BYTES)
+        {
+            append(out, time(nullptr), "Log ring full: " + to_string(drops - reported_drops) + " records dropped");
+            reported_drops = drops;
+        }
+
+        if (!out.empty())
+        {
+            write_out(out); // one write() per batch
+            continue;
+        }
+
+        if (stopping)
+            break; // everything queued before close_logger() has been written
+
+        unique_lock<mutex> lock(idle_lock);
+        idle_cv.wait_for(lock, chrono::milliseconds(WRITER_IDLE_MS));
+    }
+}
+
+void init_logger(const string &filename, size_t max_size_bytes, size_t queue_size, bool block)
 {
     log_filename = filename;
     max_size = max_size_bytes;
-    log_file.open(filename, ios::out | ios::app);
+    block_when_full = block;
+
+    capacity = 1;
+    while (capacity < queue_size)
+        capacity <<= 1;
+
+    ring.reset(new Slot[capacity]);
+    for (size_t i = 0; i < capacity; ++i)
+        ring[i].seq.store(i, memory_order_relaxed);
+
+    open_log();
+
+    running = true;
+    writer = thread(writer_loop);
 }
 
-void log_info(const string &msg)
+void log_info(string msg)
 {
-    lock_guard<mutex> lock(log_mutex);
-    rotate_if_needed();
-    log_file << "[" << timestamp() << "] " << msg << endl;
+    if (!running.load(memory_order_relaxed))
+        return;
+
+    LogRecord record{time(nullptr), move(msg)};
+
+    while (!push(record))
+    {
+        if (!block_when_full)
+        {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+
+        idle_cv.notify_one(); // slow path only: wake the writer instead of waiting out its nap
+        this_thread::yield();
+    }
 }
 
 void close_logger()
 {
-    if (log_file.is_open())
+    if (!writer.joinable())
+        return;
+
+    running = false;
+    idle_cv.notify_one();
+    writer.join();
+
+    if (log_fd >= 0)
     {
-        log_file.close();
+        close(log_fd);
+        log_fd = -1;
         cout << "[INFO] Log File Closed" << endl;
     }
 }
@@ -7,6 +7,11 @@
 #include "config.h"
 #include "global_config.h"
 #include "server.h"
+#include "response_cache.h"
+#include "disk_cache.h"
+#include "collapsed_forwarding.h"
+#include "buffer_pool.h"
+#include "admin_server.h"
 
 atomic<bool> shutting_down(false);
 
@@ -17,10 +22,17 @@ void handle_signal(int) // Shutdown Initiator
     cout << "\n[INFO] Graceful shutdown initiated..." << endl;
 }
 
+void handle_reload(int) // SIGHUP: pick up blocklist changes
+{
+    request_blocklist_reload();
+}
+
 int main()
 {
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    signal(SIGHUP, handle_reload);
+    signal(SIGPIPE, SIG_IGN); // sendfile() has no MSG_NOSIGNAL; a closed client shows up as EPIPE instead
 
     if (!load_config("config/proxy.conf", global_config)) // load config file
         return 1;
@@ -30,18 +42,44 @@ int main()
 
     if (global_config.enable_blocklist)
     {
-        if (!load_blocklist(global_config.blocklist_file)) // loading the blocklist file
+        if (!load_blocklist(global_config.blocklist_file, global_config.blocklist_image_file)) // loading the blocklist file
             return 1;
     }
 
-    init_logger(global_config.log_file, global_config.log_max_size_bytes); // initialize Log file
-    init_metrics(global_config.metrics_file);                              // initialize Metrics file
+    if (global_config.admin_port > 0 && !start_admin_server(global_config.admin_address, global_config.admin_port))
+        return 1;
+
+    init_logger(global_config.log_file, global_config.log_max_size_bytes,
+                global_config.log_queue_size, global_config.log_full_policy == "block"); // initialize Log file
+    init_metrics(global_config.metrics_file, global_config.metrics_flush_interval_ms); // initialize Metrics file
+
+    init_response_cache((size_t)global_config.response_cache_max_mb << 20,
+                        (size_t)global_config.response_cache_max_object_kb << 10);
+
+    init_collapsed_forwarding((size_t)global_config.collapsed_forwarding_buffer_kb << 10);
+
+    init_buffer_pool((size_t)global_config.io_buffer_pool_mb << 20);
+
+    if (global_config.response_cache_max_mb > 0 && !global_config.response_cache_dir.empty())
+    {
+        init_disk_cache(global_config.response_cache_dir, (size_t)global_config.response_cache_disk_max_mb << 20,
+                        (size_t)global_config.response_cache_max_object_kb << 10,
+                        (size_t)global_config.response_cache_disk_max_object_mb << 20);
+    }
+
+    if (global_config.enable_blocklist)
+        start_blocklist_watcher(); // reload on file changes and SIGHUP
 
     cout << "[INFO] Starting Proxy Server on " << global_config.listen_address << ":" << global_config.listen_port << endl;
     log_info("Starting Proxy Server on " + global_config.listen_address + ":" + to_string(global_config.listen_port));
 
     start_server(global_config.listen_port); // Start the server
 
+    stop_blocklist_watcher();
+    stop_admin_server();
+    stop_disk_cache(); // marks the index clean so the next start maps it as is
+    stop_metrics(); // write the final counts
+
     log_info("Proxy Server stopped cleanly");
 
     close_logger(); // close the log file cleanly after shutdown is initiated
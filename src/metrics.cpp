@@ -1,24 +1,231 @@
 #include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <ctime>
 #include "metrics.h"
 
 using namespace std;
 
-static mutex m;
+#define METRIC_SHARDS 64
+#define ERROR_KINDS 5
+#define LATENCY_KINDS 3
+
+// Log-linear histograms of microseconds: values below 8 get a bucket each, every power of two
+// above is split into 8 equal buckets (under 12.5% wide), up to 2^32 us (about 71 minutes)
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_BUCKETS 240
+
+// Counters written by one recording thread; padded so shards never share a cache line.
+// Only host_counts needs a lock, and its only other user is the flusher.
+struct alignas(64) MetricShard
+{
+    atomic<size_t> total_requests{0};
+    atomic<size_t> blocked_requests{0};
+    atomic<size_t> allowed_requests{0};
+    atomic<size_t> bytes_transferred{0};
+    atomic<size_t> request_body_bytes{0};
+    atomic<size_t> pool_hits{0};
+    atomic<size_t> pool_misses{0};
+    atomic<size_t> dns_hits{0};
+    atomic<size_t> dns_lookups{0};
+    atomic<size_t> dns_lookup_us{0};
+    atomic<size_t> cache_hits{0};
+    atomic<size_t> cache_misses{0};
+    atomic<size_t> cache_evictions{0};
+    atomic<size_t> collapsed_saved{0};
+    atomic<size_t> collapsed_fallbacks{0};
+    atomic<size_t> accept_waits{0};
+    atomic<size_t> accept_wait_us{0};
+    atomic<size_t> shed_connections{0};
+    atomic<size_t> shed_queue{0};
+    atomic<size_t> shed_delay{0};
+    atomic<size_t> errors[ERROR_KINDS];
+    atomic<size_t> latency[LATENCY_KINDS][HISTOGRAM_BUCKETS]; // zero as part of static storage
+
+    mutex host_lock;
+    unordered_map<string, size_t> host_counts; // drained into the flusher's totals
+};
+
+static MetricShard shards[METRIC_SHARDS];
+static atomic<size_t> next_shard{0};
+
+static atomic<size_t> cache_bytes{0};
+static atomic<size_t> cache_entries{0};
+static atomic<size_t> disk_cache_bytes{0};
+static atomic<size_t> disk_cache_entries{0};
+
+static atomic<size_t (*)()> accept_queue_depth{nullptr};
+static atomic<size_t> accept_queue_peak{0};
+
+// Latest blocking pool report; written by the pool's supervisor, read by the flusher
+static mutex blocking_pool_lock;
+static size_t blocking_workers = 0;
+static size_t blocking_grown = 0;
+static size_t blocking_retired = 0;
+static double blocking_wait_ms[3] = {0, 0, 0};
+
+// Latest buffer pool report
+static mutex io_buffers_lock;
+static BufferPoolStats io_buffers{};
+
+// Indexed by Lane; busy and wall time are reset by every flush
+static atomic<size_t> lane_busy_us[2];
+static atomic<size_t> lane_wall_us[2];
+static atomic<long> lane_connections[2];
+
+static atomic<size_t (*)()> client_connections{nullptr};
+static atomic<long> open_tunnels{0};
+
+static atomic<size_t> blocklist_rules{0};
+static atomic<size_t> blocklist_loads{0};
+static atomic<size_t> blocklist_load_us{0};
+
+// Gauges owned by other modules, read when rendering; zero until they are registered
+static size_t read_gauge(const atomic<size_t (*)()> &source)
+{
+    size_t (*read)() = source.load();
+    return read ? read() : 0;
+}
+
+// Owned by the flusher thread
 static string metrics_file;
+static int flush_interval_ms;
 static time_t start_time;
-static size_t total_requests = 0;
-static size_t blocked_requests = 0;
-static size_t allowed_requests = 0;
-static size_t bytes_transferred = 0;
 static unordered_map<string, size_t> host_counts;
 static string top_host;
 static size_t top_host_count = 0;
 
+static thread flusher;
+static mutex flusher_lock;
+static condition_variable flusher_cv;
+static bool flusher_running = false;
+
+static MetricShard &local_shard()
+{
+    static thread_local MetricShard &shard = shards[next_shard.fetch_add(1) % METRIC_SHARDS];
+    return shard;
+}
+
+static void add(atomic<size_t> &counter, size_t n = 1)
+{
+    counter.fetch_add(n, memory_order_relaxed);
+}
+
+static size_t sum(atomic<size_t> MetricShard::*counter)
+{
+    size_t total = 0;
+    for (MetricShard &shard : shards)
+        total += (shard.*counter).load(memory_order_relaxed);
+    return total;
+}
+
+static size_t sum_error(int error)
+{
+    size_t total = 0;
+    for (MetricShard &shard : shards)
+        total += shard.errors[error].load(memory_order_relaxed);
+    return total;
+}
+
+static int histogram_bucket(size_t micros)
+{
+    if (micros < HISTOGRAM_SUB_BUCKETS)
+        return (int)micros;
+    if (micros >= (size_t)1 << 32)
+        return HISTOGRAM_BUCKETS - 1;
+
+    int octave = 63 - __builtin_clzll(micros); // 3..31
+    return (octave - 2) * HISTOGRAM_SUB_BUCKETS + (int)((micros >> (octave - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Smallest value of bucket i; bucket i holds [bucket_lower(i), bucket_lower(i + 1))
+static size_t bucket_lower(int i)
+{
+    if (i < HISTOGRAM_SUB_BUCKETS)
+        return i;
+
+    int octave = i / HISTOGRAM_SUB_BUCKETS + 2;
+    return (size_t)(HISTOGRAM_SUB_BUCKETS + i % HISTOGRAM_SUB_BUCKETS) << (octave - 3);
+}
+
+// Middle of bucket i in microseconds; exact below 8
+static double bucket_value(int i)
+{
+    if (i < HISTOGRAM_SUB_BUCKETS || i == HISTOGRAM_BUCKETS - 1)
+        return bucket_lower(i);
+
+    return (bucket_lower(i) + bucket_lower(i + 1)) / 2.0;
+}
+
+// All shards' buckets of one histogram; returns the number of samples
+static size_t latency_counts(Latency which, size_t counts[HISTOGRAM_BUCKETS])
+{
+    size_t total = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+    {
+        counts[b] = 0;
+        for (MetricShard &shard : shards)
+            counts[b] += shard.latency[(int)which][b].load(memory_order_relaxed);
+        total += counts[b];
+    }
+    return total;
+}
+
+static double latency_percentile_ms(const size_t counts[HISTOGRAM_BUCKETS], size_t total, double p)
+{
+    if (total == 0)
+        return 0;
+
+    size_t rank = (size_t)(p * total + 0.999999);
+    size_t seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+    {
+        seen += counts[b];
+        if (seen >= rank)
+            return bucket_value(b) / 1000.0;
+    }
+    return bucket_value(HISTOGRAM_BUCKETS - 1) / 1000.0;
+}
+
+static void merge_hosts()
+{
+    for (MetricShard &shard : shards)
+    {
+        unordered_map<string, size_t> counts;
+        {
+            lock_guard<mutex> lock(shard.host_lock);
+            counts.swap(shard.host_counts);
+        }
+
+        for (auto &entry : counts)
+        {
+            size_t count = host_counts[entry.first] += entry.second;
+            if (count > top_host_count)
+            {
+                top_host = entry.first;
+                top_host_count = count;
+            }
+        }
+    }
+}
+
+// Writes a snapshot to a temporary file and renames it over metrics_file,
+// so readers never see a half-written file
 static void flush()
 {
+    merge_hosts();
+
+    size_t total_requests = sum(&MetricShard::total_requests);
+    size_t dns_hits = sum(&MetricShard::dns_hits);
+    size_t dns_lookups = sum(&MetricShard::dns_lookups);
+    size_t dns_lookup_us = sum(&MetricShard::dns_lookup_us);
+    size_t loads = blocklist_loads.load();
+
     time_t now = time(nullptr);
     double elapsed_minutes = difftime(now, start_time) / 60.0;
 
@@ -26,67 +233,416 @@ static void flush()
     if (elapsed_minutes > 0)
         rpm = total_requests / elapsed_minutes;
 
-    ofstream out(metrics_file, ios::out | ios::trunc);
+    string tmp = metrics_file + ".tmp";
+    {
+        ofstream out(tmp, ios::out | ios::trunc);
 
-    out << "Total Requests : " << total_requests << "\n";
-    out << "Blocked Requests : " << blocked_requests << "\n";
-    out << "Allowed Requests : " << allowed_requests << "\n";
-    out << "Bytes transferred : " << bytes_transferred << "\n";
+        out << "Total Requests : " << total_requests << "\n";
+        out << "Blocked Requests : " << sum(&MetricShard::blocked_requests) << "\n";
+        out << "Allowed Requests : " << sum(&MetricShard::allowed_requests) << "\n";
+        out << "Bytes transferred : " << sum(&MetricShard::bytes_transferred) << "\n";
+        out << "Request Body Bytes : " << sum(&MetricShard::request_body_bytes) << "\n";
 
-    if (!top_host.empty())
-        out << "Top Requested Host : " << top_host << " - " << top_host_count << "\n";
-    else
-        out << "Top Requested Host : None\n";
+        if (!top_host.empty())
+            out << "Top Requested Host : " << top_host << " - " << top_host_count << "\n";
+        else
+            out << "Top Requested Host : None\n";
+
+        out << "Requests Per Minute : " << rpm << "\n";
+        out << "Upstream Pool Hits : " << sum(&MetricShard::pool_hits) << "\n";
+        out << "Upstream Pool Misses : " << sum(&MetricShard::pool_misses) << "\n";
 
-    out << "Requests Per Minute : " << rpm << "\n";
+        size_t dns_total = dns_hits + dns_lookups;
+        out << "DNS Cache Hit Rate : " << (dns_total ? 100.0 * dns_hits / dns_total : 0.0) << "% (" << dns_hits << "/" << dns_total << ")\n";
+        out << "DNS Avg Lookup ms : " << (dns_lookups ? dns_lookup_us / 1000.0 / dns_lookups : 0.0) << "\n";
+
+        size_t cache_hits = sum(&MetricShard::cache_hits);
+        size_t cache_lookups = cache_hits + sum(&MetricShard::cache_misses);
+        out << "Response Cache Hit Rate : " << (cache_lookups ? 100.0 * cache_hits / cache_lookups : 0.0) << "% (" << cache_hits << "/" << cache_lookups << ")\n";
+        out << "Response Cache Evictions : " << sum(&MetricShard::cache_evictions) << "\n";
+        out << "Response Cache Memory : " << cache_bytes.load() << " bytes in " << cache_entries.load() << " entries\n";
+        out << "Response Cache Disk : " << disk_cache_bytes.load() << " bytes in " << disk_cache_entries.load() << " entries\n";
+        out << "Collapsed Forwarding : " << sum(&MetricShard::collapsed_saved) << " upstream fetches saved, "
+            << sum(&MetricShard::collapsed_fallbacks) << " fallbacks\n";
+        size_t accept_waits = sum(&MetricShard::accept_waits);
+        size_t shed_connections = sum(&MetricShard::shed_connections);
+        size_t shed_queue = sum(&MetricShard::shed_queue);
+        size_t shed_delay = sum(&MetricShard::shed_delay);
+        out << "Accept Queue Depth : " << read_gauge(accept_queue_depth) << " (peak " << accept_queue_peak.load() << ")\n";
+        out << "Accept Queue Avg Wait ms : " << (accept_waits ? sum(&MetricShard::accept_wait_us) / 1000.0 / accept_waits : 0.0) << "\n";
+        out << "Load Shed (503) : " << shed_connections + shed_queue + shed_delay << " (connection limit " << shed_connections
+            << ", queue limit " << shed_queue << ", queue delay " << shed_delay << ")\n";
+        {
+            lock_guard<mutex> lock(blocking_pool_lock);
+            out << "Blocking Pool : " << blocking_workers << " threads (" << blocking_grown << " added, " << blocking_retired
+                << " retired), queue wait p50 " << blocking_wait_ms[0] << " ms, p90 " << blocking_wait_ms[1]
+                << " ms, p99 " << blocking_wait_ms[2] << " ms\n";
+        }
+        {
+            lock_guard<mutex> lock(io_buffers_lock);
+            size_t requests = io_buffers.reused + io_buffers.allocated;
+            out << "I/O Buffers : " << io_buffers.in_use_bytes << " bytes in use (";
+            for (int c = 0; c < BUFFER_CLASSES; ++c)
+                out << (c ? ", " : "") << (buffer_class_size(c) >> 10) << " KB x " << io_buffers.in_use[c];
+            out << "), " << io_buffers.pooled_bytes << " bytes pooled, "
+                << (requests ? 100.0 * io_buffers.reused / requests : 0.0) << "% reused\n";
+        }
+
+        const char *lane_names[2] = {"HTTP Lane", "Tunnel Lane"};
+        for (int lane = 0; lane < 2; ++lane)
+        {
+            size_t busy = lane_busy_us[lane].exchange(0);
+            size_t wall = lane_wall_us[lane].exchange(0);
+            out << lane_names[lane] << " : " << (wall ? 100.0 * busy / wall : 0.0) << "% busy, "
+                << lane_connections[lane].load() << " connections\n";
+        }
+        out << "Open Connections : " << read_gauge(client_connections) << "\n";
+        out << "Open Tunnels : " << open_tunnels.load() << "\n";
+
+        size_t errors[ERROR_KINDS];
+        for (int e = 0; e < ERROR_KINDS; ++e)
+            errors[e] = sum_error(e);
+        out << "Errors : " << errors[0] + errors[1] + errors[2] + errors[3] + errors[4] << " (bad request " << errors[0]
+            << ", dns " << errors[1] << ", connect " << errors[2] << ", upstream " << errors[3] << ", timeout " << errors[4] << ")\n";
+
+        const char *latency_names[LATENCY_KINDS] = {"Request Duration", "Time To First Byte", "Upstream Connect"};
+        for (int l = 0; l < LATENCY_KINDS; ++l)
+        {
+            size_t counts[HISTOGRAM_BUCKETS];
+            size_t total = latency_counts((Latency)l, counts);
+            out << latency_names[l] << " : p50 " << latency_percentile_ms(counts, total, 0.5) << " ms, p90 "
+                << latency_percentile_ms(counts, total, 0.9) << " ms, p99 " << latency_percentile_ms(counts, total, 0.99)
+                << " ms (" << total << " samples)\n";
+        }
+
+        out << "Blocklist Rules : " << blocklist_rules.load() << "\n";
+        out << "Blocklist Reloads : " << (loads ? loads - 1 : 0) << " (last load " << blocklist_load_us.load() / 1000.0 << " ms)\n";
+
+        if (!out)
+            return;
+    }
+
+    rename(tmp.c_str(), metrics_file.c_str());
 }
 
-void init_metrics(const string &filename)
+static void flush_loop()
 {
-    lock_guard<mutex> lock(m);
+    unique_lock<mutex> lock(flusher_lock);
+
+    while (flusher_running)
+    {
+        flusher_cv.wait_for(lock, chrono::milliseconds(flush_interval_ms));
+        flush();
+    }
+}
 
+void init_metrics(const string &filename, int interval_ms)
+{
     metrics_file = filename;
+    flush_interval_ms = interval_ms;
     start_time = time(nullptr);
 
-    total_requests = 0;
-    blocked_requests = 0;
-    allowed_requests = 0;
-    bytes_transferred = 0;
-
-    host_counts.clear();
-    top_host.clear();
-    top_host_count = 0;
-
     flush();
+
+    lock_guard<mutex> lock(flusher_lock);
+    flusher_running = true;
+    flusher = thread(flush_loop);
 }
 
-void metrics_record_request(const string &host)
+void stop_metrics()
 {
-    lock_guard<mutex> lock(m);
-
-    total_requests++;
-
-    size_t count = ++host_counts[host];
-    if (count > top_host_count)
     {
-        top_host = host;
-        top_host_count = count;
+        lock_guard<mutex> lock(flusher_lock);
+        if (!flusher_running)
+            return;
+        flusher_running = false;
     }
 
-    flush();
+    flusher_cv.notify_one();
+    flusher.join(); // the loop writes a final snapshot on its way out
+}
+
+void metrics_record_request(const string &host)
+{
+    MetricShard &shard = local_shard();
+    add(shard.total_requests);
+
+    lock_guard<mutex> lock(shard.host_lock); // uncontended unless the flusher is draining this shard
+    shard.host_counts[host]++;
 }
 
 void metrics_record_blocked()
 {
-    lock_guard<mutex> lock(m);
-    blocked_requests++;
-    flush();
+    add(local_shard().blocked_requests);
 }
 
 void metrics_record_allowed(size_t bytes)
 {
-    lock_guard<mutex> lock(m);
-    allowed_requests++;
-    bytes_transferred += bytes;
-    flush();
+    MetricShard &shard = local_shard();
+    add(shard.allowed_requests);
+    add(shard.bytes_transferred, bytes);
+}
+
+void metrics_record_request_body(size_t bytes)
+{
+    if (bytes > 0)
+        add(local_shard().request_body_bytes, bytes);
+}
+
+void metrics_record_upstream_pool(bool hit)
+{
+    MetricShard &shard = local_shard();
+    add(hit ? shard.pool_hits : shard.pool_misses);
+}
+
+void metrics_record_dns_hit()
+{
+    add(local_shard().dns_hits);
+}
+
+void metrics_record_dns_lookup(double millis)
+{
+    MetricShard &shard = local_shard();
+    add(shard.dns_lookups);
+    add(shard.dns_lookup_us, (size_t)(millis * 1000));
+}
+
+void metrics_record_response_cache_lookup(bool hit)
+{
+    MetricShard &shard = local_shard();
+    add(hit ? shard.cache_hits : shard.cache_misses);
+}
+
+void metrics_record_response_cache_evictions(size_t count)
+{
+    add(local_shard().cache_evictions, count);
+}
+
+void metrics_record_response_cache_usage(size_t bytes, size_t entries)
+{
+    cache_bytes.store(bytes, memory_order_relaxed);
+    cache_entries.store(entries, memory_order_relaxed);
+}
+
+void metrics_record_response_cache_disk_usage(size_t bytes, size_t entries)
+{
+    disk_cache_bytes.store(bytes, memory_order_relaxed);
+    disk_cache_entries.store(entries, memory_order_relaxed);
+}
+
+void metrics_record_collapsed(bool saved)
+{
+    MetricShard &shard = local_shard();
+    add(saved ? shard.collapsed_saved : shard.collapsed_fallbacks);
+}
+
+void metrics_record_blocking_pool(size_t workers, size_t grown, size_t retired, double p50_ms, double p90_ms, double p99_ms)
+{
+    lock_guard<mutex> lock(blocking_pool_lock);
+    blocking_workers = workers;
+    blocking_grown = grown;
+    blocking_retired = retired;
+    blocking_wait_ms[0] = p50_ms;
+    blocking_wait_ms[1] = p90_ms;
+    blocking_wait_ms[2] = p99_ms;
+}
+
+void metrics_record_io_buffers(const BufferPoolStats &stats)
+{
+    lock_guard<mutex> lock(io_buffers_lock);
+    io_buffers = stats;
+}
+
+void metrics_record_lane(Lane lane, size_t busy_micros, size_t wall_micros, long connections_delta)
+{
+    int i = (int)lane;
+    lane_busy_us[i].fetch_add(busy_micros, memory_order_relaxed);
+    lane_wall_us[i].fetch_add(wall_micros, memory_order_relaxed);
+    lane_connections[i].fetch_add(connections_delta, memory_order_relaxed);
+}
+
+void metrics_record_accept_queue(size_t depth)
+{
+    size_t peak = accept_queue_peak.load(memory_order_relaxed);
+    while (depth > peak && !accept_queue_peak.compare_exchange_weak(peak, depth, memory_order_relaxed))
+        ;
+}
+
+void metrics_watch_accept_queue(size_t (*depth)())
+{
+    accept_queue_depth.store(depth);
+}
+
+void metrics_record_accept_wait(size_t micros)
+{
+    MetricShard &shard = local_shard();
+    add(shard.accept_waits);
+    add(shard.accept_wait_us, micros);
+}
+
+void metrics_record_load_shed(ShedReason reason)
+{
+    MetricShard &shard = local_shard();
+
+    if (reason == ShedReason::CONNECTION_LIMIT)
+        add(shard.shed_connections);
+    else if (reason == ShedReason::QUEUE_LIMIT)
+        add(shard.shed_queue);
+    else
+        add(shard.shed_delay);
+}
+
+void metrics_record_blocklist_load(size_t rules, double millis)
+{
+    blocklist_rules.store(rules);
+    blocklist_load_us.store((size_t)(millis * 1000));
+    blocklist_loads.fetch_add(1);
+}
+
+void metrics_record_error(ProxyError error)
+{
+    add(local_shard().errors[(int)error]);
+}
+
+void metrics_record_latency(Latency which, size_t micros)
+{
+    add(local_shard().latency[(int)which][histogram_bucket(micros)]);
+}
+
+void metrics_watch_connections(size_t (*open)())
+{
+    client_connections.store(open);
+}
+
+void metrics_record_tunnel(bool opened)
+{
+    open_tunnels.fetch_add(opened ? 1 : -1, memory_order_relaxed);
+}
+
+// Prometheus text format: one HELP and TYPE line per family, then its samples
+
+static void family(string &out, const char *name, const char *type, const char *help)
+{
+    out += string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+static string number(double value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.12g", value);
+    return buf;
+}
+
+static void sample(string &out, const char *name, const string &labels, double value)
+{
+    out += name;
+    if (!labels.empty())
+        out += "{" + labels + "}";
+    out += " " + number(value) + "\n";
+}
+
+static void counter(string &out, const char *name, const char *help, size_t value)
+{
+    family(out, name, "counter", help);
+    sample(out, name, "", value);
+}
+
+static void gauge(string &out, const char *name, const char *help, double value)
+{
+    family(out, name, "gauge", help);
+    sample(out, name, "", value);
+}
+
+// Cumulative buckets at every power of two from 16 us, in seconds. The sum is estimated from
+// bucket midpoints, which keeps recording at one increment.
+static void histogram(string &out, const char *name, const char *help, Latency which)
+{
+    size_t counts[HISTOGRAM_BUCKETS];
+    size_t total = latency_counts(which, counts);
+
+    family(out, name, "histogram", help);
+
+    string bucket = string(name) + "_bucket";
+    size_t cumulative = 0;
+    int b = 0;
+    for (int octave = 4; octave <= 32; ++octave)
+    {
+        size_t bound = (size_t)1 << octave;
+        while (b < HISTOGRAM_BUCKETS && bucket_lower(b) < bound)
+            cumulative += counts[b++];
+
+        sample(out, bucket.c_str(), "le=\"" + number(bound / 1e6) + "\"", cumulative);
+    }
+    sample(out, bucket.c_str(), "le=\"+Inf\"", total);
+
+    double sum_us = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        sum_us += counts[i] * bucket_value(i);
+
+    sample(out, (string(name) + "_sum").c_str(), "", sum_us / 1e6);
+    sample(out, (string(name) + "_count").c_str(), "", total);
+}
+
+string metrics_prometheus()
+{
+    string out;
+    out.reserve(16384);
+
+    counter(out, "proxy_requests_total", "Requests with a complete header.", sum(&MetricShard::total_requests));
+    counter(out, "proxy_requests_blocked_total", "Requests refused by policy or unparsable.", sum(&MetricShard::blocked_requests));
+    counter(out, "proxy_requests_allowed_total", "Requests forwarded to the origin or served from the cache.",
+            sum(&MetricShard::allowed_requests));
+    counter(out, "proxy_transferred_bytes_total", "Bytes relayed for allowed requests.", sum(&MetricShard::bytes_transferred));
+    counter(out, "proxy_request_body_bytes_total", "Request body bytes sent to origins.", sum(&MetricShard::request_body_bytes));
+
+    const char *error_types[ERROR_KINDS] = {"bad_request", "dns", "connect", "upstream", "timeout"};
+    family(out, "proxy_errors_total", "counter", "Requests that failed, by cause.");
+    for (int e = 0; e < ERROR_KINDS; ++e)
+        sample(out, "proxy_errors_total", string("type=\"") + error_types[e] + "\"", sum_error(e));
+
+    family(out, "proxy_load_shed_total", "counter", "New clients answered with 503, by limit.");
+    sample(out, "proxy_load_shed_total", "reason=\"connection_limit\"", sum(&MetricShard::shed_connections));
+    sample(out, "proxy_load_shed_total", "reason=\"queue_limit\"", sum(&MetricShard::shed_queue));
+    sample(out, "proxy_load_shed_total", "reason=\"queue_delay\"", sum(&MetricShard::shed_delay));
+
+    family(out, "proxy_upstream_pool_total", "counter", "Origin connections taken from the keep-alive pool or opened.");
+    sample(out, "proxy_upstream_pool_total", "result=\"hit\"", sum(&MetricShard::pool_hits));
+    sample(out, "proxy_upstream_pool_total", "result=\"miss\"", sum(&MetricShard::pool_misses));
+
+    family(out, "proxy_dns_total", "counter", "Destination lookups answered from the cache or resolved.");
+    sample(out, "proxy_dns_total", "result=\"hit\"", sum(&MetricShard::dns_hits));
+    sample(out, "proxy_dns_total", "result=\"miss\"", sum(&MetricShard::dns_lookups));
+
+    family(out, "proxy_response_cache_lookups_total", "counter", "Response cache lookups.");
+    sample(out, "proxy_response_cache_lookups_total", "result=\"hit\"", sum(&MetricShard::cache_hits));
+    sample(out, "proxy_response_cache_lookups_total", "result=\"miss\"", sum(&MetricShard::cache_misses));
+
+    gauge(out, "proxy_active_connections", "Open client connections.", read_gauge(client_connections));
+    gauge(out, "proxy_accept_queue_depth", "Accepted connections not yet started by a loop.", read_gauge(accept_queue_depth));
+    gauge(out, "proxy_open_tunnels", "Established CONNECT tunnels.", open_tunnels.load());
+
+    family(out, "proxy_response_cache_bytes", "gauge", "Bytes held by the response cache.");
+    sample(out, "proxy_response_cache_bytes", "tier=\"memory\"", cache_bytes.load());
+    sample(out, "proxy_response_cache_bytes", "tier=\"disk\"", disk_cache_bytes.load());
+
+    {
+        lock_guard<mutex> lock(io_buffers_lock);
+        family(out, "proxy_io_buffer_bytes", "gauge", "Relay buffer memory.");
+        sample(out, "proxy_io_buffer_bytes", "state=\"in_use\"", io_buffers.in_use_bytes);
+        sample(out, "proxy_io_buffer_bytes", "state=\"pooled\"", io_buffers.pooled_bytes);
+    }
+    {
+        lock_guard<mutex> lock(blocking_pool_lock);
+        gauge(out, "proxy_blocking_pool_threads", "Threads of the blocking-work pool.", blocking_workers);
+    }
+    gauge(out, "proxy_blocklist_rules", "Rules in the active blocklist.", blocklist_rules.load());
+    gauge(out, "proxy_start_time_seconds", "Start time of the proxy since the Unix epoch.", start_time);
+
+    histogram(out, "proxy_request_duration_seconds", "Time from a complete request header to the end of its response.",
+              Latency::REQUEST);
+    histogram(out, "proxy_time_to_first_byte_seconds", "Time from a complete request header to the response header.",
+              Latency::FIRST_BYTE);
+    histogram(out, "proxy_upstream_connect_seconds", "Time to establish a new origin connection.", Latency::UPSTREAM_CONNECT);
+
+    return out;
 }
@@ -0,0 +1,197 @@
+#include <netdb.h>
+#include <sys/socket.h>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "resolver.h"
+#include "thread_pool.h"
+#include "global_config.h"
+#include "metrics.h"
+
+using namespace std;
+
+#define RESOLVER_SHARDS 16
+
+using Clock = chrono::steady_clock;
+
+// A connection waiting for a lookup that is already running
+struct Waiter
+{
+    EventLoop *loop;
+    ResolveCallback done;
+};
+
+struct CacheEntry
+{
+    string key;
+    bool in_flight = true;
+    bool ok = false;
+    sockaddr_in addr{};
+    Clock::time_point expires;
+    vector<Waiter> waiters;
+};
+
+// One lock per shard; lru.front() is the most recently used entry
+struct Shard
+{
+    mutex m;
+    list<CacheEntry> lru;
+    unordered_map<string, list<CacheEntry>::iterator> index;
+};
+
+static unique_ptr<ThreadPool> pool;
+static Shard shards[RESOLVER_SHARDS];
+
+void init_resolver(size_t min_threads, size_t max_threads)
+{
+    ThreadPoolOptions options;
+    options.min_workers = min_threads;
+    options.max_workers = max_threads;
+    options.target_wait = chrono::milliseconds(global_config.blocking_pool_target_wait_ms);
+    options.idle_timeout = chrono::seconds(global_config.blocking_pool_idle_sec);
+    options.report = [](const ThreadPoolStats &stats)
+    {
+        metrics_record_blocking_pool(stats.workers, stats.grown, stats.retired,
+                                     stats.wait_p50_ms, stats.wait_p90_ms, stats.wait_p99_ms);
+    };
+
+    pool.reset(new ThreadPool(options));
+}
+
+void stop_resolver()
+{
+    pool.reset(); // finishes queued lookups, then joins the threads
+
+    for (Shard &shard : shards)
+    {
+        lock_guard<mutex> lock(shard.m);
+        shard.index.clear();
+        shard.lru.clear();
+    }
+}
+
+static Shard &shard_for(const string &key)
+{
+    return shards[hash<string>()(key) % RESOLVER_SHARDS];
+}
+
+// Drops least recently used entries beyond the shard's share of dns_cache_max_entries.
+// In-flight entries are never evicted: their waiters still need the answer.
+static void evict(Shard &shard)
+{
+    size_t limit = (global_config.dns_cache_max_entries + RESOLVER_SHARDS - 1) / RESOLVER_SHARDS;
+
+    auto it = shard.lru.end();
+    while (shard.index.size() > limit && it != shard.lru.begin())
+    {
+        --it;
+        if (it->in_flight)
+            continue;
+
+        shard.index.erase(it->key);
+        it = shard.lru.erase(it);
+    }
+}
+
+static void lookup(const string &key, const string &host, int port)
+{
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    sockaddr_in addr{};
+    Clock::time_point start = Clock::now();
+    bool ok = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res) == 0;
+    Clock::time_point now = Clock::now();
+
+    if (ok)
+    {
+        memcpy(&addr, res->ai_addr, sizeof(addr));
+        freeaddrinfo(res);
+    }
+
+    metrics_record_dns_lookup(chrono::duration<double, milli>(now - start).count());
+
+    vector<Waiter> waiters;
+    Shard &shard = shard_for(key);
+    {
+        lock_guard<mutex> lock(shard.m);
+
+        auto found = shard.index.find(key);
+        if (found == shard.index.end())
+            return; // resolver shut down
+
+        CacheEntry &entry = *found->second;
+        entry.in_flight = false;
+        entry.ok = ok;
+        entry.addr = addr;
+        entry.expires = now + chrono::seconds(ok ? global_config.dns_cache_ttl_sec : global_config.dns_negative_ttl_sec);
+        waiters.swap(entry.waiters);
+
+        evict(shard);
+    }
+
+    for (Waiter &w : waiters)
+    {
+        ResolveCallback done = move(w.done);
+        w.loop->post([done, ok, addr]()
+                     { done(ok, addr); });
+    }
+}
+
+void resolve_async(EventLoop &loop, const string &host, int port, ResolveCallback done)
+{
+    string key = host + ":" + to_string(port);
+    Shard &shard = shard_for(key);
+
+    unique_lock<mutex> lock(shard.m);
+
+    auto found = shard.index.find(key);
+    if (found != shard.index.end())
+    {
+        CacheEntry &entry = *found->second;
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+
+        if (entry.in_flight)
+        {
+            entry.waiters.push_back({&loop, move(done)}); // the running lookup answers everyone
+            lock.unlock();
+
+            metrics_record_dns_hit();
+            return;
+        }
+
+        if (Clock::now() < entry.expires)
+        {
+            bool ok = entry.ok;
+            sockaddr_in addr = entry.addr;
+            lock.unlock();
+
+            metrics_record_dns_hit();
+            done(ok, addr); // already on loop's thread, no need to post
+            return;
+        }
+
+        // Expired: reuse the slot for a fresh lookup
+        entry.in_flight = true;
+        entry.waiters.push_back({&loop, move(done)});
+    }
+    else
+    {
+        shard.lru.emplace_front();
+        CacheEntry &entry = shard.lru.front();
+        entry.key = key;
+        entry.waiters.push_back({&loop, move(done)});
+        shard.index[key] = shard.lru.begin();
+    }
+
+    lock.unlock();
+
+    pool->submit([key, host, port]()
+                  { lookup(key, host, port); });
+}
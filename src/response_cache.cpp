@@ -0,0 +1,409 @@
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <cctype>
+#include <cstdlib>
+#include <unistd.h>
+#include "response_cache.h"
+#include "disk_cache.h"
+#include "metrics.h"
+
+using namespace std;
+
+#define RESPONSE_CACHE_SHARDS 16
+#define ENTRY_OVERHEAD 128 // list node, index node and bookkeeping, roughly
+
+struct CacheSlot
+{
+    string key;
+    shared_ptr<const CachedResponse> response;
+    size_t size;
+};
+
+// One lock per shard; lru.front() is the most recently used entry
+struct CacheShard
+{
+    mutex m;
+    list<CacheSlot> lru;
+    unordered_map<string, list<CacheSlot>::iterator> index;
+    size_t bytes = 0;
+};
+
+static CacheShard shards[RESPONSE_CACHE_SHARDS];
+static size_t shard_budget = 0;
+static size_t max_object = 0;
+static atomic<size_t> used_bytes{0};
+static atomic<size_t> entry_count{0};
+
+static bool iequals(string_view a, string_view b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+            return false;
+    }
+    return true;
+}
+
+static string_view trim(string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+// First value of a header in a raw header block (request or status line first); empty if absent
+static string_view header_value(string_view block, string_view name)
+{
+    size_t pos = block.find("\r\n");
+
+    while (pos != string_view::npos && pos + 2 < block.size())
+    {
+        pos += 2;
+        size_t eol = block.find("\r\n", pos);
+        string_view line = block.substr(pos, eol == string_view::npos ? string_view::npos : eol - pos);
+
+        size_t colon = line.find(':');
+        if (colon != string_view::npos && iequals(line.substr(0, colon), name))
+            return trim(line.substr(colon + 1));
+
+        pos = eol;
+    }
+
+    return string_view();
+}
+
+// Looks for a Cache-Control directive; its "=seconds" argument, if any, goes to seconds
+static bool has_directive(string_view cache_control, string_view name, long *seconds = nullptr)
+{
+    while (!cache_control.empty())
+    {
+        size_t comma = cache_control.find(',');
+        string_view item = trim(cache_control.substr(0, comma));
+        cache_control = comma == string_view::npos ? string_view() : cache_control.substr(comma + 1);
+
+        size_t eq = item.find('=');
+        if (!iequals(trim(item.substr(0, eq)), name))
+            continue;
+
+        if (seconds)
+        {
+            if (eq == string_view::npos)
+                return false;
+
+            string arg(trim(item.substr(eq + 1)));
+            if (!arg.empty() && arg.front() == '"')
+                arg = arg.substr(1, arg.size() - 2);
+
+            char *end;
+            *seconds = strtol(arg.c_str(), &end, 10);
+            return !arg.empty() && *end == '\0' && *seconds >= 0;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"); -1 if it does not parse
+static time_t parse_http_date(string_view value)
+{
+    string text(value);
+    tm parsed{};
+    const char *end = strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &parsed);
+    return end ? timegm(&parsed) : -1;
+}
+
+string response_cache_key(const HttpRequest &req)
+{
+    return req.method + " " + req.host + ":" + to_string(req.port) + req.path;
+}
+
+// Range and If-* requests get a partial or 304 answer that only fits the request that asked
+static bool has_range_or_condition(string_view block)
+{
+    size_t pos = block.find("\r\n");
+
+    while (pos != string_view::npos && pos + 2 < block.size())
+    {
+        pos += 2;
+        size_t colon = block.find(':', pos);
+        size_t eol = block.find("\r\n", pos);
+        if (colon != string_view::npos && colon < eol)
+        {
+            string_view name = block.substr(pos, colon - pos);
+            if (iequals(name, "Range") || (name.size() > 3 && iequals(name.substr(0, 3), "If-")))
+                return true;
+        }
+        pos = eol;
+    }
+    return false;
+}
+
+// Statuses that are complete answers to any GET for the key
+static bool cacheable_status(int s)
+{
+    return s == 200 || s == 203 || s == 300 || s == 301 || s == 404 || s == 410;
+}
+
+bool request_shareable(const HttpRequest &req)
+{
+    return req.method == "GET" && req.body.kind == BodyKind::NONE && header_value(req.raw_request, "Authorization").empty() &&
+           !has_range_or_condition(req.raw_request);
+}
+
+bool response_shareable(const HttpResponse &resp)
+{
+    string_view head = resp.head;
+    string_view cache_control = header_value(head, "Cache-Control");
+
+    return cacheable_status(resp.status) && !has_directive(cache_control, "no-store") && !has_directive(cache_control, "private") &&
+           header_value(head, "Set-Cookie").empty() && header_value(head, "Vary").empty();
+}
+
+static CacheShard &shard_for(const string &key)
+{
+    return shards[hash<string>()(key) % RESPONSE_CACHE_SHARDS];
+}
+
+static void publish_usage()
+{
+    metrics_record_response_cache_usage(used_bytes.load(memory_order_relaxed), entry_count.load(memory_order_relaxed));
+}
+
+static void remove_slot(CacheShard &shard, list<CacheSlot>::iterator it)
+{
+    shard.bytes -= it->size;
+    used_bytes.fetch_sub(it->size, memory_order_relaxed);
+    entry_count.fetch_sub(1, memory_order_relaxed);
+
+    shard.index.erase(it->key);
+    shard.lru.erase(it);
+}
+
+CachedResponse::~CachedResponse()
+{
+    if (fd >= 0)
+        close(fd);
+    if (!temp_path.empty())
+        unlink(temp_path.c_str());
+}
+
+void init_response_cache(size_t max_bytes, size_t max_object_bytes)
+{
+    shard_budget = max_bytes / RESPONSE_CACHE_SHARDS;
+    max_object = min(max_object_bytes, shard_budget);
+}
+
+bool response_cache_enabled()
+{
+    return shard_budget > 0 || disk_cache_enabled();
+}
+
+static bool selects(const CachedResponse &response, const HttpRequest &req)
+{
+    if (response.chunked && !req.http11)
+        return false; // HTTP/1.0 clients cannot read chunked bodies
+
+    for (const auto &selector : response.vary)
+    {
+        if (header_value(req.raw_request, selector.first) != selector.second)
+            return false;
+    }
+    return true;
+}
+
+static shared_ptr<const CachedResponse> memory_lookup(const string &key)
+{
+    if (shard_budget == 0)
+        return nullptr;
+
+    CacheShard &shard = shard_for(key);
+    lock_guard<mutex> lock(shard.m);
+
+    auto found = shard.index.find(key);
+    if (found == shard.index.end())
+        return nullptr;
+
+    auto it = found->second;
+    if (it->response->expires <= time(nullptr))
+    {
+        remove_slot(shard, it);
+        publish_usage();
+        return nullptr;
+    }
+
+    shard.lru.splice(shard.lru.begin(), shard.lru, it);
+    return it->response;
+}
+
+shared_ptr<const CachedResponse> response_cache_lookup(const HttpRequest &req)
+{
+    if (req.method != "GET")
+        return nullptr;
+
+    string_view cache_control = header_value(req.raw_request, "Cache-Control");
+    if (has_directive(cache_control, "no-cache") || has_directive(cache_control, "no-store") ||
+        iequals(header_value(req.raw_request, "Pragma"), "no-cache"))
+        return nullptr; // the client wants the origin's answer
+
+    // Memory first; large responses live on disk only
+    string key = response_cache_key(req);
+    shared_ptr<const CachedResponse> response = memory_lookup(key);
+    if (!response || !selects(*response, req))
+        response = disk_cache_enabled() ? disk_cache_lookup(key) : nullptr;
+    if (response && !selects(*response, req))
+        response = nullptr;
+
+    metrics_record_response_cache_lookup(response != nullptr);
+    return response;
+}
+
+shared_ptr<CachedResponse> response_cache_begin(const HttpRequest &req, const HttpResponse &resp)
+{
+    if (!response_cache_enabled() || req.method != "GET")
+        return nullptr;
+
+    if (has_directive(header_value(req.raw_request, "Cache-Control"), "no-store") ||
+        !header_value(req.raw_request, "Authorization").empty())
+        return nullptr;
+
+    if (!cacheable_status(resp.status))
+        return nullptr;
+
+    // Responses too large for memory go to the disk tier when their length is known up front
+    bool to_disk = resp.body.kind == BodyKind::LENGTH && resp.body.remaining > max_object;
+    if (resp.body.kind == BodyKind::UNTIL_CLOSE || (resp.body.kind == BodyKind::CHUNKED && shard_budget == 0) ||
+        (to_disk && (!disk_cache_enabled() || resp.body.remaining > disk_cache_max_object())))
+        return nullptr;
+
+    string_view head = resp.head;
+    string_view cache_control = header_value(head, "Cache-Control");
+
+    if (has_directive(cache_control, "no-store") || has_directive(cache_control, "private") ||
+        has_directive(cache_control, "no-cache") || !header_value(head, "Set-Cookie").empty())
+        return nullptr;
+
+    // Freshness must be explicit; there is no heuristic caching
+    time_t now = time(nullptr);
+    time_t expires = -1;
+    long seconds;
+
+    if (has_directive(cache_control, "s-maxage", &seconds) || has_directive(cache_control, "max-age", &seconds))
+    {
+        expires = now + seconds;
+    }
+    else if (!header_value(head, "Expires").empty())
+    {
+        time_t at = parse_http_date(header_value(head, "Expires"));
+        time_t date = parse_http_date(header_value(head, "Date"));
+        if (at >= 0)
+            expires = now + (at - (date >= 0 ? date : now)); // relative to the origin's clock
+    }
+
+    if (expires <= now)
+        return nullptr;
+
+    auto entry = to_disk ? disk_cache_new_capture() : make_shared<CachedResponse>();
+    entry->stored = now;
+    entry->expires = expires;
+    entry->chunked = resp.body.kind == BodyKind::CHUNKED;
+
+    string_view vary = header_value(head, "Vary");
+    while (!vary.empty())
+    {
+        size_t comma = vary.find(',');
+        string_view name = trim(vary.substr(0, comma));
+        vary = comma == string_view::npos ? string_view() : vary.substr(comma + 1);
+
+        if (name == "*")
+            return nullptr; // varies on something a cache cannot see
+
+        if (!name.empty())
+        {
+            string lower(name);
+            for (char &c : lower)
+                c = tolower((unsigned char)c);
+            entry->vary.emplace_back(lower, string(header_value(req.raw_request, name)));
+        }
+    }
+
+    // Age is regenerated on every hit
+    size_t pos = 0;
+    while (pos < head.size())
+    {
+        size_t eol = head.find("\r\n", pos);
+        size_t next = eol == string_view::npos ? head.size() : eol + 2;
+        string_view line = head.substr(pos, next - pos);
+
+        if (pos == 0 || !iequals(trim(line.substr(0, line.find(':'))), "Age"))
+            entry->head.append(line);
+        pos = next;
+    }
+
+    if (to_disk && !disk_cache_begin(response_cache_key(req), *entry))
+        return nullptr;
+
+    return entry;
+}
+
+bool response_cache_append(CachedResponse &entry, const char *data, size_t len)
+{
+    if (entry.on_disk)
+        return disk_cache_append(entry, data, len);
+
+    if (entry.body.size() + len > max_object)
+        return false;
+
+    entry.body.append(data, len);
+    return true;
+}
+
+void response_cache_store(const HttpRequest &req, shared_ptr<CachedResponse> entry)
+{
+    string key = response_cache_key(req);
+    if (entry->on_disk)
+    {
+        disk_cache_store(key, *entry);
+        return;
+    }
+
+    size_t size = key.size() + entry->head.size() + entry->body.size() + ENTRY_OVERHEAD;
+    for (const auto &selector : entry->vary)
+        size += selector.first.size() + selector.second.size();
+
+    if (size > shard_budget)
+        return;
+
+    size_t evicted = 0;
+    CacheShard &shard = shard_for(key);
+    {
+        lock_guard<mutex> lock(shard.m);
+
+        auto found = shard.index.find(key);
+        if (found != shard.index.end())
+            remove_slot(shard, found->second);
+
+        shard.lru.push_front({key, move(entry), size});
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += size;
+        used_bytes.fetch_add(size, memory_order_relaxed);
+        entry_count.fetch_add(1, memory_order_relaxed);
+
+        while (shard.bytes > shard_budget)
+        {
+            remove_slot(shard, prev(shard.lru.end()));
+            evicted++;
+        }
+    }
+
+    if (evicted > 0)
+        metrics_record_response_cache_evictions(evicted);
+    publish_usage();
+}
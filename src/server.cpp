@@ -3,33 +3,296 @@
 #include <cerrno>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <netinet/in.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "server.h"
-#include "thread_pool.h"
+#include "event_loop.h"
+#include "client_handler.h"
+#include "resolver.h"
 #include "task.h"
 #include "global_config.h"
+#include "metrics.h"
+#include "buffer_pool.h"
 
 using namespace std;
 
+#define CODEL_INTERVAL_MS 100
+
 static atomic<bool> running{true};
-static int server_fd = -1;
+static EventLoop *accept_loop = nullptr;
 
-void start_server(int port)
+static vector<EventLoop *> tunnel_loops; // set before any connection is accepted
+static atomic<size_t> next_tunnel_loop{0};
+
+static atomic<size_t> queued{0};   // handed to a loop, not started yet
+static string overloaded_response; // built once at startup
+
+static size_t accept_queue_depth()
+{
+    return queued.load(memory_order_relaxed);
+}
+
+// Hand-off delay tracking for the loop running on this thread
+struct HandoffDelay
+{
+    bool above_target = false;
+    chrono::steady_clock::time_point shed_after;
+};
+
+static thread_local HandoffDelay handoff_delay;
+
+// Answers with the pre-built 503 and closes; a fresh socket's send buffer always has room for it
+static void shed(int client_fd, ShedReason reason)
+{
+    send(client_fd, overloaded_response.data(), overloaded_response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(client_fd);
+    metrics_record_load_shed(reason);
+}
+
+EventLoop *tunnel_lane()
+{
+    if (tunnel_loops.empty())
+        return nullptr;
+
+    return tunnel_loops[next_tunnel_loop.fetch_add(1, memory_order_relaxed) % tunnel_loops.size()];
+}
+
+// What a loop last reported to its lane's metrics
+struct LaneSample
+{
+    Lane lane;
+    chrono::steady_clock::time_point at = chrono::steady_clock::now();
+    chrono::steady_clock::duration busy{0};
+    long connections = 0;
+};
+
+// Reports loop's busy time and connection count to its lane's metrics about once per second.
+// own_handlers: handlers on the loop that are not connections (an acceptor)
+static shared_ptr<LaneSample> report_lane(EventLoop &loop, Lane lane, size_t own_handlers)
+{
+    auto last = make_shared<LaneSample>();
+    last->lane = lane;
+
+    loop.add_periodic([&loop, lane, own_handlers, last](chrono::steady_clock::time_point now)
+                      {
+        long connections = (long)loop.handler_count() - (long)own_handlers;
+        if (connections < 0)
+            connections = 0;
+
+        auto busy = loop.busy_time();
+        metrics_record_lane(lane,
+                            chrono::duration_cast<chrono::microseconds>(busy - last->busy).count(),
+                            chrono::duration_cast<chrono::microseconds>(now - last->at).count(),
+                            connections - last->connections);
+
+        last->at = now;
+        last->busy = busy;
+        last->connections = connections; });
+
+    return last;
+}
+
+static void report_buffers(chrono::steady_clock::time_point)
+{
+    metrics_record_io_buffers(buffer_pool_stats());
+}
+
+// Limits checked by the acceptor, before a connection costs anything more than its socket
+static bool over_limit(bool handoff, ShedReason &reason)
+{
+    size_t waiting = queued.load(memory_order_relaxed);
+
+    if (global_config.max_connections > 0 &&
+        open_connection_count() + waiting >= (size_t)global_config.max_connections)
+    {
+        reason = ShedReason::CONNECTION_LIMIT;
+        return true;
+    }
+
+    if (handoff && global_config.max_accept_queue > 0 && waiting >= (size_t)global_config.max_accept_queue)
+    {
+        reason = ShedReason::QUEUE_LIMIT;
+        return true;
+    }
+
+    return false;
+}
+
+// CoDel-style: shed only once hand-offs have waited longer than the target for a whole
+// interval, so a burst is absorbed but a standing queue is not
+static bool standing_queue(chrono::steady_clock::time_point now, chrono::steady_clock::duration waited)
+{
+    if (global_config.accept_queue_target_ms <= 0 || waited < chrono::milliseconds(global_config.accept_queue_target_ms))
+    {
+        handoff_delay.above_target = false;
+        return false;
+    }
+
+    if (!handoff_delay.above_target)
+    {
+        handoff_delay.above_target = true;
+        handoff_delay.shed_after = now + chrono::milliseconds(CODEL_INTERVAL_MS);
+        return false;
+    }
+
+    return now >= handoff_delay.shed_after;
+}
+
+// Runs on the target loop's thread
+static void start_handoff(EventLoop &loop, const Task &task)
+{
+    queued.fetch_sub(1, memory_order_relaxed);
+
+    auto now = chrono::steady_clock::now();
+    auto waited = now - task.accepted;
+    metrics_record_accept_wait(chrono::duration_cast<chrono::microseconds>(waited).count());
+
+    if (standing_queue(now, waited))
+    {
+        shed(task.client_fd, ShedReason::QUEUE_DELAY);
+        return;
+    }
+
+    handle_client(loop, task);
+}
+
+// Accepts every pending connection and hands them round-robin to the worker loops, or, without
+// workers (one SO_REUSEPORT listener per loop), handles them on its own loop. On the io_uring
+// backend the kernel accepts and on_accept() receives the sockets.
+class Acceptor : public EventHandler
 {
-    ThreadPool pool(global_config.thread_pool_size); // initialize an object of ThreadPool
+public:
+    Acceptor(EventLoop &loop, int fd, vector<unique_ptr<EventLoop>> *workers)
+        : loop(loop), workers(workers), next(0)
+    {
+        channel.handler = this;
+        channel.fd = fd;
+    }
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    ~Acceptor() override
+    {
+        if (channel.fd >= 0)
+            close(channel.fd);
+    }
+
+    Channel channel;
+
+    void on_event(Channel *, uint32_t) override
+    {
+        while (running) // edge-triggered: drain the backlog until accept would block
+        {
+            sockaddr_in client_addr{};
+            socklen_t client_len = sizeof(client_addr);
+
+            int client_fd = accept4(channel.fd, (sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if (client_fd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("accept");
+                return;
+            }
+
+            admit(client_fd, client_addr);
+        }
+    }
+
+    void on_accept(Channel *, int client_fd) override
+    {
+        if (!running)
+        {
+            close(client_fd);
+            return;
+        }
+
+        // A multishot accept shares one address buffer between all its connections
+        sockaddr_in client_addr{};
+        socklen_t client_len = sizeof(client_addr);
+        getpeername(client_fd, (sockaddr *)&client_addr, &client_len);
+
+        admit(client_fd, client_addr);
+    }
+
+    void on_shutdown() override
+    {
+        loop.close_fd(channel.fd);
+        channel.fd = -1;
+        loop.detach(this);
+    }
+
+    // Registers the listener with the loop's backend
+    bool start()
+    {
+        return loop.accept_fd(&channel) || loop.add_fd(&channel, EPOLLIN | EPOLLET);
+    }
+
+private:
+    void admit(int client_fd, const sockaddr_in &client_addr)
+    {
+        ShedReason reason;
+        if (over_limit(workers != nullptr, reason))
+        {
+            shed(client_fd, reason);
+            return;
+        }
+
+        char ipbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, ipbuf, sizeof(ipbuf));
+
+        Task task;
+        task.client_fd = client_fd;
+        task.client_ip = ipbuf;
+        task.client_port = ntohs(client_addr.sin_port);
+        task.accepted = chrono::steady_clock::now();
+
+        if (!workers)
+        {
+            handle_client(loop, task); // nothing crosses threads on this path
+            return;
+        }
+
+        metrics_record_accept_queue(queued.fetch_add(1, memory_order_relaxed) + 1);
+
+        EventLoop *target = (*workers)[next++ % workers->size()].get();
+        target->post([target, task]()
+                     { start_handoff(*target, task); });
+    }
+
+    EventLoop &loop;
+    vector<unique_ptr<EventLoop>> *workers;
+    size_t next;
+};
+
+static int open_listener(int port, bool reuseport)
+{
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_fd < 0)
     {
         perror("socket");
-        return;
+        return -1;
     }
 
     int opt = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
+    if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        perror("SO_REUSEPORT");
+        close(server_fd);
+        return -1;
+    }
+
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
@@ -47,62 +310,197 @@ void start_server(int port)
     {
         perror("bind");
         close(server_fd);
-        return;
+        return -1;
     }
 
     if (listen(server_fd, SOMAXCONN) < 0)
     {
         perror("listen");
         close(server_fd);
-        return;
+        return -1;
     }
 
-    while (running) // start the main server loop
+    return server_fd;
+}
+
+// Pins worker i to the i-th CPU this process may run on; true if worker i ended up on CPU i for every i
+static bool pin_workers(vector<thread> &threads)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return false;
+
+    vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
     {
-        sockaddr_in client_addr{};
-        socklen_t client_len = sizeof(client_addr);
+        if (CPU_ISSET(cpu, &allowed))
+            cpus.push_back(cpu);
+    }
 
-        int client_fd = accept(server_fd, (sockaddr *)&client_addr, &client_len);
+    bool identity = threads.size() <= cpus.size();
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpus[i % cpus.size()], &one);
+        pthread_setaffinity_np(threads[i].native_handle(), sizeof(one), &one);
 
-        if (client_fd < 0)
-        {
-            if (!running)
-                break;
+        identity = identity && cpus[i] == (int)i;
+    }
 
-            if (errno == EINTR)
-                continue;
+    return identity;
+}
+
+// Has the kernel pick the listener by the CPU that received the connection (cpu % n),
+// which is the loop pinned to that CPU; the program applies to the whole reuseport group
+static void steer_by_cpu(int server_fd, size_t listeners)
+{
+    sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)listeners},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+
+    if (setsockopt(server_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0)
+        perror("SO_ATTACH_REUSEPORT_CBPF"); // the kernel's hash-based balancing still applies
+}
 
-            perror("accept");
-            continue;
+void start_server(int port)
+{
+    bool reuseport = global_config.reuseport_listeners;
+    int server_fd = -1;
+    vector<int> listener_fds;
+
+    if (reuseport)
+    {
+        // One listener per loop, all bound before any of them is used
+        for (int i = 0; i < global_config.thread_pool_size; ++i)
+        {
+            int fd = open_listener(port, true);
+            if (fd < 0)
+            {
+                for (int opened : listener_fds)
+                    close(opened);
+                return;
+            }
+            listener_fds.push_back(fd);
         }
+    }
+    else
+    {
+        server_fd = open_listener(port, false);
+        if (server_fd < 0)
+            return;
+    }
 
-        char ipbuf[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, ipbuf, sizeof(ipbuf));
+    string overloaded_body = "Proxy overloaded, retry later.\n";
+    overloaded_response = "HTTP/1.0 503 Service Unavailable\r\n"
+                          "Retry-After: " + to_string(global_config.overload_retry_after_sec) + "\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: " + to_string(overloaded_body.size()) + "\r\n"
+                          "Connection: close\r\n"
+                          "\r\n" + overloaded_body;
 
-        Task task;
-        task.client_fd = client_fd;
-        task.client_ip = ipbuf;
-        task.client_port = ntohs(client_addr.sin_port);
+    init_resolver(global_config.blocking_pool_size, global_config.blocking_pool_max_size);
+    metrics_watch_connections(open_connection_count);
+    metrics_watch_accept_queue(accept_queue_depth);
+
+    vector<unique_ptr<EventLoop>> workers;
+    vector<unique_ptr<EventLoop>> tunnel_workers; // CONNECT tunnels move here once established
+    vector<thread> threads;
+    vector<thread> tunnel_threads;
+    vector<shared_ptr<LaneSample>> lane_samples;
 
-        pool.enqueue(task); // add the Task to the ThreadPool Object pool
+    IoBackend backend = global_config.io_backend == "io_uring" ? IoBackend::IO_URING : IoBackend::EPOLL;
+
+    for (int i = 0; i < global_config.thread_pool_size; ++i)
+    {
+        workers.emplace_back(new EventLoop(backend));
+        lane_samples.push_back(report_lane(*workers.back(), Lane::HTTP, reuseport ? 1 : 0));
     }
 
-    if (server_fd >= 0)
+    for (int i = 0; i < global_config.tunnel_loops; ++i)
     {
-        close(server_fd);
-        server_fd = -1;
+        tunnel_workers.emplace_back(new EventLoop(backend));
+        lane_samples.push_back(report_lane(*tunnel_workers.back(), Lane::TUNNEL, 0));
+        tunnel_loops.push_back(tunnel_workers.back().get());
+    }
+
+    for (auto &worker : workers) // one event loop per worker thread
+        threads.emplace_back(&EventLoop::run, worker.get());
+    for (auto &worker : tunnel_workers)
+        tunnel_threads.emplace_back(&EventLoop::run, worker.get());
+
+    bool one_loop_per_cpu = global_config.pin_worker_threads && pin_workers(threads);
+    if (reuseport && one_loop_per_cpu)
+        steer_by_cpu(listener_fds[0], listener_fds.size());
+
+    EventLoop loop(backend);
+    loop.add_periodic(report_buffers);
+
+    if (backend == IoBackend::IO_URING && loop.backend() != backend)
+        cerr << "[WARN] io_uring is not available, using epoll" << endl;
+
+    if (reuseport)
+    {
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            EventLoop *worker = workers[i].get();
+            int fd = listener_fds[i];
+
+            // Registered from the worker's own thread, like everything else it owns
+            worker->post([worker, fd]()
+                         {
+                if (!running) // stopped before the loop got here: shutdown has already been handed out
+                {
+                    close(fd);
+                    return;
+                }
+
+                auto acceptor = make_shared<Acceptor>(*worker, fd, nullptr);
+                worker->attach(acceptor);
+                acceptor->start(); });
+        }
     }
+    else
+    {
+        auto acceptor = make_shared<Acceptor>(loop, server_fd, &workers);
+
+        loop.attach(acceptor);
+        acceptor->start();
+    }
+
+    accept_loop = &loop;
+    if (running) // start the main server loop; with reuseport it only waits for stop_server()
+        loop.run();
+    accept_loop = nullptr;
 
     cout << "[INFO] Server stopped accepting connections" << endl;
+
+    for (auto &worker : workers) // in-flight connections finish before the loops exit
+        worker->stop();
+    for (thread &t : threads)
+        t.join();
+
+    // Last, since the HTTP loops can still hand tunnels over while they drain
+    for (auto &worker : tunnel_workers)
+        worker->stop();
+    for (thread &t : tunnel_threads)
+        t.join();
+    tunnel_loops.clear();
+
+    for (auto &sample : lane_samples) // every connection is gone by now
+        metrics_record_lane(sample->lane, 0, 0, -sample->connections);
+    report_buffers(chrono::steady_clock::now());
+
+    stop_resolver();
 }
 
 void stop_server()
 {
     running = false;
 
-    if (server_fd >= 0)
-    {
-        close(server_fd);
-        server_fd = -1;
-    }
+    if (accept_loop)
+        accept_loop->stop();
 }
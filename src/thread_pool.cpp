@@ -1,53 +1,462 @@
+#include <algorithm>
 #include "thread_pool.h"
-#include "client_handler.h"
 
-ThreadPool::ThreadPool(size_t size) : stop(false)
+#define DEQUE_INITIAL_CAPACITY 64
+#define SPIN_ROUNDS 64
+#define REPORT_INTERVAL_MS 1000
+
+struct CurrentWorker
+{
+    ThreadPool *pool;
+    size_t index;
+};
+
+static thread_local CurrentWorker current = {nullptr, 0};
+
+WorkDeque::Ring::Ring(int64_t capacity) : capacity(capacity), slots(new atomic<PoolJob *>[capacity])
+{
+}
+
+WorkDeque::WorkDeque() : top(0), bottom(0)
+{
+    rings.emplace_back(new Ring(DEQUE_INITIAL_CAPACITY));
+    ring.store(rings.back().get(), memory_order_relaxed);
+}
+
+WorkDeque::Ring *WorkDeque::grow(Ring *old, int64_t t, int64_t b)
+{
+    rings.emplace_back(new Ring(old->capacity * 2));
+    Ring *bigger = rings.back().get();
+
+    for (int64_t i = t; i < b; ++i)
+        bigger->put(i, old->get(i));
+
+    ring.store(bigger, memory_order_release);
+    return bigger;
+}
+
+void WorkDeque::push(PoolJob *job)
+{
+    int64_t b = bottom.load(memory_order_relaxed);
+    int64_t t = top.load(memory_order_acquire);
+    Ring *r = ring.load(memory_order_relaxed);
+
+    if (b - t > r->capacity - 1)
+        r = grow(r, t, b);
+
+    r->put(b, job);
+    atomic_thread_fence(memory_order_release);
+    bottom.store(b + 1, memory_order_relaxed);
+}
+
+PoolJob *WorkDeque::pop()
 {
-    for (size_t i = 0; i < size; ++i) // initialize the worker threads
+    int64_t b = bottom.load(memory_order_relaxed) - 1;
+    Ring *r = ring.load(memory_order_relaxed);
+    bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = top.load(memory_order_relaxed);
+
+    if (t > b) // empty
     {
-        workers.emplace_back(&ThreadPool::worker, this);
+        bottom.store(b + 1, memory_order_relaxed);
+        return nullptr;
     }
+
+    PoolJob *job = r->get(b);
+    if (t == b) // last job: race the thieves for it
+    {
+        if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+            job = nullptr;
+        bottom.store(b + 1, memory_order_relaxed);
+    }
+
+    return job;
+}
+
+PoolJob *WorkDeque::steal()
+{
+    int64_t t = top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = bottom.load(memory_order_acquire);
+
+    if (t >= b)
+        return nullptr;
+
+    Ring *r = ring.load(memory_order_acquire);
+    PoolJob *job = r->get(t);
+
+    if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return nullptr; // another thief or the owner got it
+
+    return job;
 }
 
-void ThreadPool::worker()
+static ThreadPoolOptions fixed_size(size_t size)
 {
+    ThreadPoolOptions options;
+    options.min_workers = size;
+    options.max_workers = size;
+    return options;
+}
+
+static int64_t ticks(chrono::steady_clock::time_point t)
+{
+    return t.time_since_epoch().count();
+}
+
+ThreadPool::ThreadPool(size_t size) : ThreadPool(fixed_size(size))
+{
+}
+
+ThreadPool::ThreadPool(const ThreadPoolOptions &opts)
+    : options(opts), pending(0), next(0), spinning(0), sleeping(0), waking(false),
+      longest_wait(0), active(0), grown(0), retired(0), stop(false)
+{
+    if (options.min_workers == 0)
+        options.min_workers = 1;
+    if (options.max_workers < options.min_workers)
+        options.max_workers = options.min_workers;
+
+    for (atomic<size_t> &bucket : wait_buckets)
+        bucket = 0;
+
+    // Half the workers may spin at once, and none when there is a single CPU
+    unsigned cpus = thread::hardware_concurrency();
+    max_spinning = cpus > 1 ? (int)max<size_t>(1, options.min_workers / 2) : 0;
+
+    for (size_t i = 0; i < options.max_workers; ++i)
+        queues.emplace_back(new Worker());
+    workers.resize(options.max_workers);
+
+    {
+        lock_guard<mutex> lock(park_mutex);
+        for (size_t i = 0; i < options.min_workers; ++i) // initialize the worker threads
+            start_worker();
+        grown = 0;
+    }
+
+    if (options.max_workers > options.min_workers || options.report)
+        supervisor = thread(&ThreadPool::supervise, this);
+}
+
+void ThreadPool::start_worker()
+{
+    for (size_t i = 0; i < queues.size(); ++i)
+    {
+        if (queues[i]->running.load())
+            continue;
+
+        if (workers[i].joinable()) // the slot's previous thread retired; it no longer needs any lock
+            workers[i].join();
+
+        queues[i]->running = true;
+        workers[i] = thread(&ThreadPool::worker, this, i);
+
+        active++;
+        grown++;
+        last_grow = chrono::steady_clock::now();
+        return;
+    }
+}
+
+void ThreadPool::schedule(PoolJob *job)
+{
+    static thread_local size_t submitted = 0;
+    if (++submitted % POOL_WAIT_SAMPLE == 0) // reading the clock for every job costs more than the job hand-off
+        job->queued = chrono::steady_clock::now();
+
+    if (current.pool == this) // a job scheduling more work keeps it on its own deque
+    {
+        queues[current.index]->deque.push(job);
+    }
+    else
+    {
+        // Round-robin over the slots with a running worker; a retired slot is still stolen from
+        size_t start = next.fetch_add(1, memory_order_relaxed);
+        Worker *target = queues[start % queues.size()].get();
+        for (size_t i = 0; i < queues.size() && !target->running.load(memory_order_relaxed); ++i)
+            target = queues[(start + i) % queues.size()].get();
+
+        lock_guard<mutex> lock(target->inbox_mutex);
+        target->inbox.push_back(job);
+    }
+
+    pending.fetch_add(1, memory_order_seq_cst);
+    wake_helper();
+}
+
+// At most one signal is in flight: a spinning or just-woken worker finds the job by itself,
+// and wakes the next helper once it has work, so a burst does not become a futex storm
+void ThreadPool::wake_helper()
+{
+    if (spinning.load() > 0 || sleeping.load() == 0 || waking.load())
+        return;
+
+    lock_guard<mutex> lock(park_mutex); // sleeping and waking only change under it
+    if (sleeping.load() == 0 || waking.load())
+        return;
+
+    waking = true;
+    park.notify_one();
+}
+
+// Moves the jobs in from's inbox onto into's deque and returns one of them; a thief
+// takes only the newer half, so the owner does not have to steal its work back
+PoolJob *ThreadPool::take_inbox(Worker &from, Worker &into)
+{
+    vector<PoolJob *> &batch = into.batch;
+    {
+        unique_lock<mutex> lock(from.inbox_mutex, try_to_lock);
+        if (!lock.owns_lock() || from.inbox.empty())
+            return nullptr;
+
+        if (&from == &into || from.inbox.size() == 1 || !from.running.load(memory_order_relaxed))
+        {
+            batch.swap(from.inbox);
+        }
+        else
+        {
+            size_t keep = from.inbox.size() / 2;
+            batch.assign(from.inbox.begin() + keep, from.inbox.end());
+            from.inbox.resize(keep);
+        }
+    }
+
+    for (size_t i = 1; i < batch.size(); ++i)
+        into.deque.push(batch[i]);
+
+    PoolJob *first = batch[0];
+    batch.clear();
+    return first;
+}
+
+PoolJob *ThreadPool::find_job(size_t index)
+{
+    Worker &self = *queues[index];
+
+    if (PoolJob *job = self.deque.pop())
+        return job;
+    if (PoolJob *job = take_inbox(self, self))
+        return job;
+
+    for (size_t i = 1; i < queues.size(); ++i) // steal, starting after our own queue
+    {
+        Worker &victim = *queues[(index + i) % queues.size()];
+
+        if (PoolJob *job = victim.deque.steal())
+            return job;
+        if (PoolJob *job = take_inbox(victim, self)) // the owner may be stuck in a blocking job
+            return job;
+    }
+
+    return nullptr;
+}
+
+void ThreadPool::record_start(const PoolJob &job)
+{
+    auto now = chrono::steady_clock::now();
+    int64_t waited = ticks(now) - ticks(job.queued);
+
+    int64_t longest = longest_wait.load(memory_order_relaxed);
+    while (waited > longest && !longest_wait.compare_exchange_weak(longest, waited, memory_order_relaxed))
+        ;
+
+    uint64_t micros = chrono::duration_cast<chrono::microseconds>(now - job.queued).count();
+    size_t bucket = 0;
+    while (bucket + 1 < POOL_WAIT_BUCKETS && micros >= (1ull << bucket)) // bucket b holds waits below 2^b us
+        ++bucket;
+    wait_buckets[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+void ThreadPool::worker(size_t index)
+{
+    current = {this, index};
+    bool elastic = options.max_workers > options.min_workers;
+
     while (true)
     {
-        Task task;
+        PoolJob *job = find_job(index);
+
+        if (!job && spinning.fetch_add(1, memory_order_seq_cst) >= max_spinning)
+        {
+            spinning.fetch_sub(1, memory_order_seq_cst); // enough workers already searching
+        }
+        else if (!job)
+        {
+            for (int round = 0; round < SPIN_ROUNDS && !job; ++round)
+            {
+                this_thread::yield();
+                job = find_job(index);
+            }
+            spinning.fetch_sub(1, memory_order_seq_cst);
+        }
 
+        if (!job)
         {
-            unique_lock<mutex> lock(queue_mutex);
-            condition.wait(lock, [this]
-                           { return stop || !tasks.empty(); });
+            unique_lock<mutex> lock(park_mutex);
+            bool parked = false;
+            auto idle_until = chrono::steady_clock::now() + options.idle_timeout;
 
-            if (stop && tasks.empty())
+            sleeping.fetch_add(1);
+            while (!stop.load() && pending.load() <= 0)
+            {
+                bool timed_out = false;
+                if (elastic)
+                    timed_out = park.wait_until(lock, idle_until) == cv_status::timeout;
+                else
+                    park.wait(lock);
+
+                parked = true;
+                waking = false; // cleared before looking, so a later submission signals again
+
+                // Idle for a whole timeout, and the pool has not grown for as long: retire
+                auto now = chrono::steady_clock::now();
+                if (timed_out && pending.load() <= 0 && active > options.min_workers &&
+                    now - last_grow >= options.idle_timeout)
+                {
+                    sleeping.fetch_sub(1);
+                    queues[index]->running = false;
+                    active--;
+                    retired++;
+                    return;
+                }
+                if (timed_out)
+                    idle_until = now + options.idle_timeout;
+            }
+            sleeping.fetch_sub(1);
+
+            if (stop.load() && pending.load() <= 0)
                 return;
 
-            task = tasks.front();
-            tasks.pop();
+            // Work exists but was out of reach (an inbox locked by a submitter, a job not yet
+            // counted): let the other thread finish instead of retrying in a tight loop
+            if (!parked)
+            {
+                lock.unlock();
+                this_thread::yield();
+            }
+            continue;
         }
 
-        handle_client(task);
+        // More work than this worker: bring in a helper (submitters left it to us)
+        if (pending.fetch_sub(1, memory_order_seq_cst) > 1)
+            wake_helper();
+
+        Worker &self = *queues[index];
+        self.started.store(self.started.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        if (job->queued.time_since_epoch().count() != 0)
+            record_start(*job);
+
+        job->fn();
+        delete job;
     }
 }
 
-void ThreadPool::enqueue(Task task)
+// Adds a worker whenever a sampled job waited longer than the target since the last check, or
+// queued jobs have not been started for that long (every worker stuck in a slow job)
+void ThreadPool::supervise()
 {
+    auto tick = min(max(options.target_wait / 2, chrono::milliseconds(5)), chrono::milliseconds(100));
+    int64_t target = chrono::duration_cast<chrono::steady_clock::duration>(options.target_wait).count();
+    auto next_report = chrono::steady_clock::now() + chrono::milliseconds(REPORT_INTERVAL_MS);
+
+    size_t last_started = 0;
+    auto progress = chrono::steady_clock::now(); // last time a job was seen starting, or the queue was empty
+
+    unique_lock<mutex> lock(supervisor_mutex);
+    while (!stop.load())
     {
-        unique_lock<mutex> lock(queue_mutex);
-        tasks.push(task);
+        supervisor_cv.wait_for(lock, tick);
+        if (stop.load())
+            break;
+
+        auto now = chrono::steady_clock::now();
+        int64_t waited = longest_wait.exchange(0, memory_order_relaxed);
+
+        size_t started = 0;
+        for (auto &slot : queues)
+            started += slot->started.load(memory_order_relaxed);
+
+        if (started != last_started || pending.load() <= 0)
+            progress = now;
+        else
+            waited = max(waited, ticks(now) - ticks(progress));
+        last_started = started;
+
+        if (waited > target) // at most one worker per tick, so a burst does not overshoot
+        {
+            lock_guard<mutex> park_lock(park_mutex);
+            if (active < options.max_workers)
+                start_worker();
+        }
+
+        if (options.report && now >= next_report)
+        {
+            report();
+            next_report = now + chrono::milliseconds(REPORT_INTERVAL_MS);
+        }
     }
-    condition.notify_one();
+}
+
+void ThreadPool::report()
+{
+    size_t counts[POOL_WAIT_BUCKETS];
+    size_t total = 0;
+    for (size_t i = 0; i < POOL_WAIT_BUCKETS; ++i)
+    {
+        counts[i] = wait_buckets[i].exchange(0, memory_order_relaxed);
+        total += counts[i];
+    }
+
+    // Upper bound of the bucket holding the given fraction of the waits
+    auto percentile = [&](double fraction)
+    {
+        if (total == 0)
+            return 0.0;
+
+        size_t seen = 0;
+        for (size_t i = 0; i < POOL_WAIT_BUCKETS; ++i)
+        {
+            seen += counts[i];
+            if (seen >= fraction * total)
+                return (double)(1ull << i) / 1000.0;
+        }
+        return (double)(1ull << (POOL_WAIT_BUCKETS - 1)) / 1000.0;
+    };
+
+    ThreadPoolStats stats;
+    {
+        lock_guard<mutex> lock(park_mutex);
+        stats.workers = active;
+        stats.grown = grown;
+        stats.retired = retired;
+    }
+    stats.wait_p50_ms = percentile(0.50);
+    stats.wait_p90_ms = percentile(0.90);
+    stats.wait_p99_ms = percentile(0.99);
+
+    options.report(stats);
 }
 
 ThreadPool::~ThreadPool()
 {
     {
-        unique_lock<mutex> lock(queue_mutex);
+        lock_guard<mutex> lock(park_mutex);
         stop = true;
     }
-    condition.notify_all();
+    park.notify_all();
+
+    {
+        lock_guard<mutex> lock(supervisor_mutex);
+    }
+    supervisor_cv.notify_all();
+    if (supervisor.joinable())
+        supervisor.join();
 
     for (thread &worker : workers)
-        worker.join();
+    {
+        if (worker.joinable())
+            worker.join();
+    }
 }
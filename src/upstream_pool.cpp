@@ -0,0 +1,132 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <deque>
+#include <unordered_map>
+#include "upstream_pool.h"
+#include "global_config.h"
+#include "metrics.h"
+
+using namespace std;
+
+struct IdleSocket
+{
+    int fd;
+    chrono::steady_clock::time_point since;
+};
+
+struct LoopPool
+{
+    unordered_map<string, deque<IdleSocket>> idle; // oldest at the front
+    size_t total = 0;
+    bool registered = false;
+
+    ~LoopPool()
+    {
+        for (auto &entry : idle)
+            for (IdleSocket &s : entry.second)
+                close(s.fd);
+    }
+};
+
+static thread_local LoopPool pool;
+
+static string pool_key(const string &host, int port)
+{
+    return host + ":" + to_string(port);
+}
+
+static void expire_idle(chrono::steady_clock::time_point now)
+{
+    auto ttl = chrono::seconds(global_config.upstream_pool_idle_ttl_sec);
+
+    for (auto it = pool.idle.begin(); it != pool.idle.end();)
+    {
+        deque<IdleSocket> &sockets = it->second;
+
+        while (!sockets.empty() && now - sockets.front().since >= ttl)
+        {
+            close(sockets.front().fd);
+            sockets.pop_front();
+            pool.total--;
+        }
+
+        if (sockets.empty())
+            it = pool.idle.erase(it);
+        else
+            ++it;
+    }
+}
+
+static LoopPool &pool_for(EventLoop &loop)
+{
+    if (!pool.registered)
+    {
+        pool.registered = true;
+        loop.add_periodic(expire_idle);
+    }
+
+    return pool;
+}
+
+// An idle socket must have nothing to read; data or EOF means the origin gave up on it
+static bool still_open(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_pool_acquire(EventLoop &loop, const string &host, int port)
+{
+    LoopPool &p = pool_for(loop);
+
+    auto it = p.idle.find(pool_key(host, port));
+    if (it != p.idle.end())
+    {
+        deque<IdleSocket> &sockets = it->second;
+
+        while (!sockets.empty())
+        {
+            int fd = sockets.back().fd; // most recently used is the most likely to still be open
+            sockets.pop_back();
+            p.total--;
+
+            if (still_open(fd))
+            {
+                metrics_record_upstream_pool(true);
+                return fd;
+            }
+
+            close(fd);
+        }
+
+        p.idle.erase(it);
+    }
+
+    metrics_record_upstream_pool(false);
+    return -1;
+}
+
+void upstream_pool_release(EventLoop &loop, const string &host, int port, int fd)
+{
+    LoopPool &p = pool_for(loop);
+
+    if (p.total >= (size_t)global_config.upstream_pool_max_idle)
+    {
+        close(fd);
+        return;
+    }
+
+    deque<IdleSocket> &sockets = p.idle[pool_key(host, port)];
+
+    if (sockets.size() >= (size_t)global_config.upstream_pool_max_per_host)
+    {
+        close(sockets.front().fd); // make room by dropping the stalest socket for this host
+        sockets.pop_front();
+        p.total--;
+    }
+
+    sockets.push_back({fd, chrono::steady_clock::now()});
+    p.total++;
+}
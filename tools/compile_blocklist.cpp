@@ -0,0 +1,46 @@
+// Compiles a text blocklist into the image the proxy mmap()s at startup.
+//
+//   ./tools/compile_blocklist config/blocked_sites.txt config/blocked_sites.bin
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include "blocklist_image.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        cerr << "usage: " << argv[0] << " <blocked_sites.txt> <image>" << endl;
+        return 2;
+    }
+
+    vector<string> rules;
+    if (!read_blocklist_text(argv[1], rules))
+        return 1;
+
+    // Write next to the target and rename, so a running proxy never maps a half-written file
+    string tmp = string(argv[2]) + ".tmp";
+    if (!write_blocklist_image(rules, tmp) || rename(tmp.c_str(), argv[2]) != 0)
+    {
+        remove(tmp.c_str());
+        cerr << "[ERROR] Could not write blocklist image: " << argv[2] << endl;
+        return 1;
+    }
+
+    BlocklistImage image;
+    if (!map_blocklist_image(argv[2], image))
+    {
+        cerr << "[ERROR] Written image failed validation: " << argv[2] << endl;
+        return 1;
+    }
+
+    cout << "[INFO] Compiled " << image.header->rule_count << " rules into " << argv[2]
+         << " (" << image.size << " bytes)" << endl;
+
+    unmap_blocklist_image(image);
+    return 0;
+}